@@ -21,9 +21,18 @@ File Created: Mar 2013
 //#define BOOST_THREAD_PROVIDES_VARIADIC_THREAD
 //#define BOOST_THREAD_DONT_PROVIDE_FUTURE
 //#define BOOST_THREAD_PROVIDES_SIGNATURE_PACKAGED_TASK
+// The generic when_all() and when_any() need then() so they needn't park a thread waiting. As this changes the
+// layout of boost::future, the build defines it for everything including Boost.Thread, not just for this header.
+#ifndef BOOST_THREAD_PROVIDES_FUTURE_CONTINUATION
+#ifdef BOOST_THREAD_FUTURE_HPP
+#error boost/thread/future.hpp was included without BOOST_THREAD_PROVIDES_FUTURE_CONTINUATION, which the build must define for everything using this library
+#endif
+#define BOOST_THREAD_PROVIDES_FUTURE_CONTINUATION
+#endif
 #include "boost/asio.hpp"
 #include "boost/thread/thread.hpp"
 #include "boost/thread/future.hpp"
+#include "boost/smart_ptr/intrusive_ptr.hpp"
 
 #if BOOST_VERSION<105300
 #error I absolutely need Boost v1.53 or higher to compile (I need lock free containers).
@@ -608,95 +617,166 @@ public:
 	packaged_task &operator=(packaged_task &&o) { static_cast<Base &&>(*this)=std::move(o); return *this; }
 };
 
-/*! \class thread_pool
-\brief A very simple thread pool based on Boost.ASIO and std::thread
-*/
-class thread_pool {
-	class worker
+namespace detail {
+	//! A unit of work queued to a thread_pool. These are carved from pooled slabs, so queuing work needn't touch the heap.
+	struct TRIPLEGIT_ASYNC_FILE_IO_API thread_pool_task
 	{
-		thread_pool *pool;
-	public:
-		explicit worker(thread_pool *p) : pool(p) { }
-		void operator()()
-		{
-			pool->service.run();
-		}
+		virtual ~thread_pool_task() { }
+		virtual void operator()()=0;
+		static void *operator new(size_t size);
+		static void operator delete(void *p);
 	};
-	friend class worker;
+	template<class F> struct thread_pool_task_impl : public thread_pool_task
+	{
+		F f;
+		explicit thread_pool_task_impl(F &&_f) : f(std::move(_f)) { }
+		virtual void operator()() { f(); }
+	};
+	struct thread_pool_p;
+}
+
+/*! \class thread_pool
+\brief A work stealing thread pool based on std::thread, with a Boost.ASIO io_service for i/o completions
 
-	std::vector< std::unique_ptr<thread> > workers;
-	boost::asio::io_service service;
-	boost::asio::io_service::work working;
+Each worker has its own Chase-Lev deque. Work queued by a worker goes onto its own deque and is popped LIFO so
+it runs while still in cache, while idle workers steal FIFO from randomly chosen victims. Work queued from
+outside the pool goes onto a shared lock free queue. Workers with nothing to do sleep inside the io_service, so
+handlers posted to io_service() by backends are run by the same threads.
+*/
+class TRIPLEGIT_ASYNC_FILE_IO_API thread_pool {
+	detail::thread_pool_p *p;
+	void int_submit(detail::thread_pool_task *t);
+	thread_pool(const thread_pool &);
+	thread_pool &operator=(const thread_pool &);
 public:
 	//! Constructs a thread pool of \em no workers
-	explicit thread_pool(size_t no) : working(service)
-	{
-		workers.reserve(no);
-		for(size_t n=0; n<no; n++)
-			workers.push_back(std::unique_ptr<thread>(new thread(worker(this))));
-	}
-	~thread_pool()
+	explicit thread_pool(size_t no);
+	~thread_pool();
+	//! Returns the underlying io_service
+	boost::asio::io_service &io_service();
+	//! Sends some callable entity to the thread pool for execution, without the overhead of a future
+	template<class F> void post(F f)
 	{
-		service.stop();
-		for(auto &i : workers)
-			i->join();
+		int_submit(new detail::thread_pool_task_impl<F>(std::move(f)));
 	}
-	//! Returns the underlying io_service
-	boost::asio::io_service &io_service() { return service; }
 	//! Sends some callable entity to the thread pool for execution
 	template<class F> future<typename std::result_of<F()>::type> enqueue(F f)
 	{
 		typedef typename std::result_of<F()>::type R;
-		// Somewhat annoyingly, io_service.post() needs its parameter to be copy constructible,
-		// and packaged_task is only move constructible, so ...
+		// packaged_task is only move constructible, but the task wrapper keeps things simple if copyable, so ...
 		auto task=std::make_shared<packaged_task<R()>>(std::move(f));
-		service.post(std::bind([](std::shared_ptr<packaged_task<R()>> t) { (*t)(); }, task));
-		return task->get_future();
+		future<R> ret(task->get_future());
+		post(std::bind([](std::shared_ptr<packaged_task<R()>> t) { (*t)(); }, std::move(task)));
+		return ret;
 	}
 };
 //! Returns the process threadpool
 extern TRIPLEGIT_ASYNC_FILE_IO_API thread_pool &process_threadpool();
 
 namespace detail {
-	template<class returns_t, class future_type> inline returns_t when_all_do(std::shared_ptr<std::vector<future_type>> futures)
+	template<class returns_t, class value_type> struct when_all_state
 	{
-		boost::wait_for_all(futures->begin(), futures->end());
-		returns_t ret;
-		ret.reserve(futures->size());
-		std::for_each(futures->begin(), futures->end(), [&ret](future_type &f) { ret.push_back(std::move(f.get())); });
-		return ret;
-	}
-	template<class returns_t, class future_type> inline returns_t when_any_do(std::shared_ptr<std::vector<future_type>> futures)
+		std::atomic<size_t> togo;
+		std::vector<boost::shared_future<value_type>> ready;
+		promise<returns_t> done;
+		when_all_state(size_t no) : togo(no), ready(no) { }
+	};
+	// Called by then() in whichever thread made the future ready
+	template<class returns_t, class value_type> struct when_all_continuation
 	{
-		typename std::vector<future_type>::iterator it=boost::wait_for_any(futures->begin(), futures->end());
-		return std::make_pair(std::distance(futures->begin(), it), std::move(it->get()));
-	}
+		std::shared_ptr<when_all_state<returns_t, value_type>> state;
+		size_t idx;
+		when_all_continuation(std::shared_ptr<when_all_state<returns_t, value_type>> _state, size_t _idx) : state(std::move(_state)), idx(_idx) { }
+		template<class F> void operator()(F f) const
+		{
+			state->ready[idx]=boost::shared_future<value_type>(std::move(f)); // This might look thread unsafe, but each idx is unique
+			if(--state->togo)
+				return;
+			// Last one in, so gather the results in order. Like waiting on each in turn would, the first exception wins.
+			returns_t ret;
+			ret.reserve(state->ready.size());
+			try
+			{
+				for(auto &i : state->ready)
+					ret.push_back(i.get());
+			}
+			catch(...)
+			{
+				state->done.set_exception(boost::current_exception());
+				return;
+			}
+			state->done.set_value(std::move(ret));
+		}
+	};
+	template<class returns_t> struct when_any_state
+	{
+		std::atomic<bool> done;
+		promise<returns_t> first;
+		when_any_state() : done(false) { }
+	};
+	// Called by then() in whichever thread made the future ready
+	template<class returns_t> struct when_any_continuation
+	{
+		std::shared_ptr<when_any_state<returns_t>> state;
+		size_t idx;
+		when_any_continuation(std::shared_ptr<when_any_state<returns_t>> _state, size_t _idx) : state(std::move(_state)), idx(_idx) { }
+		template<class F> void operator()(F f) const
+		{
+			if(state->done.exchange(true))
+				return;
+			try
+			{
+				state->first.set_value(std::make_pair(idx, std::move(f.get())));
+			}
+			catch(...)
+			{
+				state->first.set_exception(boost::current_exception());
+			}
+		}
+	};
 }
-//! Returns a future vector of results from all the supplied futures
+/*! \brief Returns a future vector of results from all the supplied futures
+
+No thread is occupied while waiting. Instead a continuation is attached to each future, and whichever completes the
+last of them gathers the results in the thread which completed it.
+*/
 template <class InputIterator> inline future<std::vector<typename std::decay<decltype(((typename InputIterator::value_type *) 0)->get())>::type>> when_all(InputIterator first, InputIterator last)
 {
 	typedef typename InputIterator::value_type future_type;
 	typedef typename std::decay<decltype(((typename InputIterator::value_type *) 0)->get())>::type value_type;
 	typedef std::vector<value_type> returns_t;
 	// Take a copy of the futures supplied to us (which may invalidate them)
-	auto futures=std::make_shared<std::vector<future_type>>(std::make_move_iterator(first), std::make_move_iterator(last));
-	// Bind to my delegate and invoke
-	std::function<returns_t ()> waitforall(std::move(std::bind(&detail::when_all_do<returns_t, future_type>, futures)));
-	return process_threadpool().enqueue(std::move(waitforall));
+	std::vector<future_type> futures(std::make_move_iterator(first), std::make_move_iterator(last));
+	auto state(std::make_shared<detail::when_all_state<returns_t, value_type>>(futures.size()));
+	future<returns_t> ret(state->done.get_future());
+	if(futures.empty())
+		state->done.set_value(returns_t());
+	size_t idx=0;
+	for(auto &i : futures)
+		i.then(boost::launch::sync, detail::when_all_continuation<returns_t, value_type>(state, idx++));
+	return ret;
 }
 //! Returns a future tuple of results from all the supplied futures
 //template <typename... T> inline future<std::tuple<typename std::decay<T...>::type>> when_all(T&&... futures);
-//! Returns a future result from the first of the supplied futures
+/*! \brief Returns a future result from the first of the supplied futures
+
+No thread is occupied while waiting. Instead a continuation is attached to each future, and whichever completes
+first sets the result in the thread which completed it.
+*/
 template <class InputIterator> inline future<std::pair<size_t, typename std::decay<decltype(((typename InputIterator::value_type *) 0)->get())>::type>> when_any(InputIterator first, InputIterator last)
 {
 	typedef typename InputIterator::value_type future_type;
-	typedef typename std::decay<decltype(((typename InputIterator::value_type *) 0)->get())>::type value_type;
 	typedef std::pair<size_t, typename std::decay<decltype(((typename InputIterator::value_type *) 0)->get())>::type> returns_t;
+	if(first==last)
+		return future<returns_t>();
 	// Take a copy of the futures supplied to us (which may invalidate them)
-	auto futures=std::make_shared<std::vector<future_type>>(std::make_move_iterator(first), std::make_move_iterator(last));
-	// Bind to my delegate and invoke
-	std::function<returns_t ()> waitforall(std::move(std::bind(&detail::when_any_do<returns_t, future_type>, futures)));
-	return process_threadpool().enqueue(std::move(waitforall));
+	std::vector<future_type> futures(std::make_move_iterator(first), std::make_move_iterator(last));
+	auto state(std::make_shared<detail::when_any_state<returns_t>>());
+	future<returns_t> ret(state->first.get_future());
+	size_t idx=0;
+	for(auto &i : futures)
+		i.then(boost::launch::sync, detail::when_any_continuation<returns_t>(state, idx++));
+	return ret;
 }
 //! Returns a future result from the first of the supplied futures
 /*template <typename... T> inline future<std::pair<size_t, typename std::decay<T>::type>> when_any(T&&... futures)
@@ -709,6 +789,18 @@ class async_file_io_dispatcher_base;
 struct async_io_op;
 struct async_path_op_req;
 template<class T> struct async_data_op_req;
+struct async_batch_op_req;
+class async_op_batch;
+class async_op_plan;
+class async_op_plan_params;
+class async_io_buffer;
+struct async_map_op_req;
+class async_io_mapping;
+struct async_copy_op_req;
+struct async_sync_op_req;
+struct async_enumerate_op_req;
+class directory_entry;
+struct stat_t;
 
 namespace detail {
 
@@ -719,6 +811,11 @@ namespace detail {
 	class async_file_io_dispatcher_windows;
 	class async_file_io_dispatcher_linux;
 	class async_file_io_dispatcher_qnx;
+	struct async_file_io_dispatcher_op;
+	template<class F, size_t inline_size> class inline_function;
+	struct batch_op_function;
+	struct async_op_plan_ops;
+	struct async_op_plan_instance;
 	//! \brief May occasionally be useful to access to discover information about an open handle
 	class async_io_handle : public std::enable_shared_from_this<async_io_handle>
 	{
@@ -735,7 +832,8 @@ namespace detail {
 		std::filesystem::path _path; // guaranteed canonical
 	protected:
 		std::atomic<off_t> bytesread, byteswritten, byteswrittenatlastfsync;
-		async_io_handle(async_file_io_dispatcher_base *parent, const std::filesystem::path &path) : _parent(parent), _opened(std::chrono::system_clock::now()), _path(path), bytesread(0), byteswritten(0), byteswrittenatlastfsync(0) { }
+		size_t blocksize;
+		async_io_handle(async_file_io_dispatcher_base *parent, const std::filesystem::path &path) : _parent(parent), _opened(std::chrono::system_clock::now()), _path(path), bytesread(0), byteswritten(0), byteswrittenatlastfsync(0), blocksize(0) { }
 	public:
 		virtual ~async_io_handle() { }
 		//! Returns the parent of this io handle
@@ -752,8 +850,66 @@ namespace detail {
 		off_t write_count() const { return byteswritten; }
 		//! Returns how many bytes have been written since this handle was last fsynced.
 		off_t write_count_since_fsync() const { return byteswritten-byteswrittenatlastfsync; }
+		//! Returns the block size which OSDirect i/o on this handle is aligned to, or zero if this handle isn't OSDirect.
+		size_t block_size() const { return blocksize; }
 	};
+	typedef inline_function<std::shared_ptr<async_io_handle>(std::shared_ptr<async_io_handle>), 192> op_function;
 	struct immediate_async_ops;
+	struct async_io_buffer_header;
+	struct async_io_buffer_pool;
+	struct async_io_mapping_region;
+	struct async_io_op_state_pool;
+	TRIPLEGIT_ASYNC_FILE_IO_API void intrusive_ptr_add_ref(async_io_buffer_header *h);
+	TRIPLEGIT_ASYNC_FILE_IO_API void intrusive_ptr_release(async_io_buffer_header *h);
+
+	/*! \class async_io_op_state
+	\brief The intrusively reference counted shared state of an async_io_op, which holds its result once complete.
+
+	This presents the subset of shared_future's API which async_io_op users need, so op.h->get() works as it always did.
+	Unlike a future it is always valid, and get() simply waits for completion if the op hasn't completed yet.
+	States are carved from slabs owned by the dispatcher and go back to them when their last reference does.
+	*/
+	class TRIPLEGIT_ASYNC_FILE_IO_API async_io_op_state
+	{
+		friend class triplegit::async_io::async_file_io_dispatcher_base;
+		friend struct async_io_op_state_pool;
+		friend inline void intrusive_ptr_add_ref(const async_io_op_state *s) { s->refcount.fetch_add(1, std::memory_order_relaxed); }
+		friend inline void intrusive_ptr_release(const async_io_op_state *s) { if(1==s->refcount.fetch_sub(1, std::memory_order_acq_rel)) s->recycle(); }
+		mutable std::atomic<size_t> refcount;
+		std::atomic<int> state; // bit 0 is ready, bit 1 is someone waiting
+		unsigned shard; // The shard of the pool this was carved from
+		async_io_op_state_pool *pool;
+		async_io_op_state *next; // Next in the pool's free list
+		std::shared_ptr<async_io_handle> result;
+		exception_ptr exception;
+		void set(std::shared_ptr<async_io_handle> h, exception_ptr e);
+		void int_wait() const;
+		void recycle() const;
+		async_io_op_state() : refcount(0), state(0), shard(0), pool(nullptr), next(nullptr) { }
+		async_io_op_state(const async_io_op_state &);
+		async_io_op_state &operator=(const async_io_op_state &);
+	public:
+		//! Returns the dispatcher this op belongs to, or null if it has since been destroyed
+		std::shared_ptr<async_file_io_dispatcher_base> parent() const;
+		//! Always true. For compatibility with shared_future.
+		bool valid() const { return true; }
+		//! True if the op has completed
+		bool is_ready() const { return !!(state.load(std::memory_order_acquire) & 1); }
+		//! True if the op has completed with an exception
+		bool has_exception() const { return is_ready() && !!exception; }
+		//! True if the op has completed without an exception
+		bool has_value() const { return is_ready() && !exception; }
+		//! Blocks until the op has completed
+		void wait() const { if(!is_ready()) int_wait(); }
+		//! Blocks until the op has completed, returning its handle or rethrowing its exception
+		std::shared_ptr<async_io_handle> get() const
+		{
+			wait();
+			if(exception)
+				rethrow_exception(exception);
+			return result;
+		}
+	};
 }
 
 
@@ -788,10 +944,10 @@ enum class file_flags : size_t
 	Create=16,			//!< Open and create if doesn't exist
 	CreateOnlyIfNotExist=32, //!< Create and open only if doesn't exist
 	AutoFlush=64,		//!< Automatically initiate an asynchronous flush just before file close, and fuse both operations so both must complete for close to complete.
-	WillBeSequentiallyAccessed=128, //!< Will be exclusively either read or written sequentially. If you're exclusively writing sequentially, \em strongly consider turning on OSDirect too.
+	WillBeSequentiallyAccessed=128, //!< Will be exclusively either read or written sequentially. Sequential reads are read ahead. If you're exclusively writing sequentially, \em strongly consider turning on OSDirect too.
 	FastDirectoryEnumeration=256, //! Hold a file handle open to the containing directory of each open file (POSIX only).
 
-	OSDirect=(1<<16),	//!< Bypass the OS file buffers (only really useful for writing large files. Note you must 4Kb align everything if this is on)
+	OSDirect=(1<<16),	//!< Bypass the OS file buffers (only really useful for writing large files). I/o not aligned to the handle's block_size() is split into an aligned body and bounce buffered, read-modify-written edges, which is much slower.
 	OSSync=(1<<17)		//!< Ask the OS to not complete until the data is on the physical storage. Best used only with Direct, otherwise use AutoFlush.
 
 };
@@ -800,9 +956,52 @@ enum class async_op_flags : size_t
 {
 	None=0,					//!< No flags set
 	DetachedFuture=1,		//!< The specified completion routine may choose to not complete immediately
-	ImmediateCompletion=2	//!< Call chained completion immediately instead of scheduling for later. Make SURE your completion can not block!
+	ImmediateCompletion=2	//!< Call chained completion immediately, even from a user thread, instead of scheduling for later. Make SURE your completion can not block! Without this the first ready completion is still run by the worker which completed its precondition.
 };
 ASYNC_FILEIO_DECLARE_CLASS_ENUM_AS_BITFIELD(async_op_flags)
+enum class map_flags : size_t
+{
+	None=0,				//!< No flags set
+	Populate=1,			//!< Fault in the whole range while mapping, so the op completes only once it is all resident
+	Prefault=2,			//!< Fault in the whole range on a thread pool thread after the op completes
+	Sequential=4,		//!< The range will be accessed sequentially, so read ahead aggressively and drop pages behind
+	Random=8,			//!< The range will be accessed randomly, so don't read ahead
+	WillNeed=16			//!< Start reading the range in now
+};
+ASYNC_FILEIO_DECLARE_CLASS_ENUM_AS_BITFIELD(map_flags)
+enum class preallocate_flags : size_t
+{
+	None=0,				//!< Reserve the range, extending the file to cover it
+	KeepSize=1,			//!< Reserve the range without changing the file's size
+	ZeroRange=2			//!< Also zero the range, which the filing system may do without writing anything
+};
+ASYNC_FILEIO_DECLARE_CLASS_ENUM_AS_BITFIELD(preallocate_flags)
+enum class sync_kind : size_t
+{
+	Full=0,				//!< Data and all metadata of the whole file, as fsync()
+	Data=1,				//!< Data of the whole file and only the metadata needed to read it back, as fdatasync()
+	WriteBack=2,		//!< Start writing back the range without waiting for it, as sync_file_range(SYNC_FILE_RANGE_WRITE)
+	WriteAndWait=3		//!< Write back the range and wait for it, which does not make metadata durable
+};
+enum class metadata_flags : size_t
+{
+	None=0,				//!< No metadata
+	Dev=1,				//!< The device the item is on
+	Ino=2,				//!< The item's inode number
+	Type=4,				//!< The item's type
+	Perms=8,			//!< The item's permission bits
+	Nlink=16,			//!< How many hard links there are to the item
+	Uid=32,				//!< The owning user
+	Gid=64,				//!< The owning group
+	Size=128,			//!< The item's length in bytes
+	Allocated=256,		//!< How many bytes of storage the item occupies
+	Atime=512,			//!< When the item was last accessed
+	Mtime=1024,			//!< When the item's contents were last modified
+	Ctime=2048,			//!< When the item's metadata was last changed
+	Birthtime=4096,		//!< When the item was created, where the filing system records it
+	All=8191			//!< All of the above
+};
+ASYNC_FILEIO_DECLARE_CLASS_ENUM_AS_BITFIELD(metadata_flags)
 
 
 /*! \class async_file_io_dispatcher_base
@@ -817,6 +1016,7 @@ class TRIPLEGIT_ASYNC_FILE_IO_API async_file_io_dispatcher_base : public std::en
 	friend class detail::async_file_io_dispatcher_windows;
 	friend class detail::async_file_io_dispatcher_linux;
 	friend class detail::async_file_io_dispatcher_qnx;
+	friend struct detail::async_io_buffer_pool;
 
 	detail::async_file_io_dispatcher_base_p *p;
 	void int_add_io_handle(void *key, std::shared_ptr<detail::async_io_handle> h);
@@ -833,8 +1033,34 @@ public:
 	file_flags fileflags(file_flags flags) const;
 	//! Returns the current wait queue depth of this dispatcher
 	size_t wait_queue_depth() const;
+	/*! \brief Returns a buffer of at least \em length bytes from this dispatcher's pool, aligned and sized for OSDirect i/o.
+
+	Buffers are carved from hugepage backed arenas where the system allows, and where the backend can they are
+	registered with it so reads and writes of a single one need neither pinning nor copying by the kernel.
+	The buffer returns to the pool for reuse when the last async_io_buffer referring to it goes.
+	*/
+	async_io_buffer allocate_buffer(size_t length);
 	//! Returns the number of open items in this dispatcher
 	size_t count() const;
+	/*! \brief Returns how many fsyncs this dispatcher has issued for sync() and for flushed creations of items.
+
+	Syncs of a file, and creations of AutoFlush or OSSync items within a directory, which arrive while an fsync of that
+	file or directory is in flight all share the next one, so this may be far fewer than the syncs asked for. Only the
+	POSIX backends share fsyncs like this, elsewhere this is always zero.
+	*/
+	size_t fsync_count() const;
+	/*! \brief Sets how many idle read only file handles are kept open for reuse, zero (the default) disabling the cache.
+
+	While enabled, file() of a path already open read only with the same flags returns the handle already open, and
+	the last close() of such a handle keeps its file descriptor open for the next file() until it is among the least
+	recently used beyond \em idle, or until the process nears its limit on open files. Only the POSIX backends cache
+	handles.
+
+	Handles are shared by path, so rmfile() and rmdir() through this dispatcher forget those at or within their path,
+	and an idle file descriptor is only reused if its path still refers to the same file. A handle still in use however
+	is shared with file() of its path even if something outside this dispatcher has since replaced the file there.
+	*/
+	virtual void set_file_handle_cache(size_t idle);
 
 	typedef std::pair<bool, std::shared_ptr<detail::async_io_handle>> completion_returntype;
 	typedef completion_returntype completion_t(size_t, std::shared_ptr<detail::async_io_handle>);
@@ -872,6 +1098,14 @@ public:
 	virtual std::vector<async_io_op> sync(const std::vector<async_io_op> &ops)=0;
 	//! Asynchronously synchronises an item with physical storage once it completes
 	inline async_io_op sync(const async_io_op &req);
+	/*! \brief Asynchronously synchronises byte ranges of items with physical storage to the durability requested once they complete
+
+	Only the Full and Data kinds count as an fsync for write_count_since_fsync(). Where the platform has no
+	ranged sync, ranged kinds sync all the data of the file, and on Windows every kind is a FlushFileBuffers().
+	*/
+	virtual std::vector<async_io_op> sync(const std::vector<async_sync_op_req> &reqs)=0;
+	//! Asynchronously synchronises a byte range of an item with physical storage to the durability requested once it completes
+	inline async_io_op sync(const async_sync_op_req &req);
 	//! Asynchronously closes connections to items once they complete
 	virtual std::vector<async_io_op> close(const std::vector<async_io_op> &ops)=0;
 	//! Asynchronously closes the connection to an item once it completes
@@ -883,29 +1117,130 @@ public:
 	inline async_io_op read(const async_data_op_req<void> &req);
 	//! Asynchronously reads data from items
 	template<class T> inline std::vector<async_io_op> read(const std::vector<async_data_op_req<T>> &ops);
-	//! Asynchronously writes data to items
+	/*! \brief Asynchronously writes data to items
+
+	Writes with the same precondition whose ranges are adjacent are coalesced into a single gather write, and
+	each of their ops completes with its result.
+	*/
 	virtual std::vector<async_io_op> write(const std::vector<async_data_op_req<const void>> &ops)=0;
 	//! Asynchronously writes data to an item
 	inline async_io_op write(const async_data_op_req<const void> &req);
 	//! Asynchronously writes data to items
 	template<class T> inline std::vector<async_io_op> write(const std::vector<async_data_op_req<T>> &ops);
 
+	/*! \brief Asynchronously maps byte ranges of items into memory read only, returning futures of the mapped regions and the ops.
+
+	A mapped region stays valid for as long as an async_io_mapping refers to it, even after its item is closed, so
+	structures on disc can be traversed in place rather than copied out with read().
+	*/
+	std::pair<std::vector<future<async_io_mapping>>, std::vector<async_io_op>> map(const std::vector<async_map_op_req> &reqs);
+	//! Asynchronously maps a byte range of an item into memory read only, returning a future of the mapped region and the op.
+	inline std::pair<future<async_io_mapping>, async_io_op> map(const async_map_op_req &req);
+
+	/*! \brief Asynchronously copies byte ranges between items within the kernel where possible, completing with the handle of the destination.
+
+	Large copies proceed a chunk at a time, each a separate thread pool job, so they don't monopolise a thread.
+	*/
+	std::vector<async_io_op> copy(const std::vector<async_copy_op_req> &reqs);
+	//! Asynchronously copies a byte range between items within the kernel where possible, completing with the handle of the destination.
+	inline async_io_op copy(const async_copy_op_req &req);
+
+	/*! \brief Asynchronously enumerates batches of the entries of directories opened with file_flags::Read, returning futures of each batch and whether it filled so more entries may remain, and the ops.
+
+	Entries are read in large chunks on a thread pool thread, and each batch carries what the directory itself
+	says about its entries, so no item is stat()ed unless you ask for it with directory_entry::fetch_stat(). A
+	request which doesn't restart continues from where the last enumeration of its directory handle stopped, so
+	chaining the next batch onto the op of this one reads it while you process this one.
+	*/
+	std::pair<std::vector<future<std::pair<std::vector<directory_entry>, bool>>>, std::vector<async_io_op>> enumerate(const std::vector<async_enumerate_op_req> &reqs);
+	//! Asynchronously enumerates a batch of the entries of a directory opened with file_flags::Read, returning a future of the batch and whether it filled so more entries may remain, and the op.
+	inline std::pair<future<std::pair<std::vector<directory_entry>, bool>>, async_io_op> enumerate(const async_enumerate_op_req &req);
+
 	//! Truncates the lengths of items
 	virtual std::vector<async_io_op> truncate(const std::vector<async_io_op> &ops, const std::vector<off_t> &sizes)=0;
 	//! Truncates the length of an item
 	inline async_io_op truncate(const async_io_op &op, off_t newsize);
+	/*! \brief Reserves storage for byte ranges of items, so later writes into them needn't allocate extents or update as much metadata.
+
+	Where the system can't reserve storage, extending the file or writing zeros stands in as appropriate.
+	*/
+	virtual std::vector<async_io_op> preallocate(const std::vector<async_io_op> &ops, const std::vector<off_t> &offsets, const std::vector<off_t> &lengths, preallocate_flags mode=preallocate_flags::None)=0;
+	//! Reserves storage for a byte range of an item, so later writes into it needn't allocate extents or update as much metadata.
+	inline async_io_op preallocate(const async_io_op &op, off_t offset, off_t length, preallocate_flags mode=preallocate_flags::None);
+	/*! \brief Asynchronously fetches the metadata \em wanted of the items opened by ops once they complete, returning futures of the metadata and the ops.
+
+	More metadata than wanted may be returned where fetching it costs nothing extra, so check stat_t::have.
+	*/
+	virtual std::pair<std::vector<future<stat_t>>, std::vector<async_io_op>> stat(const std::vector<async_io_op> &ops, metadata_flags wanted=metadata_flags::All)=0;
+	//! Asynchronously fetches the metadata \em wanted of the item opened by an op once it completes, returning a future of the metadata and the op.
+	inline std::pair<future<stat_t>, async_io_op> stat(const async_io_op &op, metadata_flags wanted=metadata_flags::All);
+	/*! \brief Asynchronously fetches the metadata \em wanted of paths once their preconditions complete, returning futures of the metadata and the ops.
+
+	Symbolic links are followed. Only the metadata wanted is fetched where the system allows, and on Linux the
+	lookups are queued to the kernel, so thousands can be in flight at once without tying up the thread pool.
+	*/
+	virtual std::pair<std::vector<future<stat_t>>, std::vector<async_io_op>> stat(const std::vector<async_path_op_req> &reqs, metadata_flags wanted=metadata_flags::All)=0;
+	//! Asynchronously fetches the metadata \em wanted of a path once its precondition completes, returning a future of the metadata and the op.
+	inline std::pair<future<stat_t>, async_io_op> stat(const async_path_op_req &req, metadata_flags wanted=metadata_flags::All);
 	//! Completes each of the supplied ops when and only when the last of the supplied ops completes
 	std::vector<async_io_op> barrier(const std::vector<async_io_op> &ops);
+	/*! \brief Completes when and only when all of the supplied ops complete, passing on the handle of the first.
+
+	Unlike barrier() this costs one op however many ops are joined, so prefer it for fan-in like closing a file after
+	all its writes. If any of the ops errored, the first such error is replicated.
+	*/
+	async_io_op join(const std::vector<async_io_op> &ops);
+	/*! \brief Submits a whole DAG of ops built up in an async_op_batch in one go, returning an op for each in the order added.
+
+	This reserves the ops' ids with one atomic operation and registers them with one lock acquisition per shard, so
+	it is much cheaper to dispatch than the same ops issued through separate calls.
+	*/
+	std::vector<async_io_op> submit(const async_op_batch &batch);
+	/*! \brief Compiles a batch into a plan which can be submitted many times with different parameters.
+
+	The batch's structure and everything in it which isn't later replaced by parameters is validated once here,
+	rather than on every submission. Each op's implementation, flags and in plan dependants are worked out here
+	too, so submitting the plan just copies whatever parameters replace, then fills in and links op records.
+	*/
+	async_op_plan compile(const async_op_batch &batch);
+	//! Submits a compiled plan as is, returning an op for each in the order added to the batch it was compiled from
+	inline std::vector<async_io_op> submit(const async_op_plan &plan);
+	//! Submits a compiled plan with some of its paths, buffers, offsets and preconditions replaced, returning an op for each in the order added to the batch it was compiled from
+	std::vector<async_io_op> submit(const async_op_plan &plan, const async_op_plan_params &params);
 protected:
+	//! Blocks until every op currently in flight has completed. Backends which own completion machinery call this from their destructor.
+	void int_wait_for_ops();
 	void complete_async_op(size_t id, std::shared_ptr<detail::async_io_handle> h, exception_ptr e=exception_ptr());
 	completion_returntype invoke_user_completion(size_t id, std::shared_ptr<detail::async_io_handle> h, std::function<completion_t> callback);
-	template<class F, class... Args> std::shared_ptr<detail::async_io_handle> invoke_async_op_completions(size_t id, std::shared_ptr<detail::async_io_handle> h, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, Args...), Args... args);
+	template<class F, class... Args> std::shared_ptr<detail::async_io_handle> invoke_async_op_completions(size_t id, std::shared_ptr<detail::async_io_handle> h, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, Args...), Args &... args);
+	template<class F, class... Args> void bind_async_op(detail::op_function &boundf, size_t id, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, Args...), Args... args);
+	template<class F, class A> static std::shared_ptr<detail::async_io_handle> invoke_batch_op(const detail::batch_op_function &boundf, size_t id, std::shared_ptr<detail::async_io_handle> h, const async_batch_op_req &req);
+	template<class F, class A> void bind_plan_op(detail::batch_op_function &boundf, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, A));
+	//! Binds the implementation of one op of a batch, but not its id or arguments which it is given when run, returning the flags it needs
+	virtual async_op_flags bind_batch_op(detail::batch_op_function &boundf, const async_batch_op_req &req)=0;
+	void int_chain_async_op(detail::immediate_async_ops &immediates, detail::async_file_io_dispatcher_op *op, const async_io_op &precondition);
+	//! Registers arena \em idx of the buffer pool with the backend, returning false if it can't
+	virtual bool int_register_buffers(size_t idx, void *addr, size_t length);
+	//! Returns the index the backend registered the buffer pool arena holding all of \em addr as, or -1
+	int int_registered_buffers(const void *addr, size_t length) const;
+	//! Copies up to \em length bytes between two handles, returning how many were copied, which is zero only at the end of the source
+	virtual size_t int_copy(std::shared_ptr<detail::async_io_handle> src, off_t srcoffset, std::shared_ptr<detail::async_io_handle> dst, off_t dstoffset, size_t length)=0;
+	std::shared_ptr<detail::async_op_plan_ops> int_compile(const async_op_batch &batch);
+	std::vector<async_io_op> int_submit(detail::async_op_plan_instance &instance);
 	template<class F, class... Args> async_io_op chain_async_op(detail::immediate_async_ops &immediates, int optype, const async_io_op &precondition, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, Args...), Args... args);
+	template<class F, class... Args> async_io_op join_async_op(detail::immediate_async_ops &immediates, int optype, const std::vector<async_io_op> &preconditions, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, Args...), Args... args);
 	template<class F, class T> std::vector<async_io_op> chain_async_ops(int optype, const std::vector<async_io_op> &preconditions, const std::vector<T> &container, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, T));
 	template<class F> std::vector<async_io_op> chain_async_ops(int optype, const std::vector<async_io_op> &container, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, async_io_op));
 	template<class F> std::vector<async_io_op> chain_async_ops(int optype, const std::vector<async_path_op_req> &container, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, async_path_op_req));
 	template<class F, class T> std::vector<async_io_op> chain_async_ops(int optype, const std::vector<async_data_op_req<T>> &container, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, async_data_op_req<T>));
+	template<class F> std::vector<async_io_op> chain_coalesced_writes(const std::vector<async_data_op_req<const void>> &container, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, async_data_op_req<const void>));
 	template<class T> async_file_io_dispatcher_base::completion_returntype dobarrier(size_t id, std::shared_ptr<detail::async_io_handle> h, T);
+	completion_returntype dojoin(size_t id, std::shared_ptr<detail::async_io_handle> h, std::shared_ptr<std::vector<async_io_op>> ops);
+	completion_returntype docoalescedwrite(size_t id, std::shared_ptr<detail::async_io_handle> h, async_io_op write);
+	completion_returntype domap(size_t id, std::shared_ptr<detail::async_io_handle> h, std::pair<async_map_op_req, std::shared_ptr<promise<async_io_mapping>>> req);
+	completion_returntype docopy(size_t id, std::shared_ptr<detail::async_io_handle> h, std::shared_ptr<async_copy_op_req> req);
+	completion_returntype doenumerate(size_t id, std::shared_ptr<detail::async_io_handle> h, std::pair<async_enumerate_op_req, std::shared_ptr<promise<std::pair<std::vector<directory_entry>, bool>>>> req);
+	void docopychunk(size_t id, std::shared_ptr<async_copy_op_req> req, off_t copied);
 };
 /*! \brief Instatiates the best available async_file_io_dispatcher implementation for this system.
 
@@ -914,31 +1249,38 @@ protected:
 Note that the number of threads in the threadpool supplied is the maximum non-async op queue depth (e.g. file opens, closes etc.).
 For fast SSDs, there isn't much gain after eight-sixteen threads, so the process threadpool is set to eight by default.
 For slow hard drives, or worse, SANs, a queue depth of 64 or higher might deliver significant benefits.
+
+On Linux, io_uring is used where the kernel provides it, so reads, writes, opens, closes, fsyncs, deletes and
+directory creations do not consume threadpool threads and the queue depth is whatever the device can take.
 */
 extern TRIPLEGIT_ASYNC_FILE_IO_API std::shared_ptr<async_file_io_dispatcher_base> async_file_io_dispatcher(thread_pool &threadpool=process_threadpool(), file_flags flagsforce=file_flags::None, file_flags flagsmask=file_flags::None);
 
 /*! \struct async_io_op
 \brief A reference to an async operation
+
+This is just a pointer and an id, so it is cheap to copy and cheaper to move. Everything else lives in the
+intrusively reference counted shared state. That does not keep the parent dispatcher alive, though the
+handle an op completes with does.
 */
 struct async_io_op
 {
-	std::shared_ptr<async_file_io_dispatcher_base> parent; //!< The parent dispatcher
 	size_t id;											//!< A unique id for this operation
-	std::shared_ptr<shared_future<std::shared_ptr<detail::async_io_handle>>> h;	//!< A future handle to the item being operated upon
-
-	async_io_op() : id(0), h(std::make_shared<shared_future<std::shared_ptr<detail::async_io_handle>>>()) { }
-	async_io_op(const async_io_op &o) : parent(o.parent), id(o.id), h(o.h) { }
-	async_io_op(async_io_op &&o) : parent(std::move(o.parent)), id(std::move(o.id)), h(std::move(o.h)) { }
-	async_io_op(std::shared_ptr<async_file_io_dispatcher_base> _parent, size_t _id, std::shared_ptr<shared_future<std::shared_ptr<detail::async_io_handle>>> _handle) : parent(_parent), id(_id), h(std::move(_handle)) { _validate(); }
-	async_io_op(std::shared_ptr<async_file_io_dispatcher_base> _parent, size_t _id) : parent(_parent), id(_id), h(std::make_shared<shared_future<std::shared_ptr<detail::async_io_handle>>>()) { }
-	async_io_op &operator=(const async_io_op &o) { parent=o.parent; id=o.id; h=o.h; return *this; }
-	async_io_op &operator=(async_io_op &&o) { parent=std::move(o.parent); id=std::move(o.id); h=std::move(o.h); return *this; }
+	boost::intrusive_ptr<detail::async_io_op_state> h;	//!< The shared state of this operation, from which the handle being operated upon can be fetched
+
+	async_io_op() : id(0) { }
+	async_io_op(const async_io_op &o) : id(o.id), h(o.h) { }
+	async_io_op(async_io_op &&o) : id(o.id), h(std::move(o.h)) { }
+	async_io_op(detail::async_io_op_state *_h, size_t _id) : id(_id), h(_h) { }
+	async_io_op &operator=(const async_io_op &o) { id=o.id; h=o.h; return *this; }
+	async_io_op &operator=(async_io_op &&o) { id=o.id; h=std::move(o.h); return *this; }
+	//! Returns the parent dispatcher, or null if this op is empty or the dispatcher has since been destroyed
+	std::shared_ptr<async_file_io_dispatcher_base> parent() const { return h ? h->parent() : std::shared_ptr<async_file_io_dispatcher_base>(); }
 	//! Validates contents
 	bool validate() const
 	{
-		if(!parent || !id) return false;
-		// If h is valid and ready and contains an exception, throw it now
-		if(h->valid() && h->is_ready() /*h->wait_for(seconds(0))==future_status::ready*/)
+		if(!h || !id) return false;
+		// If h is ready and contains an exception, throw it now
+		if(h->is_ready())
 			h->get();
 		return true;
 	}
@@ -958,6 +1300,7 @@ namespace detail
 	{
 		std::atomic<size_t> togo;
 		std::vector<std::shared_ptr<detail::async_io_handle>> out;
+		std::vector<boost::intrusive_ptr<detail::async_io_op_state>> insharedstates;
 		promise<std::vector<std::shared_ptr<detail::async_io_handle>>> done;
 		when_all_count_completed_state(size_t outsize) : togo(outsize), out(outsize) { }
 	};
@@ -976,8 +1319,8 @@ namespace detail
 			bool done=false;
 			try
 			{
-				for(auto &i : state->out)
-					i.get();
+				for(auto &i : state->insharedstates)
+					i->get();
 			}
 			catch(...)
 			{
@@ -1004,7 +1347,7 @@ inline future<std::vector<std::shared_ptr<detail::async_io_handle>>> when_all(st
 	size_t idx=0;
 	for(auto &i : inputs)
 		callbacks.push_back(std::make_pair(async_op_flags::ImmediateCompletion, std::bind(&detail::when_all_count_completed_nothrow, std::placeholders::_1, std::placeholders::_2, state, idx++)));
-	inputs.front().parent->completion(inputs, callbacks);
+	inputs.front().parent()->completion(inputs, callbacks);
 	return state->done.get_future();
 }
 //! \brief Convenience overload for a vector of async_io_op. Retrieves exceptions.
@@ -1013,13 +1356,20 @@ inline future<std::vector<std::shared_ptr<detail::async_io_handle>>> when_all(st
 	if(first==last)
 		return future<std::vector<std::shared_ptr<detail::async_io_handle>>>();
 	std::vector<async_io_op> inputs(first, last);
+	// Anything which has already failed can be rethrown right now
+	for(auto &i : inputs)
+		if(i.h->has_exception())
+			i.h->get();
 	auto state(std::make_shared<detail::when_all_count_completed_state>(inputs.size()));
+	state->insharedstates.reserve(inputs.size());
+	for(auto &i : inputs)
+		state->insharedstates.push_back(i.h);
 	std::vector<std::pair<async_op_flags, std::function<async_file_io_dispatcher_base::completion_t>>> callbacks;
 	callbacks.reserve(inputs.size());
 	size_t idx=0;
 	for(auto &i : inputs)
 		callbacks.push_back(std::make_pair(async_op_flags::ImmediateCompletion, std::bind(&detail::when_all_count_completed, std::placeholders::_1, std::placeholders::_2, state, idx++)));
-	inputs.front().parent->completion(inputs, callbacks);
+	inputs.front().parent()->completion(inputs, callbacks);
 	return state->done.get_future();
 }
 //! \brief Convenience overload for a list of async_io_op.  Does not retrieve exceptions.
@@ -1055,6 +1405,10 @@ inline future<std::vector<std::shared_ptr<detail::async_io_handle>>> when_all(as
 
 /*! \struct async_path_op_req
 \brief A convenience bundle of path and flags, with optional precondition
+
+A request made by relative() holds a relative path, which is looked up relative to the directory its
+precondition opened or created. On POSIX that is done with the openat() family of calls, which saves the
+kernel walking every component of a long path each time.
 */
 struct async_path_op_req
 {
@@ -1062,6 +1416,10 @@ struct async_path_op_req
 	file_flags flags;
 	async_io_op precondition;
 	async_path_op_req() : flags(file_flags::None) { }
+	//! Constructs a request for _path relative to the directory opened or created by _dir, which becomes its precondition. absolute() is not called.
+	static async_path_op_req relative(async_io_op _dir, std::filesystem::path _path, file_flags _flags=file_flags::None) { return async_path_op_req(std::move(_dir), std::move(_path), _flags, 0); }
+	//! True if path is relative to the directory of the precondition
+	bool is_relative() const { return !path.empty() && !path.is_absolute(); }
 	//! Fails is path is not absolute
 	async_path_op_req(std::filesystem::path _path, file_flags _flags=file_flags::None) : path(_path), flags(_flags) { if(!path.is_absolute()) throw std::runtime_error("Non-absolute path"); }
 	//! Fails is path is not absolute
@@ -1078,9 +1436,11 @@ struct async_path_op_req
 	bool validate() const
 	{
 		if(path.empty()) return false;
+		if(is_relative() && !precondition.id) return false;
 		return !precondition.id || precondition.validate();
 	}
 private:
+	async_path_op_req(async_io_op _dir, std::filesystem::path _path, file_flags _flags, int) : path(std::move(_path)), flags(_flags), precondition(std::move(_dir)) { _validate(); }
 	void _validate() const
 	{
 #if TRIPLEGIT_VALIDATE_INPUTS
@@ -1113,10 +1473,13 @@ template<> struct async_data_op_req<void> // For reading
 		for(auto &b : buffers)
 		{
 			if(!boost::asio::buffer_cast<const void *>(b) || !boost::asio::buffer_size(b)) return false;
-			if(!!(precondition.parent->fileflags(file_flags::None)&file_flags::OSDirect))
+#ifdef WIN32
+			// Only the POSIX backends bounce buffer unaligned OSDirect i/o
+			if(!!(precondition.parent()->fileflags(file_flags::None)&file_flags::OSDirect))
 			{
 				if(((size_t)boost::asio::buffer_cast<const void *>(b) & 4095) || (boost::asio::buffer_size(b) & 4095)) return false;
 			}
+#endif
 		}
 		return true;
 	}
@@ -1151,10 +1514,13 @@ template<> struct async_data_op_req<const void> // For writing
 		for(auto &b : buffers)
 		{
 			if(!boost::asio::buffer_cast<const void *>(b) || !boost::asio::buffer_size(b)) return false;
-			if(!!(precondition.parent->fileflags(file_flags::None)&file_flags::OSDirect))
+#ifdef WIN32
+			// Only the POSIX backends bounce buffer unaligned OSDirect i/o
+			if(!!(precondition.parent()->fileflags(file_flags::None)&file_flags::OSDirect))
 			{
 				if(((size_t)boost::asio::buffer_cast<const void *>(b) & 4095) || (boost::asio::buffer_size(b) & 4095)) return false;
 			}
+#endif
 		}
 		return true;
 	}
@@ -1252,6 +1618,402 @@ template<class C, class T, class A> struct async_data_op_req<const std::basic_st
 	async_data_op_req(async_io_op _precondition, const std::basic_string<C, T, A> &v, off_t _where) : async_data_op_req<const void>(std::move(_precondition), static_cast<const void *>(&v.front()), v.size()*sizeof(A), _where) { }
 };
 
+/*! \class async_io_buffer
+\brief A reference to a buffer from async_file_io_dispatcher_base::allocate_buffer(), which returns to its pool when the last reference goes.
+
+As with any other buffer, keep a reference until every op reading or writing it has completed.
+*/
+class async_io_buffer
+{
+	friend struct detail::async_io_buffer_pool;
+	boost::intrusive_ptr<detail::async_io_buffer_header> h;
+	void *_data;
+	size_t _size;
+public:
+	async_io_buffer() : _data(nullptr), _size(0) { }
+	//! Returns the start of the buffer, which is aligned to at least 4Kb
+	void *data() const { return _data; }
+	//! Returns the length of the buffer, which is a multiple of 4Kb
+	size_t size() const { return _size; }
+};
+//! \brief A specialisation for async_io_buffer
+template<> struct async_data_op_req<async_io_buffer> : public async_data_op_req<void>
+{
+	async_data_op_req() { }
+	async_data_op_req(const async_data_op_req &o) : async_data_op_req<void>(o) { }
+	async_data_op_req(async_data_op_req &&o) : async_data_op_req<void>(std::move(o)) { }
+	async_data_op_req &operator=(const async_data_op_req &o) { static_cast<async_data_op_req<void>>(*this)=o; return *this; }
+	async_data_op_req &operator=(async_data_op_req &&o) { static_cast<async_data_op_req<void>>(*this)=std::move(o); return *this; }
+	async_data_op_req(async_io_op _precondition, const async_io_buffer &v, off_t _where) : async_data_op_req<void>(std::move(_precondition), v.data(), v.size(), _where) { }
+};
+template<> struct async_data_op_req<const async_io_buffer> : public async_data_op_req<const void>
+{
+	async_data_op_req() { }
+	async_data_op_req(const async_data_op_req &o) : async_data_op_req<const void>(o) { }
+	async_data_op_req(async_data_op_req &&o) : async_data_op_req<const void>(std::move(o)) { }
+	async_data_op_req(const async_data_op_req<async_io_buffer> &o) : async_data_op_req<const void>(o) { }
+	async_data_op_req(async_data_op_req<async_io_buffer> &&o) : async_data_op_req<const void>(std::move(o)) { }
+	async_data_op_req &operator=(const async_data_op_req &o) { static_cast<async_data_op_req<const void>>(*this)=o; return *this; }
+	async_data_op_req &operator=(async_data_op_req &&o) { static_cast<async_data_op_req<const void>>(*this)=std::move(o); return *this; }
+	async_data_op_req(async_io_op _precondition, const async_io_buffer &v, off_t _where) : async_data_op_req<const void>(std::move(_precondition), static_cast<const void *>(v.data()), v.size(), _where) { }
+};
+
+/*! \struct async_map_op_req
+\brief A convenience bundle of precondition, byte range and hints for mapping part of a file.
+*/
+struct async_map_op_req
+{
+	async_io_op precondition;
+	off_t where;
+	size_t length;	//!< Zero maps from where to the end of the file as it is when mapped
+	map_flags flags;
+	async_map_op_req() : where(0), length(0), flags(map_flags::None) { }
+	async_map_op_req(async_io_op _precondition, off_t _where=0, size_t _length=0, map_flags _flags=map_flags::None) : precondition(std::move(_precondition)), where(_where), length(_length), flags(_flags) { _validate(); }
+	//! Validates contents
+	bool validate() const
+	{
+		if(!precondition.validate()) return false;
+		if(!!(flags & map_flags::Sequential) && !!(flags & map_flags::Random)) return false;
+		return true;
+	}
+private:
+	void _validate() const
+	{
+#if TRIPLEGIT_VALIDATE_INPUTS
+		if(!validate())
+			throw std::runtime_error("Inputs are invalid.");
+#endif
+	}
+};
+/*! \struct async_copy_op_req
+\brief A convenience bundle of source and destination preconditions and byte ranges for copying between files.
+*/
+struct async_copy_op_req
+{
+	async_io_op src, dst;
+	off_t srcoffset, dstoffset, length;
+	async_copy_op_req() : srcoffset(0), dstoffset(0), length(0) { }
+	async_copy_op_req(async_io_op _src, async_io_op _dst, off_t _srcoffset, off_t _dstoffset, off_t _length) : src(std::move(_src)), dst(std::move(_dst)), srcoffset(_srcoffset), dstoffset(_dstoffset), length(_length) { _validate(); }
+	//! Validates contents
+	bool validate() const
+	{
+		if(!src.validate() || !dst.validate()) return false;
+		if(!length) return false;
+		return true;
+	}
+private:
+	void _validate() const
+	{
+#if TRIPLEGIT_VALIDATE_INPUTS
+		if(!validate())
+			throw std::runtime_error("Inputs are invalid.");
+#endif
+	}
+};
+/*! \struct async_enumerate_op_req
+\brief A convenience bundle of an open directory precondition, how many entries to return at most and which of them to return.
+*/
+struct async_enumerate_op_req
+{
+	async_io_op precondition;
+	size_t maxitems;
+	bool restart;	//!< Whether to start from the first entry rather than from where the last enumeration of this directory handle stopped
+	std::function<bool(const directory_entry &)> filter;	//!< If set, only entries for which this returns true are returned. Called from a thread pool thread.
+	async_enumerate_op_req() : maxitems(0), restart(true) { }
+	async_enumerate_op_req(async_io_op _precondition, std::function<bool(const directory_entry &)> _filter=std::function<bool(const directory_entry &)>(), size_t _maxitems=4096, bool _restart=true) : precondition(std::move(_precondition)), maxitems(_maxitems), restart(_restart), filter(std::move(_filter)) { _validate(); }
+	//! Validates contents
+	bool validate() const
+	{
+		if(!precondition.validate()) return false;
+		if(!maxitems) return false;
+		return true;
+	}
+private:
+	void _validate() const
+	{
+#if TRIPLEGIT_VALIDATE_INPUTS
+		if(!validate())
+			throw std::runtime_error("Inputs are invalid.");
+#endif
+	}
+};
+/*! \struct async_sync_op_req
+\brief A convenience bundle of a precondition, a byte range and how durable to make it. A length of zero means to the end of the file.
+*/
+struct async_sync_op_req
+{
+	async_io_op precondition;
+	sync_kind kind;
+	off_t offset, length;
+	async_sync_op_req() : kind(sync_kind::Full), offset(0), length(0) { }
+	async_sync_op_req(async_io_op _precondition, sync_kind _kind, off_t _offset=0, off_t _length=0) : precondition(std::move(_precondition)), kind(_kind), offset(_offset), length(_length) { _validate(); }
+	//! Validates contents
+	bool validate() const
+	{
+		if(!precondition.validate()) return false;
+		return true;
+	}
+private:
+	void _validate() const
+	{
+#if TRIPLEGIT_VALIDATE_INPUTS
+		if(!validate())
+			throw std::runtime_error("Inputs are invalid.");
+#endif
+	}
+};
+/*! \class async_io_mapping
+\brief A reference to a read only mapped byte range of a file from async_file_io_dispatcher_base::map(), which is unmapped when the last reference goes.
+*/
+class async_io_mapping
+{
+	friend class async_file_io_dispatcher_base;
+	std::shared_ptr<detail::async_io_mapping_region> region;
+	const void *_data;
+	size_t _size;
+	off_t _where;
+public:
+	async_io_mapping() : _data(nullptr), _size(0), _where(0) { }
+	//! Returns the first byte mapped
+	const void *data() const { return _data; }
+	//! Returns how many bytes were mapped
+	size_t size() const { return _size; }
+	//! Returns the offset into the file of the first byte mapped
+	off_t where() const { return _where; }
+};
+
+/*! \struct stat_t
+\brief The metadata of an item. Only the members named by \em have are filled in.
+*/
+struct stat_t
+{
+	unsigned long long dev, ino;
+	std::filesystem::file_type type;
+	unsigned perms;
+	unsigned nlink, uid, gid;
+	off_t size, allocated;
+	std::chrono::system_clock::time_point atim, mtim, ctim, birthtim;
+	metadata_flags have;
+	stat_t() : dev(0), ino(0), type(std::filesystem::type_unknown), perms(0), nlink(0), uid(0), gid(0), size(0), allocated(0), have(metadata_flags::None) { }
+};
+
+/*! \class directory_entry
+\brief An entry of a directory as returned by async_file_io_dispatcher_base::enumerate().
+*/
+class TRIPLEGIT_ASYNC_FILE_IO_API directory_entry
+{
+	std::filesystem::path leafname;
+	stat_t stat;
+public:
+	directory_entry() { }
+	directory_entry(std::filesystem::path _leafname, unsigned long long ino, std::filesystem::file_type type) : leafname(std::move(_leafname))
+	{
+		stat.ino=ino;
+		stat.type=type;
+		if(ino)
+			stat.have=stat.have|metadata_flags::Ino;
+		if(std::filesystem::type_unknown!=type)
+			stat.have=stat.have|metadata_flags::Type;
+	}
+	//! Returns the name of the entry within its directory
+	const std::filesystem::path &name() const { return leafname; }
+	//! Returns the entry's inode number, or zero if the platform doesn't say
+	unsigned long long inode() const { return stat.ino; }
+	//! Returns the entry's type, or type_unknown if the filing system didn't say when it was enumerated
+	std::filesystem::file_type type() const { return stat.type; }
+	//! Returns which metadata is known without fetching it
+	metadata_flags have_metadata() const { return stat.have; }
+	/*! \brief Returns the entry's metadata, fetching whichever of \em wanted isn't known yet from the directory \em dirh it was enumerated from.
+
+	Symbolic links are not followed. This blocks the calling thread, so prefer calling it from a thread pool thread.
+	*/
+	const stat_t &fetch_stat(std::shared_ptr<detail::async_io_handle> dirh, metadata_flags wanted=metadata_flags::All);
+};
+
+/*! \struct async_batch_op_req
+\brief One op in an async_op_batch. You shouldn't need to construct these yourself.
+*/
+struct async_batch_op_req
+{
+	//! The kinds of op a batch can contain
+	enum class op_kind
+	{
+		dir,
+		rmdir,
+		file,
+		rmfile,
+		sync,
+		close,
+		read,
+		write,
+		truncate
+	};
+	op_kind kind;
+	size_t precondition;	//!< The index of an earlier op in the same batch to use as precondition, or npos to use the precondition below
+	async_path_op_req path;	//!< For dir, rmdir, file and rmfile
+	async_data_op_req<void> readreq;	//!< For read
+	async_data_op_req<const void> writereq;	//!< For write
+	async_io_op op;			//!< For sync, close and truncate
+	off_t newsize;			//!< For truncate
+	static const size_t npos=(size_t) -1;
+	async_batch_op_req(op_kind _kind, size_t _precondition) : kind(_kind), precondition(_precondition), newsize(0) { }
+};
+
+/*! \class async_op_batch
+\brief Accumulates a whole DAG of ops client side so async_file_io_dispatcher_base::submit() can dispatch it in one go.
+
+Each op added returns its index within the batch. Later ops may use that index as their precondition instead of an
+async_io_op, so for example open, write, close and delete of a file can all be described before any of them exists.
+*/
+class async_op_batch
+{
+	std::vector<async_batch_op_req> ops;
+	size_t add(async_batch_op_req &&req)
+	{
+		if(req.precondition!=async_batch_op_req::npos && req.precondition>=ops.size())
+			throw std::runtime_error("Batch precondition must be an earlier op in the same batch.");
+		ops.push_back(std::move(req));
+		return ops.size()-1;
+	}
+	size_t add_path(async_batch_op_req::op_kind kind, async_path_op_req req, size_t precondition)
+	{
+		async_batch_op_req r(kind, precondition);
+		r.path=std::move(req);
+		return add(std::move(r));
+	}
+	size_t add_op(async_batch_op_req::op_kind kind, async_io_op op, size_t precondition)
+	{
+		async_batch_op_req r(kind, precondition);
+		r.op=std::move(op);
+		return add(std::move(r));
+	}
+public:
+	//! Reserves space for \em no ops
+	void reserve(size_t no) { ops.reserve(no); }
+	//! Returns the number of ops in the batch
+	size_t size() const { return ops.size(); }
+	//! True if the batch is empty
+	bool empty() const { return ops.empty(); }
+	//! Returns the op at \em idx
+	const async_batch_op_req &operator[](size_t idx) const { return ops[idx]; }
+
+	//! Adds creating a directory, after the batch op at \em precondition if not npos. Returns its index.
+	size_t dir(async_path_op_req req, size_t precondition=async_batch_op_req::npos) { return add_path(async_batch_op_req::op_kind::dir, std::move(req), precondition); }
+	//! Adds deleting a directory, after the batch op at \em precondition if not npos. Returns its index.
+	size_t rmdir(async_path_op_req req, size_t precondition=async_batch_op_req::npos) { return add_path(async_batch_op_req::op_kind::rmdir, std::move(req), precondition); }
+	//! Adds opening or creating a file, after the batch op at \em precondition if not npos. Returns its index.
+	size_t file(async_path_op_req req, size_t precondition=async_batch_op_req::npos) { return add_path(async_batch_op_req::op_kind::file, std::move(req), precondition); }
+	//! Adds deleting a file, after the batch op at \em precondition if not npos. Returns its index.
+	size_t rmfile(async_path_op_req req, size_t precondition=async_batch_op_req::npos) { return add_path(async_batch_op_req::op_kind::rmfile, std::move(req), precondition); }
+	//! Adds syncing the item opened by the batch op at \em precondition. Returns its index.
+	size_t sync(size_t precondition) { return add_op(async_batch_op_req::op_kind::sync, async_io_op(), precondition); }
+	//! Adds syncing the item opened by \em op. Returns its index.
+	size_t sync(async_io_op op) { return add_op(async_batch_op_req::op_kind::sync, std::move(op), async_batch_op_req::npos); }
+	//! Adds closing the item opened by the batch op at \em precondition. Returns its index.
+	size_t close(size_t precondition) { return add_op(async_batch_op_req::op_kind::close, async_io_op(), precondition); }
+	//! Adds closing the item opened by \em op. Returns its index.
+	size_t close(async_io_op op) { return add_op(async_batch_op_req::op_kind::close, std::move(op), async_batch_op_req::npos); }
+	//! Adds reading into \em buffers at \em where from the item opened by the batch op at \em precondition. Returns its index.
+	size_t read(size_t precondition, std::vector<boost::asio::mutable_buffer> buffers, off_t where)
+	{
+		async_batch_op_req r(async_batch_op_req::op_kind::read, precondition);
+		r.readreq.buffers=std::move(buffers);
+		r.readreq.where=where;
+		return add(std::move(r));
+	}
+	//! Adds reading into \em buffer at \em where from the item opened by the batch op at \em precondition. Returns its index.
+	size_t read(size_t precondition, void *buffer, size_t length, off_t where) { return read(precondition, std::vector<boost::asio::mutable_buffer>(1, boost::asio::mutable_buffer(buffer, length)), where); }
+	//! Adds a read. Returns its index.
+	size_t read(async_data_op_req<void> req)
+	{
+		async_batch_op_req r(async_batch_op_req::op_kind::read, async_batch_op_req::npos);
+		r.readreq=std::move(req);
+		return add(std::move(r));
+	}
+	//! Adds writing \em buffers at \em where to the item opened by the batch op at \em precondition. Returns its index.
+	size_t write(size_t precondition, std::vector<boost::asio::const_buffer> buffers, off_t where)
+	{
+		async_batch_op_req r(async_batch_op_req::op_kind::write, precondition);
+		r.writereq.buffers=std::move(buffers);
+		r.writereq.where=where;
+		return add(std::move(r));
+	}
+	//! Adds writing \em buffer at \em where to the item opened by the batch op at \em precondition. Returns its index.
+	size_t write(size_t precondition, const void *buffer, size_t length, off_t where) { return write(precondition, std::vector<boost::asio::const_buffer>(1, boost::asio::const_buffer(buffer, length)), where); }
+	//! Adds a write. Returns its index.
+	size_t write(async_data_op_req<const void> req)
+	{
+		async_batch_op_req r(async_batch_op_req::op_kind::write, async_batch_op_req::npos);
+		r.writereq=std::move(req);
+		return add(std::move(r));
+	}
+	//! Adds truncating the item opened by the batch op at \em precondition. Returns its index.
+	size_t truncate(size_t precondition, off_t newsize)
+	{
+		async_batch_op_req r(async_batch_op_req::op_kind::truncate, precondition);
+		r.newsize=newsize;
+		return add(std::move(r));
+	}
+	//! Adds truncating the item opened by \em op. Returns its index.
+	size_t truncate(async_io_op op, off_t newsize)
+	{
+		async_batch_op_req r(async_batch_op_req::op_kind::truncate, async_batch_op_req::npos);
+		r.op=std::move(op);
+		r.newsize=newsize;
+		return add(std::move(r));
+	}
+};
+
+/*! \class async_op_plan
+\brief An async_op_batch compiled by async_file_io_dispatcher_base::compile() for submitting many times.
+
+Use async_op_plan_params to replace any op's path, buffers, offset or external precondition per submission, so the
+batch compiled need only contain placeholders for them.
+*/
+class async_op_plan
+{
+	friend class async_file_io_dispatcher_base;
+	std::weak_ptr<const async_file_io_dispatcher_base> parent;
+	std::shared_ptr<const detail::async_op_plan_ops> ops;
+	size_t no;
+public:
+	async_op_plan() : no(0) { }
+	//! Returns the number of ops in the plan
+	size_t size() const { return no; }
+};
+
+/*! \class async_op_plan_params
+\brief The parameters to replace in an async_op_plan for one submission. Anything not set keeps its compiled value.
+*/
+class async_op_plan_params
+{
+	friend class async_file_io_dispatcher_base;
+	std::vector<std::pair<size_t, std::filesystem::path>> paths;
+	std::vector<std::pair<size_t, std::vector<boost::asio::mutable_buffer>>> readbuffers;
+	std::vector<std::pair<size_t, std::vector<boost::asio::const_buffer>>> writebuffers;
+	std::vector<std::pair<size_t, off_t>> offsets;
+	std::vector<std::pair<size_t, async_io_op>> preconditions;
+public:
+	//! Replaces the path of the op at \em idx. Fails if path is not absolute.
+	async_op_plan_params &path(size_t idx, std::filesystem::path path) { if(!path.is_absolute()) throw std::runtime_error("Non-absolute path"); paths.push_back(std::make_pair(idx, std::move(path))); return *this; }
+	//! Replaces the path of the op at \em idx. make_preferred() and absolute() are called in this case.
+	async_op_plan_params &path(size_t idx, const std::string &path) { return this->path(idx, std::filesystem::absolute(std::filesystem::path(path).make_preferred())); }
+	//! Replaces the path of the op at \em idx. make_preferred() and absolute() are called in this case.
+	async_op_plan_params &path(size_t idx, const char *path) { return this->path(idx, std::filesystem::absolute(std::filesystem::path(path).make_preferred())); }
+	//! Replaces the buffers read into by the op at \em idx
+	async_op_plan_params &read_buffers(size_t idx, std::vector<boost::asio::mutable_buffer> buffers) { readbuffers.push_back(std::make_pair(idx, std::move(buffers))); return *this; }
+	//! Replaces the buffer read into by the op at \em idx
+	async_op_plan_params &read_buffer(size_t idx, void *buffer, size_t length) { return read_buffers(idx, std::vector<boost::asio::mutable_buffer>(1, boost::asio::mutable_buffer(buffer, length))); }
+	//! Replaces the buffers written by the op at \em idx
+	async_op_plan_params &write_buffers(size_t idx, std::vector<boost::asio::const_buffer> buffers) { writebuffers.push_back(std::make_pair(idx, std::move(buffers))); return *this; }
+	//! Replaces the buffer written by the op at \em idx
+	async_op_plan_params &write_buffer(size_t idx, const void *buffer, size_t length) { return write_buffers(idx, std::vector<boost::asio::const_buffer>(1, boost::asio::const_buffer(buffer, length))); }
+	//! Replaces the offset read or written at by the op at \em idx, or the size truncated to
+	async_op_plan_params &offset(size_t idx, off_t offset) { offsets.push_back(std::make_pair(idx, offset)); return *this; }
+	//! Replaces the precondition of the op at \em idx, which must not have one within the plan
+	async_op_plan_params &precondition(size_t idx, async_io_op op) { preconditions.push_back(std::make_pair(idx, std::move(op))); return *this; }
+};
+
 namespace detail {
 	template<bool isconst> struct void_type_selector { typedef void type; };
 	template<> struct void_type_selector<true> { typedef const void type; };
@@ -1346,6 +2108,13 @@ inline async_io_op async_file_io_dispatcher_base::sync(const async_io_op &req)
 	i.push_back(req);
 	return std::move(sync(i).front());
 }
+inline async_io_op async_file_io_dispatcher_base::sync(const async_sync_op_req &req)
+{
+	std::vector<async_sync_op_req> i;
+	i.reserve(1);
+	i.push_back(req);
+	return std::move(sync(i).front());
+}
 inline async_io_op async_file_io_dispatcher_base::close(const async_io_op &req)
 {
 	std::vector<async_io_op> i;
@@ -1375,6 +2144,33 @@ template<class T> inline std::vector<async_io_op> async_file_io_dispatcher_base:
 {
 	return write(detail::async_file_io_dispatcher_rwconverter<T>()(ops));
 }
+inline std::vector<async_io_op> async_file_io_dispatcher_base::submit(const async_op_plan &plan)
+{
+	return submit(plan, async_op_plan_params());
+}
+inline std::pair<future<async_io_mapping>, async_io_op> async_file_io_dispatcher_base::map(const async_map_op_req &req)
+{
+	std::vector<async_map_op_req> i;
+	i.reserve(1);
+	i.push_back(req);
+	auto ret(map(i));
+	return std::make_pair(std::move(ret.first.front()), ret.second.front());
+}
+inline async_io_op async_file_io_dispatcher_base::copy(const async_copy_op_req &req)
+{
+	std::vector<async_copy_op_req> i;
+	i.reserve(1);
+	i.push_back(req);
+	return std::move(copy(i).front());
+}
+inline std::pair<future<std::pair<std::vector<directory_entry>, bool>>, async_io_op> async_file_io_dispatcher_base::enumerate(const async_enumerate_op_req &req)
+{
+	std::vector<async_enumerate_op_req> i;
+	i.reserve(1);
+	i.push_back(req);
+	auto ret(enumerate(i));
+	return std::make_pair(std::move(ret.first.front()), ret.second.front());
+}
 inline async_io_op async_file_io_dispatcher_base::truncate(const async_io_op &op, off_t newsize)
 {
 	std::vector<async_io_op> o;
@@ -1386,6 +2182,35 @@ inline async_io_op async_file_io_dispatcher_base::truncate(const async_io_op &op
 	return std::move(truncate(o, i).front());
 }
 
+inline async_io_op async_file_io_dispatcher_base::preallocate(const async_io_op &op, off_t offset, off_t length, preallocate_flags mode)
+{
+	std::vector<async_io_op> o;
+	std::vector<off_t> i, l;
+	o.reserve(1);
+	o.push_back(op);
+	i.reserve(1);
+	i.push_back(offset);
+	l.reserve(1);
+	l.push_back(length);
+	return std::move(preallocate(o, i, l, mode).front());
+}
+inline std::pair<future<stat_t>, async_io_op> async_file_io_dispatcher_base::stat(const async_io_op &op, metadata_flags wanted)
+{
+	std::vector<async_io_op> i;
+	i.reserve(1);
+	i.push_back(op);
+	auto ret(stat(i, wanted));
+	return std::make_pair(std::move(ret.first.front()), ret.second.front());
+}
+inline std::pair<future<stat_t>, async_io_op> async_file_io_dispatcher_base::stat(const async_path_op_req &req, metadata_flags wanted)
+{
+	std::vector<async_path_op_req> i;
+	i.reserve(1);
+	i.push_back(req);
+	auto ret(stat(i, wanted));
+	return std::make_pair(std::move(ret.first.front()), ret.second.front());
+}
+
 
 } } // namespace
 
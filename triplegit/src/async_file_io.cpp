@@ -5,7 +5,29 @@ File Created: Mar 2013
 */
 
 #define MAX_NON_ASYNC_QUEUE_DEPTH 8
+// This is how many continuations in a row a worker will run itself before handing the next back to the pool
+#define MAX_INLINE_CONTINUATIONS 16
+// This is the most bytes and buffers adjacent writes to the same handle will be coalesced into
+#define MAX_COALESCED_WRITE (1024*1024)
+#define MAX_COALESCED_WRITE_BUFFERS 1024
+// This is how big and how many windows are speculatively read ahead of sequential reads of WillBeSequentiallyAccessed handles
+#define READAHEAD_WINDOW (256*1024)
+#define READAHEAD_WINDOWS 4
+// This is how big each arena of a dispatcher's buffer pool is, and how many arenas a pool can have
+#define BUFFER_POOL_ARENA (4*1024*1024)
+#define BUFFER_POOL_ARENAS 64
+// This is the most bytes a copy does before handing the rest back to the pool, and the buffer it uses if the kernel can't copy
+#define COPY_CHUNK (16*1024*1024)
+#define COPY_BUFFER (1024*1024)
+// This is how many shards the POSIX containing directory handle cache has, and how many directories it keeps open after their last file closes
+#define DIRCACHE_SHARDS 16
+#define DIRCACHE_HOT 64
+// This is the buffer enumerate() reads directory entries into, so the most it reads from a directory at once
+#define ENUMERATE_BUFFER (256*1024)
+// This is how many SQEs the Linux io_uring backend can submit at once. Its completion queue is four times this.
+#define IO_URING_QUEUE_DEPTH 1024
 //#define USE_POSIX_ON_WIN32 // Useful for testing
+//#define USE_POSIX_ON_LINUX // Useful for testing
 
 #define _CRT_SECURE_NO_WARNINGS
 #define _CRT_NONSTDC_DEPRECATE(a)
@@ -18,10 +40,13 @@ File Created: Mar 2013
 
 #include "../include/async_file_io.hpp"
 #include "boost/smart_ptr/detail/spinlock.hpp"
+#include "boost/lockfree/queue.hpp"
 #include "../../NiallsCPP11Utilities/ErrorHandling.hpp"
 #include "../../NiallsCPP11Utilities/valgrind/memcheck.h"
 #include "../../NiallsCPP11Utilities/valgrind/helgrind.h"
 #include <mutex>
+#include <condition_variable>
+#include <list>
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -40,10 +65,21 @@ File Created: Mar 2013
 #define posix_close _close
 #define posix_unlink _wunlink
 #define posix_fsync _commit
+#define posix_fdatasync _commit
 #define posix_ftruncate _chsize_s
+// No *at() functions here, so relative lookups always use an absolute path
+#define AT_FDCWD -100
+#define posix_mkdirat(dirfd, path, mode) _wmkdir(path)
+#define posix_rmdirat(dirfd, path) _wrmdir(path)
+#define posix_openat(dirfd, path, flags, mode) _wopen(path, flags, mode)
+#define posix_unlinkat(dirfd, path) _wunlink(path)
+#define posix_statat(dirfd, path, buf) _wstat64(path, buf)
 #else
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <limits.h>
+#include <dirent.h>
 #define posix_mkdir mkdir
 #define posix_rmdir ::rmdir
 #define posix_stat stat
@@ -51,11 +87,37 @@ File Created: Mar 2013
 #define posix_close ::close
 #define posix_unlink unlink
 #define posix_fsync fsync
+#define posix_mkdirat mkdirat
+#define posix_rmdirat(dirfd, path) unlinkat(dirfd, path, AT_REMOVEDIR)
+#define posix_openat openat
+#define posix_unlinkat(dirfd, path) unlinkat(dirfd, path, 0)
+#define posix_statat(dirfd, path, buf) fstatat(dirfd, path, buf, 0)
+#ifdef __APPLE__
+#define posix_fdatasync fsync
+#else
+#define posix_fdatasync fdatasync
+#endif
 #define posix_ftruncate ftruncate
 #endif
+#if defined(__linux__) && !defined(USE_POSIX_ON_LINUX)
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
 
 // libstdc++ doesn't come with std::lock_guard
 #define lock_guard boost::lock_guard
+// Nor do all our compilers support thread_local yet
+#ifdef _MSC_VER
+#define TRIPLEGIT_THREAD_LOCAL __declspec(thread)
+#else
+#define TRIPLEGIT_THREAD_LOCAL __thread
+#endif
 
 #if defined(_DEBUG) && 0
 #define DEBUG_PRINTING 1
@@ -112,6 +174,372 @@ ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, triplegit::async_io
 
 namespace triplegit { namespace async_io {
 
+namespace detail {
+	/* A Chase-Lev work stealing deque, using the memory orderings from Le, Pop, Cohen and Zappa Nardelli's
+	"Correct and Efficient Work-Stealing for Weak Memory Models" (2013). Only the owning worker may push()
+	and take(), but anyone may steal().
+	*/
+	class work_stealing_deque
+	{
+		struct array_t
+		{
+			size_t mask;
+			std::unique_ptr<std::atomic<thread_pool_task *>[]> items;
+			explicit array_t(size_t size) : mask(size-1), items(new std::atomic<thread_pool_task *>[size]) { }
+			thread_pool_task *get(ptrdiff_t i) const { return items[i & mask].load(std::memory_order_relaxed); }
+			void put(ptrdiff_t i, thread_pool_task *t) { items[i & mask].store(t, std::memory_order_relaxed); }
+		};
+		std::atomic<ptrdiff_t> top, bottom;
+		std::atomic<array_t *> array;
+		// Thieves may still be reading a retired array, so keep them all until we die
+		std::vector<std::unique_ptr<array_t>> arrays;
+	public:
+		work_stealing_deque() : top(0), bottom(0)
+		{
+			arrays.push_back(std::unique_ptr<array_t>(new array_t(256)));
+			array=arrays.back().get();
+		}
+		void push(thread_pool_task *task)
+		{
+			ptrdiff_t b=bottom.load(std::memory_order_relaxed), t=top.load(std::memory_order_acquire);
+			array_t *a=array.load(std::memory_order_relaxed);
+			if(b-t>(ptrdiff_t) a->mask)
+			{
+				std::unique_ptr<array_t> n(new array_t((a->mask+1)*2));
+				for(ptrdiff_t i=t; i<b; i++)
+					n->put(i, a->get(i));
+				a=n.get();
+				arrays.push_back(std::move(n));
+				array.store(a, std::memory_order_release);
+			}
+			a->put(b, task);
+			std::atomic_thread_fence(std::memory_order_release);
+			bottom.store(b+1, std::memory_order_relaxed);
+		}
+		thread_pool_task *take()
+		{
+			ptrdiff_t b=bottom.load(std::memory_order_relaxed)-1;
+			array_t *a=array.load(std::memory_order_relaxed);
+			bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			ptrdiff_t t=top.load(std::memory_order_relaxed);
+			thread_pool_task *task=nullptr;
+			if(t<=b)
+			{
+				task=a->get(b);
+				if(t==b)
+				{
+					// Last item, so race any thieves for it
+					if(!top.compare_exchange_strong(t, t+1, std::memory_order_seq_cst, std::memory_order_relaxed))
+						task=nullptr;
+					bottom.store(b+1, std::memory_order_relaxed);
+				}
+			}
+			else
+				bottom.store(b+1, std::memory_order_relaxed);
+			return task;
+		}
+		thread_pool_task *steal()
+		{
+			ptrdiff_t t=top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			ptrdiff_t b=bottom.load(std::memory_order_acquire);
+			if(t>=b)
+				return nullptr;
+			array_t *a=array.load(std::memory_order_acquire);
+			thread_pool_task *task=a->get(t);
+			if(!top.compare_exchange_strong(t, t+1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return nullptr;
+			return task;
+		}
+	};
+	/* Tasks are carved from slabs into a free list per size class, sharded by the allocating thread so
+	threads queuing work rarely contend. Blocks remember their shard and go back to it whoever frees them,
+	so a thread feeding work to others keeps reusing its own blocks rather than carving ever more. Slabs
+	are never freed, as tasks may outlive any one pool.
+	*/
+	struct thread_pool_task_allocator
+	{
+		static const size_t shards=16, slabsize=64, headersize=16;
+		static const size_t minsize=64;
+		static const int sizeclasses=4; // 64 to 512 byte blocks, header included
+		struct header_t
+		{
+			header_t *next; // In my shard's free list while free
+			unsigned shard;
+			int sizeclass; // -1 for a block too big for any size class
+		};
+		typedef boost::detail::spinlock lock_t;
+		struct shard_t
+		{
+			lock_t lock;
+			header_t *freelists[sizeclasses];
+			std::vector<std::unique_ptr<char[]>> slabs;
+
+			shard_t()
+			{
+				// Boost's spinlock is so lightweight it has no constructor ...
+				lock.unlock();
+				for(auto &i : freelists)
+					i=nullptr;
+			}
+		};
+		std::atomic<unsigned> nextshard;
+		shard_t blocks[shards];
+
+		thread_pool_task_allocator() : nextshard(0) { }
+		static int sizeclass(size_t size)
+		{
+			int c=0;
+			for(size_t s=minsize; s<size && c<sizeclasses; s<<=1)
+				c++;
+			return c<sizeclasses ? c : -1;
+		}
+		// Called in unknown thread
+		void *allocate(size_t size, unsigned &threadshard)
+		{
+			header_t *h;
+			int c=sizeclass(size+headersize);
+			if(c<0)
+			{
+				h=(header_t *) ::operator new(size+headersize);
+				h->sizeclass=-1;
+				return (char *) h+headersize;
+			}
+			if(!threadshard)
+				threadshard=1+(unsigned)(nextshard++ % shards);
+			shard_t &shard=blocks[threadshard-1];
+			{
+				lock_guard<lock_t> g(shard.lock);
+				if(!shard.freelists[c])
+				{
+					size_t blocksize=minsize<<c;
+					shard.slabs.push_back(std::unique_ptr<char[]>(new char[blocksize*slabsize]));
+					char *slab=shard.slabs.back().get();
+					for(size_t n=0; n<slabsize; n++)
+					{
+						header_t *b=(header_t *)(slab+n*blocksize);
+						b->shard=threadshard-1;
+						b->sizeclass=c;
+						b->next=shard.freelists[c];
+						shard.freelists[c]=b;
+					}
+				}
+				h=shard.freelists[c];
+				shard.freelists[c]=h->next;
+			}
+			return (char *) h+headersize;
+		}
+		// Called in unknown thread
+		void deallocate(void *p)
+		{
+			if(!p)
+				return;
+			header_t *h=(header_t *)((char *) p-headersize);
+			if(h->sizeclass<0)
+			{
+				::operator delete(h);
+				return;
+			}
+			shard_t &shard=blocks[h->shard];
+			lock_guard<lock_t> g(shard.lock);
+			h->next=shard.freelists[h->sizeclass];
+			shard.freelists[h->sizeclass]=h;
+		}
+	};
+	static thread_pool_task_allocator &thread_pool_task_blocks()
+	{
+		// Never destroyed, as tasks may be freed during static deinitialisation
+		static thread_pool_task_allocator *ret=new thread_pool_task_allocator;
+		return *ret;
+	}
+	// Which shard of task blocks the calling thread allocates from, plus one, or zero if not yet chosen
+	static TRIPLEGIT_THREAD_LOCAL unsigned thread_pool_task_shard;
+
+	struct thread_pool_p
+	{
+		struct worker_t
+		{
+			thread_pool_p *pool;
+			work_stealing_deque tasks;
+			size_t seed;
+			worker_t(thread_pool_p *_pool, size_t _seed) : pool(_pool), seed(_seed) { }
+		};
+		// Wakeups are posted into these rather than the heap. Never more are pending than there are workers,
+		// and these must outlive the io_service which frees any still pending when it dies.
+		struct wakeup_slot_t
+		{
+			std::aligned_storage<128, 16>::type storage; // First, so a slot is found from its storage
+			std::atomic<bool> used;
+			wakeup_slot_t() : used(false) { }
+		};
+		std::unique_ptr<wakeup_slot_t[]> wakeupslots;
+		size_t wakeupslotscount;
+		boost::asio::io_service service;
+		boost::asio::io_service::work working;
+		std::vector<std::unique_ptr<worker_t>> workers;
+		std::vector<std::unique_ptr<thread>> threads;
+		boost::lockfree::queue<thread_pool_task *> injected; // Work queued from outside the pool
+		std::atomic<size_t> idle; // Workers asleep in the io_service, or about to be
+		std::atomic<size_t> waking; // Wakeups posted to the io_service but not yet run
+		std::atomic<bool> stopping;
+		explicit thread_pool_p(size_t no) : wakeupslots(new wakeup_slot_t[no]), wakeupslotscount(no), working(service), injected(256), idle(0), waking(0), stopping(false) { }
+		// Called in unknown thread
+		void *allocate_wakeup(size_t size)
+		{
+			if(size<=sizeof(wakeup_slot_t::storage))
+				for(size_t n=0; n<wakeupslotscount; n++)
+				{
+					bool expected=false;
+					if(!wakeupslots[n].used.load(std::memory_order_relaxed) && wakeupslots[n].used.compare_exchange_strong(expected, true, std::memory_order_acquire))
+						return &wakeupslots[n].storage;
+				}
+			return ::operator new(size);
+		}
+		// Called in unknown thread
+		void deallocate_wakeup(void *p)
+		{
+			wakeup_slot_t *slot=(wakeup_slot_t *) p;
+			if(slot>=wakeupslots.get() && slot<wakeupslots.get()+wakeupslotscount)
+				slot->used.store(false, std::memory_order_release);
+			else
+				::operator delete(p);
+		}
+	};
+	// Posted to the io_service to wake a sleeping worker, allocating from its pool's wakeup slots
+	struct thread_pool_wakeup
+	{
+		template<class T> struct allocator
+		{
+			typedef T value_type;
+			thread_pool_p *pool;
+			explicit allocator(thread_pool_p *_pool) : pool(_pool) { }
+			template<class U> allocator(const allocator<U> &o) : pool(o.pool) { }
+			T *allocate(size_t no) { return (T *) pool->allocate_wakeup(no*sizeof(T)); }
+			void deallocate(T *p, size_t) { pool->deallocate_wakeup(p); }
+			template<class U> bool operator==(const allocator<U> &o) const { return pool==o.pool; }
+			template<class U> bool operator!=(const allocator<U> &o) const { return pool!=o.pool; }
+		};
+		typedef allocator<void> allocator_type;
+		thread_pool_p *pool;
+		explicit thread_pool_wakeup(thread_pool_p *_pool) : pool(_pool) { }
+		allocator_type get_allocator() const { return allocator_type(pool); }
+		void operator()() const { --pool->waking; }
+	};
+	// The worker the calling thread is, if any
+	static TRIPLEGIT_THREAD_LOCAL thread_pool_p::worker_t *thread_pool_current_worker;
+
+	static thread_pool_task *thread_pool_find_work(thread_pool_p *pool, thread_pool_p::worker_t *me)
+	{
+		thread_pool_task *task=me->tasks.take();
+		if(task || pool->injected.pop(task))
+			return task;
+		// Steal starting from a random victim so thieves don't all gang up on the same one
+		size_t no=pool->workers.size();
+		me->seed^=me->seed<<13;
+		me->seed^=me->seed>>7;
+		me->seed^=me->seed<<17;
+		for(size_t n=0, start=me->seed % no; n<no; n++)
+		{
+			thread_pool_p::worker_t *victim=pool->workers[(start+n) % no].get();
+			if(victim!=me && (task=victim->tasks.steal()))
+				return task;
+		}
+		return nullptr;
+	}
+	static void thread_pool_worker(thread_pool_p *pool, thread_pool_p::worker_t *me)
+	{
+		thread_pool_current_worker=me;
+		size_t ran=0;
+		while(!pool->stopping)
+		{
+			thread_pool_task *task=thread_pool_find_work(pool, me);
+			if(!task)
+			{
+				// Look again once visibly idle, else someone queuing work may have missed us
+				++pool->idle;
+				if(!(task=thread_pool_find_work(pool, me)))
+					pool->service.run_one();
+				--pool->idle;
+				if(!task)
+					continue;
+			}
+			std::unique_ptr<thread_pool_task> taskh(task);
+			(*task)();
+			// Don't let a busy worker starve i/o completions
+			if(!(++ran & 15))
+				pool->service.poll_one();
+		}
+	}
+}
+
+void *detail::thread_pool_task::operator new(size_t size)
+{
+	return thread_pool_task_blocks().allocate(size, thread_pool_task_shard);
+}
+
+void detail::thread_pool_task::operator delete(void *p)
+{
+	thread_pool_task_blocks().deallocate(p);
+}
+
+thread_pool::thread_pool(size_t no) : p(new detail::thread_pool_p(no))
+{
+	// All workers must exist before any can try stealing from them
+	p->workers.reserve(no);
+	for(size_t n=0; n<no; n++)
+		p->workers.push_back(std::unique_ptr<detail::thread_pool_p::worker_t>(new detail::thread_pool_p::worker_t(p, 0x9e3779b97f4a7c15ULL*(n+1))));
+	p->threads.reserve(no);
+	for(size_t n=0; n<no; n++)
+		p->threads.push_back(std::unique_ptr<thread>(new thread(std::bind(&detail::thread_pool_worker, p, p->workers[n].get()))));
+}
+
+thread_pool::~thread_pool()
+{
+	p->stopping=true;
+	p->service.stop();
+	for(auto &i : p->threads)
+		i->join();
+	// Like io_service, discard anything never run
+	detail::thread_pool_task *task;
+	for(auto &i : p->workers)
+		while((task=i->tasks.take()))
+			delete task;
+	while(p->injected.pop(task))
+		delete task;
+	delete p;
+}
+
+boost::asio::io_service &thread_pool::io_service()
+{
+	return p->service;
+}
+
+// Called in unknown thread
+void thread_pool::int_submit(detail::thread_pool_task *task)
+{
+	detail::thread_pool_p::worker_t *me=detail::thread_pool_current_worker;
+	// If I am one of this pool's workers, keep the work local where it's still in cache
+	if(me && me->pool==p)
+		me->tasks.push(task);
+	else if(!p->injected.push(task))
+	{
+		delete task;
+		throw std::bad_alloc();
+	}
+	// Pairs with the idle workers looking again after incrementing idle
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	// Only wake another sleeper if more are asleep than are already being woken. Whoever runs a wakeup
+	// looks for work straight after, so nothing queued meanwhile is missed.
+	size_t waking=p->waking.load(std::memory_order_relaxed);
+	while(waking<p->idle.load(std::memory_order_relaxed))
+		if(p->waking.compare_exchange_weak(waking, waking+1, std::memory_order_relaxed))
+		{
+			p->service.post(detail::thread_pool_wakeup(p));
+			break;
+		}
+}
+
 thread_pool &process_threadpool()
 {
 	// This is basically how many file i/o operations can occur at once
@@ -128,14 +556,15 @@ namespace detail {
 		std::unique_ptr<boost::asio::windows::random_access_handle> h;
 		void *myid;
 		bool has_been_added, autoflush;
+		HANDLE findh; // Where enumerate() got to
 
 		static HANDLE int_checkHandle(HANDLE h, const std::filesystem::path &path)
 		{
 			ERRHWINFN(INVALID_HANDLE_VALUE!=h, path);
 			return h;
 		}
-		async_io_handle_windows(std::shared_ptr<async_file_io_dispatcher_base> _parent, const std::filesystem::path &path) : async_io_handle(_parent.get(), path), parent(_parent), myid(nullptr), has_been_added(false), autoflush(false) { }
-		async_io_handle_windows(std::shared_ptr<async_file_io_dispatcher_base> _parent, const std::filesystem::path &path, bool _autoflush, HANDLE _h) : async_io_handle(_parent.get(), path), parent(_parent), h(new boost::asio::windows::random_access_handle(process_threadpool().io_service(), int_checkHandle(_h, path))), myid(_h), has_been_added(false), autoflush(_autoflush) { }
+		async_io_handle_windows(std::shared_ptr<async_file_io_dispatcher_base> _parent, const std::filesystem::path &path) : async_io_handle(_parent.get(), path), parent(_parent), myid(nullptr), has_been_added(false), autoflush(false), findh(INVALID_HANDLE_VALUE) { }
+		async_io_handle_windows(std::shared_ptr<async_file_io_dispatcher_base> _parent, const std::filesystem::path &path, bool _autoflush, HANDLE _h) : async_io_handle(_parent.get(), path), parent(_parent), h(new boost::asio::windows::random_access_handle(process_threadpool().io_service(), int_checkHandle(_h, path))), myid(_h), has_been_added(false), autoflush(_autoflush), findh(INVALID_HANDLE_VALUE) { }
 		virtual void *native_handle() const { return myid; }
 
 		// You can't use shared_from_this() in a constructor so ...
@@ -152,6 +581,8 @@ namespace detail {
 			DEBUG_PRINT("D %p\n", this);
 			if(has_been_added)
 				parent->int_del_io_handle(myid);
+			if(INVALID_HANDLE_VALUE!=findh)
+				FindClose(findh);
 			if(h)
 			{
 				if(autoflush && write_count_since_fsync())
@@ -161,15 +592,163 @@ namespace detail {
 		}
 	};
 #endif
+	/* Windows of a handle opened with WillBeSequentiallyAccessed speculatively read ahead of sequential reads.
+	A window's data is only touched outside the lock by the one fill which marked it filling, and a fill
+	only makes its window ready if nothing has been written, truncated or closed since it began.
+	*/
+	struct readahead_ring
+	{
+		enum class window_state { empty, filling, ready };
+		struct window
+		{
+			window_state state;
+			off_t where;
+			size_t length;
+			std::unique_ptr<char[]> data;
+			window() : state(window_state::empty), where(0), length(0) { }
+		};
+		typedef boost::detail::spinlock lock_t;
+		lock_t lock;
+		size_t generation;
+		bool closed;
+		off_t nextsequential;
+		window windows[READAHEAD_WINDOWS];
+		readahead_ring() : generation(0), closed(false), nextsequential(0)
+		{
+			// Boost's spinlock is so lightweight it has no constructor ...
+			lock.unlock();
+		}
+		// Copies all of buffers from ready windows if they hold every byte of them
+		bool serve(const std::vector<boost::asio::mutable_buffer> &buffers, off_t where)
+		{
+			size_t length=boost::asio::buffer_size(buffers);
+			lock_guard<lock_t> g(lock);
+			if(closed)
+				return false;
+			for(off_t k=where/READAHEAD_WINDOW; k<=(off_t)(where+length-1)/READAHEAD_WINDOW; k++)
+			{
+				const window &w=windows[k % READAHEAD_WINDOWS];
+				if(window_state::ready!=w.state || w.where!=k*READAHEAD_WINDOW || w.where+(off_t) w.length<std::min(where+(off_t) length, (k+1)*READAHEAD_WINDOW))
+					return false;
+			}
+			for(auto &b : buffers)
+			{
+				char *out=boost::asio::buffer_cast<char *>(b);
+				for(size_t togo=boost::asio::buffer_size(b); togo;)
+				{
+					const window &w=windows[(where/READAHEAD_WINDOW) % READAHEAD_WINDOWS];
+					size_t offset=(size_t)(where-w.where), amount=std::min(togo, w.length-offset);
+					memcpy(out, w.data.get()+offset, amount);
+					out+=amount;
+					where+=amount;
+					togo-=amount;
+				}
+			}
+			return true;
+		}
+		// Records a read, returning the windows following it which need filling if it continued a sequential run
+		size_t advance(off_t where, size_t length, std::vector<std::pair<size_t, off_t>> &fills)
+		{
+			lock_guard<lock_t> g(lock);
+			bool sequential=(where==nextsequential);
+			nextsequential=where+length;
+			if(!sequential || closed)
+				return generation;
+			for(off_t k=nextsequential/READAHEAD_WINDOW, end=k+READAHEAD_WINDOWS; k<end; k++)
+			{
+				size_t slot=(size_t)(k % READAHEAD_WINDOWS);
+				window &w=windows[slot];
+				// Filling windows are owned by their fill until it finishes
+				if(window_state::filling==w.state || (window_state::ready==w.state && w.where==k*READAHEAD_WINDOW))
+					continue;
+				if(!w.data)
+					w.data.reset(new char[READAHEAD_WINDOW]);
+				w.state=window_state::filling;
+				w.where=k*READAHEAD_WINDOW;
+				w.length=0;
+				fills.push_back(std::make_pair(slot, w.where));
+			}
+			return generation;
+		}
+		void filled(size_t slot, size_t _generation, ssize_t length)
+		{
+			lock_guard<lock_t> g(lock);
+			window &w=windows[slot];
+			if(length<=0 || _generation!=generation || closed)
+				w.state=window_state::empty;
+			else
+			{
+				w.state=window_state::ready;
+				w.length=(size_t) length;
+			}
+		}
+		// Discards everything read ahead, and anything currently being
+		void invalidate(bool close=false)
+		{
+			lock_guard<lock_t> g(lock);
+			++generation;
+			if(close)
+				closed=true;
+			for(auto &w : windows)
+				if(window_state::ready==w.state)
+					w.state=window_state::empty;
+		}
+	};
+	// Syncs of a handle arriving while an fsync of it is in flight wait to share the next one. For a directory
+	// the waiters are the creations of items within it, each completing with its own handle.
+	struct sync_group
+	{
+		typedef std::vector<std::pair<size_t, std::shared_ptr<async_io_handle>>> waiters_t;
+		typedef boost::detail::spinlock lock_t;
+		lock_t lock;
+		bool syncing;
+		waiters_t waiters;
+		sync_group() : syncing(false)
+		{
+			// Boost's spinlock is so lightweight it has no constructor ...
+			lock.unlock();
+		}
+		// True if the caller should fsync now, else op id waits for the next fsync to complete with h
+		bool join(size_t id, std::shared_ptr<async_io_handle> h)
+		{
+			lock_guard<lock_t> g(lock);
+			if(syncing)
+			{
+				waiters.push_back(std::make_pair(id, std::move(h)));
+				return false;
+			}
+			syncing=true;
+			return true;
+		}
+		// Called after each fsync. Returns the ops to complete after the next fsync, if none then no fsync is in flight any more.
+		waiters_t next()
+		{
+			waiters_t ret;
+			lock_guard<lock_t> g(lock);
+			ret.swap(waiters);
+			if(ret.empty())
+				syncing=false;
+			return ret;
+		}
+	};
 	struct async_io_handle_posix : public async_io_handle
 	{
 		std::shared_ptr<async_file_io_dispatcher_base> parent;
 		std::shared_ptr<detail::async_io_handle> dirh;
 		int fd;
-		bool has_been_added, autoflush, has_ever_been_fsynced;
+		bool has_been_added, autoflush, has_ever_been_fsynced, cached;
+		file_flags cacheflags; // What a cached handle was opened with
+		std::unique_ptr<readahead_ring> readahead;
+		sync_group syncs;
+#if !defined(WIN32) && !defined(__linux__)
+		DIR *enumerator; // Where enumerate() got to
+#endif
 
-		async_io_handle_posix(std::shared_ptr<async_file_io_dispatcher_base> _parent, std::shared_ptr<detail::async_io_handle> _dirh, const std::filesystem::path &path, bool _autoflush, int _fd) : async_io_handle(_parent.get(), path), parent(_parent), dirh(_dirh), fd(_fd), has_been_added(false), autoflush(_autoflush),has_ever_been_fsynced(false)
+		async_io_handle_posix(std::shared_ptr<async_file_io_dispatcher_base> _parent, std::shared_ptr<detail::async_io_handle> _dirh, const std::filesystem::path &path, bool _autoflush, int _fd) : async_io_handle(_parent.get(), path), parent(_parent), dirh(_dirh), fd(_fd), has_been_added(false), autoflush(_autoflush),has_ever_been_fsynced(false), cached(false), cacheflags(file_flags::None)
 		{
+#if !defined(WIN32) && !defined(__linux__)
+			enumerator=nullptr;
+#endif
 			if(fd!=-999)
 				ERRHOSFN(fd, path);
 		}
@@ -181,10 +760,75 @@ namespace detail {
 			parent->int_add_io_handle((void *)(size_t)fd, shared_from_this());
 			has_been_added=true;
 		}
+		// Gives up ownership of the fd without closing it, so whichever handle next wraps it can register it
+		int release_fd()
+		{
+			if(has_been_added)
+				parent->int_del_io_handle((void *)(size_t)fd);
+			has_been_added=false;
+			int ret=fd;
+			fd=-1;
+			return ret;
+		}
+		// Reads of handles opened for sequential reading get read ahead, except with OSDirect whose buffers must be aligned
+		void do_enable_readahead(file_flags flags)
+		{
+			if(!(flags & file_flags::WillBeSequentiallyAccessed) || !(flags & file_flags::Read) || !!(flags & file_flags::OSDirect))
+				return;
+#ifdef POSIX_FADV_SEQUENTIAL
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+			readahead.reset(new readahead_ring);
+		}
+		// OSDirect i/o must be aligned to the logical block size, which is per device and per filing system
+		void do_discover_block_size(file_flags flags)
+		{
+#ifdef O_DIRECT
+			if(!(flags & file_flags::OSDirect))
+				return;
+			blocksize=4096;
+#ifdef __linux__
+#ifdef STATX_DIOALIGN
+			struct statx sx;
+			if(!statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx) && (sx.stx_mask & STATX_DIOALIGN) && sx.stx_dio_offset_align)
+			{
+				blocksize=std::max(sx.stx_dio_offset_align, sx.stx_dio_mem_align);
+				return;
+			}
+#endif
+			struct stat s;
+			int sectorsize;
+			if(!fstat(fd, &s) && S_ISBLK(s.st_mode) && !ioctl(fd, BLKSSZGET, &sectorsize) && sectorsize>0)
+				blocksize=(size_t) sectorsize;
+#endif
+#endif
+		}
+		// True if i/o at where to or from vecs needs no bouncing
+		bool is_block_aligned(const std::vector<iovec> &vecs, off_t where) const
+		{
+			if(where & (blocksize-1))
+				return false;
+			for(auto &v : vecs)
+				if(((size_t) v.iov_base | v.iov_len) & (blocksize-1))
+					return false;
+			return true;
+		}
+		// Records that everything written before written was fsynced. Concurrent fsyncs may finish in any order.
+		void synced(off_t written)
+		{
+			has_ever_been_fsynced=true;
+			off_t was=byteswrittenatlastfsync;
+			while(was<written && !byteswrittenatlastfsync.compare_exchange_weak(was, written));
+		}
 		~async_io_handle_posix()
 		{
 			if(has_been_added)
 				parent->int_del_io_handle((void *)(size_t)fd);
+#if !defined(WIN32) && !defined(__linux__)
+			// Closes its own duplicate of fd
+			if(enumerator)
+				closedir(enumerator);
+#endif
 			if(fd>=0)
 			{
 				// Flush synchronously here? I guess ...
@@ -210,6 +854,12 @@ namespace detail {
 		write,
 		truncate,
 		barrier,
+		join,
+		map,
+		copy,
+		preallocate,
+		enumerate,
+		stat,
 
 		Last
 	};
@@ -225,107 +875,882 @@ namespace detail {
 		"read",
 		"write",
 		"truncate",
-		"barrier"
+		"barrier",
+		"join",
+		"map",
+		"copy",
+		"preallocate",
+		"enumerate",
+		"stat"
 	};
 	static_assert(static_cast<size_t>(OpType::Last)==sizeof(optypes)/sizeof(*optypes), "You forgot to fix up the strings matching OpType");
-	struct async_file_io_dispatcher_op
+	// What each op of a preallocate() reserves
+	struct preallocate_range
 	{
-		OpType optype;
-		async_op_flags flags;
-		std::shared_ptr<shared_future<std::shared_ptr<detail::async_io_handle>>> h;
-		std::unique_ptr<promise<std::shared_ptr<detail::async_io_handle>>> detached_promise;
-		typedef std::pair<size_t, std::function<std::shared_ptr<detail::async_io_handle> (std::shared_ptr<detail::async_io_handle>)>> completion_t;
-		std::vector<completion_t> completions;
-		async_file_io_dispatcher_op(OpType _optype, async_op_flags _flags, std::shared_ptr<shared_future<std::shared_ptr<detail::async_io_handle>>> _h)
-			: optype(_optype), flags(_flags), h(_h) { }
-		async_file_io_dispatcher_op(async_file_io_dispatcher_op &&o) : optype(o.optype), flags(std::move(o.flags)), h(std::move(o.h)),
-			detached_promise(std::move(o.detached_promise)), completions(std::move(o.completions)) { }
-	private:
-		async_file_io_dispatcher_op(const async_file_io_dispatcher_op &o);
+		off_t offset, length;
+		preallocate_flags mode;
+		preallocate_range(off_t _offset, off_t _length, preallocate_flags _mode) : offset(_offset), length(_length), mode(_mode) { }
 	};
-	struct async_file_io_dispatcher_base_p
+	// Relative path requests are relative to the directory their precondition opened or created
+	static std::filesystem::path absolute_path(const std::shared_ptr<async_io_handle> &dirh, const async_path_op_req &req)
 	{
-		thread_pool &pool;
-		file_flags flagsforce, flagsmask;
-
-		typedef boost::detail::spinlock fdslock_t;
-		typedef std::recursive_mutex opslock_t;
-		fdslock_t fdslock; std::unordered_map<void *, std::weak_ptr<async_io_handle>> fds;
-		opslock_t opslock; size_t monotoniccount; std::unordered_map<size_t, async_file_io_dispatcher_op> ops;
-
-		async_file_io_dispatcher_base_p(thread_pool &_pool, file_flags _flagsforce, file_flags _flagsmask) : pool(_pool),
-			flagsforce(_flagsforce), flagsmask(_flagsmask), monotoniccount(0)
+		if(!req.is_relative())
+			return req.path;
+		if(!dirh)
+			throw std::runtime_error("Relative path has no containing directory");
+		return dirh->path()/req.path;
+	}
+	static std::vector<async_io_op> sync_preconditions(const std::vector<async_sync_op_req> &reqs)
+	{
+		std::vector<async_io_op> ret;
+		ret.reserve(reqs.size());
+		for(auto &i : reqs)
+			ret.push_back(i.precondition);
+		return ret;
+	}
+	static std::vector<preallocate_range> make_preallocate_ranges(const std::vector<async_io_op> &ops, const std::vector<off_t> &offsets, const std::vector<off_t> &lengths, preallocate_flags mode)
+	{
+		if(offsets.size()!=ops.size() || lengths.size()!=ops.size())
+			throw std::runtime_error("preconditions size does not match size of ops data");
+		std::vector<preallocate_range> ret;
+		ret.reserve(ops.size());
+		for(size_t n=0; n<ops.size(); n++)
+			ret.push_back(preallocate_range(offsets[n], lengths[n], mode));
+		return ret;
+	}
+	// What each op of a stat() fetches, and where it delivers it. Without a path the precondition's handle is stat()ed.
+	struct stat_req
+	{
+		async_path_op_req req;
+		metadata_flags wanted;
+		std::shared_ptr<promise<stat_t>> result;
+		stat_req(async_path_op_req _req, metadata_flags _wanted) : req(std::move(_req)), wanted(_wanted), result(std::make_shared<promise<stat_t>>()) { }
+		bool byhandle() const { return req.path.empty(); }
+	};
+	static std::vector<future<stat_t>> make_stat_reqs(std::vector<stat_req> &out, const std::vector<async_io_op> &ops, metadata_flags wanted)
+	{
+		std::vector<future<stat_t>> ret;
+		out.reserve(ops.size());
+		ret.reserve(ops.size());
+		for(auto &i : ops)
 		{
-			// Boost's spinlock is so lightweight it has no constructor ...
-			fdslock.unlock();
-			ANNOTATE_RWLOCK_CREATE(&fdslock);
-			ops.reserve(10000);
+			out.push_back(stat_req(async_path_op_req(), wanted));
+			ret.push_back(out.back().result->get_future());
 		}
-		~async_file_io_dispatcher_base_p()
+		return ret;
+	}
+	static std::vector<future<stat_t>> make_stat_reqs(std::vector<stat_req> &out, std::vector<async_io_op> &preconditions, const std::vector<async_path_op_req> &reqs, metadata_flags wanted)
+	{
+		std::vector<future<stat_t>> ret;
+		out.reserve(reqs.size());
+		preconditions.reserve(reqs.size());
+		ret.reserve(reqs.size());
+		for(auto &i : reqs)
 		{
-			ANNOTATE_RWLOCK_DESTROY(&fdslock);
+			out.push_back(stat_req(i, wanted));
+			preconditions.push_back(i.precondition);
+			ret.push_back(out.back().result->get_future());
 		}
-	};
-	class async_file_io_dispatcher_compat;
-	class async_file_io_dispatcher_windows;
-	class async_file_io_dispatcher_linux;
-	class async_file_io_dispatcher_qnx;
-	struct immediate_async_ops
+		return ret;
+	}
+	/* Like std::function<R (A)>, but keeps callables of up to inline_size bytes inside itself so a recycled
+	op record, or anything else pooled, can be rebound without touching the heap.
+	*/
+	template<class R, class A, size_t inline_size> class inline_function<R(A), inline_size>
 	{
-		typedef std::shared_ptr<detail::async_io_handle> rettype;
-		typedef rettype retfuncttype();
-		std::vector<packaged_task<retfuncttype>> toexecute;
-
-		immediate_async_ops() { }
-		// Returns a promise which is fulfilled when this is destructed
-		future<rettype> enqueue(std::function<retfuncttype> f)
+		struct vtable_t
 		{
-			packaged_task<retfuncttype> t(std::move(f));
-			toexecute.push_back(std::move(t));
-			return toexecute.back().get_future();
+			R (*call)(void *, A);
+			void (*move)(void *, void *);
+			void (*destroy)(void *);
+		};
+		template<class T> struct inline_impl
+		{
+			static R call(void *s, A a) { return (*(T *) s)(std::forward<A>(a)); }
+			static void move(void *d, void *s) { new(d) T(std::move(*(T *) s)); ((T *) s)->~T(); }
+			static void destroy(void *s) { ((T *) s)->~T(); }
+			static const vtable_t vtable;
+		};
+		// Callables too big to fit are kept on the heap
+		template<class T> struct heap_impl
+		{
+			static R call(void *s, A a) { return (**(T **) s)(std::forward<A>(a)); }
+			static void move(void *d, void *s) { *(T **) d=*(T **) s; }
+			static void destroy(void *s) { delete *(T **) s; }
+			static const vtable_t vtable;
+		};
+		typename std::aligned_storage<inline_size, 16>::type storage;
+		const vtable_t *vtable;
+		template<class T> void construct(T &&f, std::true_type)
+		{
+			typedef typename std::decay<T>::type type;
+			new(&storage) type(std::forward<T>(f));
+			vtable=&inline_impl<type>::vtable;
 		}
-		~immediate_async_ops()
+		template<class T> void construct(T &&f, std::false_type)
 		{
-			for(auto &i : toexecute)
-				i();
+			typedef typename std::decay<T>::type type;
+			*(type **) &storage=new type(std::forward<T>(f));
+			vtable=&heap_impl<type>::vtable;
+		}
+	public:
+		inline_function() : vtable(nullptr) { }
+		inline_function(inline_function &&o) : vtable(o.vtable)
+		{
+			if(vtable)
+				vtable->move(&storage, &o.storage);
+			o.vtable=nullptr;
+		}
+		template<class T> inline_function(T &&f) : vtable(nullptr)
+		{
+			typedef typename std::decay<T>::type type;
+			construct(std::forward<T>(f), std::integral_constant<bool, sizeof(type)<=inline_size && std::alignment_of<type>::value<=16>());
+		}
+		~inline_function() { reset(); }
+		inline_function &operator=(inline_function &&o)
+		{
+			reset();
+			if((vtable=o.vtable))
+				vtable->move(&storage, &o.storage);
+			o.vtable=nullptr;
+			return *this;
 		}
+		void reset()
+		{
+			if(vtable)
+				vtable->destroy(&storage);
+			vtable=nullptr;
+		}
+		explicit operator bool() const { return !!vtable; }
+		R operator()(A a) { return vtable->call(&storage, std::forward<A>(a)); }
 	private:
-		immediate_async_ops(const immediate_async_ops &);
-		immediate_async_ops &operator=(const immediate_async_ops &);
-		immediate_async_ops(immediate_async_ops &&);
-		immediate_async_ops &operator=(immediate_async_ops &&);
+		inline_function(const inline_function &);
+		inline_function &operator=(const inline_function &);
 	};
-}
+	template<class R, class A, size_t inline_size> template<class T> const typename inline_function<R(A), inline_size>::vtable_t inline_function<R(A), inline_size>::inline_impl<T>::vtable={ &inline_function<R(A), inline_size>::inline_impl<T>::call, &inline_function<R(A), inline_size>::inline_impl<T>::move, &inline_function<R(A), inline_size>::inline_impl<T>::destroy };
+	template<class R, class A, size_t inline_size> template<class T> const typename inline_function<R(A), inline_size>::vtable_t inline_function<R(A), inline_size>::heap_impl<T>::vtable={ &inline_function<R(A), inline_size>::heap_impl<T>::call, &inline_function<R(A), inline_size>::heap_impl<T>::move, &inline_function<R(A), inline_size>::heap_impl<T>::destroy };
 
-async_file_io_dispatcher_base::async_file_io_dispatcher_base(thread_pool &threadpool, file_flags flagsforce, file_flags flagsmask) : p(new detail::async_file_io_dispatcher_base_p(threadpool, flagsforce, flagsmask))
-{
-}
+	/* A batch op bound to its implementation but not to its id or arguments, which it is handed each time it
+	is run, so a compiled plan binds each of its ops just once however many times it is submitted.
+	*/
+	struct batch_op_function
+	{
+		typedef std::shared_ptr<detail::async_io_handle> handle_t;
+		typedef async_file_io_dispatcher_base::completion_returntype (async_file_io_dispatcher_base::*impl_t)();
+		handle_t (*invoke)(const batch_op_function &, size_t, handle_t, const async_batch_op_req &);
+		async_file_io_dispatcher_base *parent;
+		impl_t impl; // Cast back to its true type by invoke
+		batch_op_function() : invoke(nullptr), parent(nullptr), impl(nullptr) { }
+		handle_t operator()(size_t id, handle_t h, const async_batch_op_req &req) const { return invoke(*this, id, std::move(h), req); }
+	};
+	// Fetches the argument a batch op's implementation takes, which depends on its kind
+	template<class A> struct batch_op_arg;
+	template<> struct batch_op_arg<async_path_op_req> { static const async_path_op_req &get(const async_batch_op_req &req) { return req.path; } };
+	template<> struct batch_op_arg<async_data_op_req<void>> { static const async_data_op_req<void> &get(const async_batch_op_req &req) { return req.readreq; } };
+	template<> struct batch_op_arg<async_data_op_req<const void>> { static const async_data_op_req<const void> &get(const async_batch_op_req &req) { return req.writereq; } };
+	template<> struct batch_op_arg<async_io_op> { static const async_io_op &get(const async_batch_op_req &req) { return req.op; } };
+	template<> struct batch_op_arg<off_t> { static const off_t &get(const async_batch_op_req &req) { return req.newsize; } };
 
-async_file_io_dispatcher_base::~async_file_io_dispatcher_base()
-{
-	for(;;)
+	struct async_op_plan_instance;
+	/* A batch compiled for submitting, perhaps many times. Everything which depends neither on the ids its
+	ops get nor on parameters is worked out once here.
+	*/
+	struct async_op_plan_ops
+	{
+		struct op_t
+		{
+			async_batch_op_req req;
+			OpType optype;
+			async_op_flags flags;
+			batch_op_function boundf;
+			size_t firstdependant, dependants; // My in plan dependants in the order they chain onto me, as a range of the plan's dependants
+			op_t(const async_batch_op_req &_req) : req(_req), optype(OpType::Unknown), flags(async_op_flags::None), firstdependant(0), dependants(0) { }
+		};
+		std::vector<op_t> ops;
+		std::vector<size_t> dependants; // Indices of ops, grouped by the op whose completion they chain onto
+		std::vector<size_t> roots; // Ops whose precondition, if any, is outside the plan
+		// Instances no longer in flight, kept for the next submission so patching parameters needn't allocate
+		typedef boost::detail::spinlock lock_t;
+		mutable lock_t lock;
+		mutable async_op_plan_instance *freelist;
+		mutable std::vector<std::unique_ptr<async_op_plan_instance>> instances;
+		async_op_plan_ops() : freelist(nullptr)
+		{
+			// Boost's spinlock is so lightweight it has no constructor ...
+			lock.unlock();
+		}
+		~async_op_plan_ops();
+		// Returns an instance of me for submitting, which keeps me alive until its last op is done with it
+		async_op_plan_instance *acquire(std::shared_ptr<const async_op_plan_ops> self) const;
+	};
+	/* What every op of one submission of a plan shares. Recycled into its plan when its last op is done with it,
+	putting back whatever parameters were patched in.
+	*/
+	struct async_op_plan_instance
 	{
-		std::vector<std::shared_ptr<shared_future<std::shared_ptr<detail::async_io_handle>>>> outstanding;
+		std::atomic<size_t> refcount;
+		std::shared_ptr<const async_op_plan_ops> plan; // Only while in use
+		std::vector<async_batch_op_req> reqs; // A copy of every op's request to patch, made on first patching
+		std::vector<size_t> patched; // Which of reqs have been patched since they were last put back
+		std::vector<async_file_io_dispatcher_op *> records; // Scratch space for submitting
+		async_op_plan_instance *next; // In my plan's free list
+		async_op_plan_instance() : refcount(0), next(nullptr) { }
+		const async_batch_op_req &req(size_t idx) const { return reqs.empty() ? plan->ops[idx].req : reqs[idx]; }
+		// Returns the request of op idx to patch
+		async_batch_op_req &patch(size_t idx)
 		{
-			lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(p->opslock);
-			if(!p->ops.empty())
+			if(reqs.empty())
 			{
-				outstanding.reserve(p->ops.size());
-				for(auto &op : p->ops)
-					if(op.second.h->valid())
-						outstanding.push_back(op.second.h);
+				reqs.reserve(plan->ops.size());
+				for(auto &op : plan->ops)
+					reqs.push_back(op.req);
 			}
+			patched.push_back(idx);
+			return reqs[idx];
 		}
-		if(outstanding.empty()) break;
-		for(auto &op : outstanding)
-			op->wait();
+		void recycle()
+		{
+			std::shared_ptr<const async_op_plan_ops> _plan(std::move(plan));
+			for(auto idx : patched)
+				reqs[idx]=_plan->ops[idx].req;
+			patched.clear();
+			lock_guard<async_op_plan_ops::lock_t> g(_plan->lock);
+			next=_plan->freelist;
+			_plan->freelist=this;
+		}
+		friend inline void intrusive_ptr_add_ref(async_op_plan_instance *i) { i->refcount.fetch_add(1, std::memory_order_relaxed); }
+		friend inline void intrusive_ptr_release(async_op_plan_instance *i) { if(1==i->refcount.fetch_sub(1, std::memory_order_acq_rel)) i->recycle(); }
+	};
+	inline async_op_plan_ops::~async_op_plan_ops() { }
+	inline async_op_plan_instance *async_op_plan_ops::acquire(std::shared_ptr<const async_op_plan_ops> self) const
+	{
+		async_op_plan_instance *ret;
+		{
+			lock_guard<lock_t> g(lock);
+			if((ret=freelist))
+				freelist=ret->next;
+			else
+			{
+				instances.push_back(std::unique_ptr<async_op_plan_instance>(new async_op_plan_instance));
+				ret=instances.back().get();
+			}
+		}
+		ret->next=nullptr;
+		ret->plan=std::move(self);
+		return ret;
 	}
-	delete p;
-}
+	// What each op record of a submitted plan is bound to
+	struct async_op_plan_thunk
+	{
+		boost::intrusive_ptr<async_op_plan_instance> instance;
+		const batch_op_function *boundf;
+		const async_batch_op_req *req;
+		size_t id;
+		std::shared_ptr<detail::async_io_handle> operator()(std::shared_ptr<detail::async_io_handle> h) const { return (*boundf)(id, std::move(h), *req); }
+	};
 
-void async_file_io_dispatcher_base::int_add_io_handle(void *key, std::shared_ptr<detail::async_io_handle> h)
-{
-	lock_guard<detail::async_file_io_dispatcher_base_p::fdslock_t> lockh(p->fdslock);
+	/* An in flight op. These are pooled per shard and recycled, and chain themselves into their
+	shard's hash table and onto their precondition's completions list intrusively.
+	*/
+	struct async_file_io_dispatcher_op
+	{
+		size_t id;
+		OpType optype;
+		async_op_flags flags;
+		boost::intrusive_ptr<async_io_op_state> h;
+		op_function boundf; // My implementation bound to its arguments. Moved out when I am run.
+		async_file_io_dispatcher_op *hashnext; // Next in my shard's hash bucket, or in its free list
+		async_file_io_dispatcher_op *completionnext; // Next in my precondition's completions
+		async_file_io_dispatcher_op *completionshead, *completionstail; // Ops to run when I complete, in order of chaining
+		async_file_io_dispatcher_op *jointo; // If set I am just a link in one of a join's preconditions' completions, not an op
+		std::atomic<size_t> joinsremaining; // If I am a join, how many of my preconditions are yet to complete
+		async_file_io_dispatcher_op() : id(0), optype(OpType::Unknown), flags(async_op_flags::None), hashnext(nullptr), completionnext(nullptr), completionshead(nullptr), completionstail(nullptr), jointo(nullptr), joinsremaining(0) { }
+	private:
+		async_file_io_dispatcher_op(const async_file_io_dispatcher_op &o);
+		async_file_io_dispatcher_op &operator=(const async_file_io_dispatcher_op &o);
+	};
+	// Called in unknown thread
+	static std::shared_ptr<detail::async_io_handle> run_async_file_io_dispatcher_op(async_file_io_dispatcher_op *op, std::shared_ptr<detail::async_io_handle> h)
+	{
+		// op gets recycled the moment it completes, which may be before its implementation returns
+		op_function f(std::move(op->boundf));
+		return f(std::move(h));
+	}
+	// The continuation a completing worker will run itself once its current op returns, instead of queuing it
+	struct inline_continuation
+	{
+		async_file_io_dispatcher_op *op;
+		std::shared_ptr<detail::async_io_handle> h;
+		size_t run;
+		inline_continuation() : op(nullptr), run(0) { }
+	};
+	static TRIPLEGIT_THREAD_LOCAL inline_continuation *current_inline_continuation;
+	// Called in a thread pool worker. Trampolines rather than recurses, so long chains don't eat the stack.
+	static void run_async_file_io_dispatcher_ops(async_file_io_dispatcher_op *op, std::shared_ptr<detail::async_io_handle> h)
+	{
+		inline_continuation next, *prev=current_inline_continuation;
+		current_inline_continuation=&next;
+		auto unsetit=NiallsCPP11Utilities::Undoer([prev](){ current_inline_continuation=prev; });
+		for(;;)
+		{
+			run_async_file_io_dispatcher_op(op, std::move(h));
+			if(!next.op)
+				break;
+			op=next.op;
+			h=std::move(next.h);
+			next.op=nullptr;
+			++next.run;
+		}
+	}
+	// Maps anonymous memory for buffers, backed by huge pages if asked and possible
+	static void *map_buffer_memory(size_t length, bool hugepages)
+	{
+#ifdef WIN32
+		void *ret=VirtualAlloc(nullptr, length, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+		if(!ret)
+			throw std::bad_alloc();
+		return ret;
+#else
+		void *ret=MAP_FAILED;
+#ifdef MAP_HUGETLB
+		if(hugepages)
+			ret=mmap(nullptr, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+		if(MAP_FAILED==ret)
+		{
+			ret=mmap(nullptr, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+			if(MAP_FAILED==ret)
+				throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+			// Ask for transparent huge pages instead
+			if(hugepages)
+				madvise(ret, length, MADV_HUGEPAGE);
+#endif
+		}
+		return ret;
+#endif
+	}
+	static void unmap_buffer_memory(void *addr, size_t length)
+	{
+#ifdef WIN32
+		VirtualFree(addr, 0, MEM_RELEASE);
+#else
+		munmap(addr, length);
+#endif
+	}
+	struct async_io_buffer_header
+	{
+		std::atomic<size_t> refcount;
+		async_io_buffer_pool *pool;
+		void *data;
+		size_t size;
+		int sizeclass; // -1 for a buffer with its own mapping, as it was too big or the arenas ran out
+		async_io_buffer_header *next;
+		async_io_buffer_header(async_io_buffer_pool *_pool, void *_data, size_t _size, int _sizeclass) : refcount(0), pool(_pool), data(_data), size(_size), sizeclass(_sizeclass), next(nullptr) { }
+	};
+	/* Keeps a free list per power of two size class of buffer, carving new ones from large arenas which are
+	registered with the backend when it can. Arenas are never unmapped before the pool dies, and the pool
+	outlives its dispatcher for as long as any of its buffers are still referenced.
+	*/
+	struct async_io_buffer_pool
+	{
+		static const size_t minsize=4096;
+		static const int sizeclasses=11; // 4Kb to 4Mb
+		struct arena
+		{
+			char *addr;
+			int registered;
+		};
+		typedef boost::detail::spinlock lock_t;
+		lock_t lock;
+		std::mutex growlock; // Held while mapping and registering a new arena
+		std::atomic<size_t> outstanding; // Buffers handed out, plus one while the dispatcher lives
+		async_io_buffer_header *freelists[sizeclasses];
+		arena arenas[BUFFER_POOL_ARENAS];
+		std::atomic<size_t> arenascount;
+		char *bump, *bumpend; // What's left of the newest arena
+
+		async_io_buffer_pool() : outstanding(1), arenascount(0), bump(nullptr), bumpend(nullptr)
+		{
+			// Boost's spinlock is so lightweight it has no constructor ...
+			lock.unlock();
+			for(auto &i : freelists)
+				i=nullptr;
+		}
+		~async_io_buffer_pool()
+		{
+			for(auto &i : freelists)
+				while(i)
+				{
+					async_io_buffer_header *h=i;
+					i=h->next;
+					delete h;
+				}
+			for(size_t n=0; n<arenascount; n++)
+				unmap_buffer_memory(arenas[n].addr, BUFFER_POOL_ARENA);
+		}
+		static int sizeclass(size_t length)
+		{
+			int c=0;
+			for(size_t size=minsize; size<length; size<<=1)
+				c++;
+			return c;
+		}
+		// Called by the dispatcher as it dies
+		void release_owner()
+		{
+			if(1==outstanding.fetch_sub(1, std::memory_order_acq_rel))
+				delete this;
+		}
+		// Called in unknown thread when the last reference to a buffer goes
+		void recycle(async_io_buffer_header *h)
+		{
+			if(h->sizeclass<0)
+			{
+				unmap_buffer_memory(h->data, h->size);
+				delete h;
+			}
+			else
+			{
+				lock_guard<lock_t> g(lock);
+				h->next=freelists[h->sizeclass];
+				freelists[h->sizeclass]=h;
+			}
+			if(1==outstanding.fetch_sub(1, std::memory_order_acq_rel))
+				delete this;
+		}
+		// Carves whatever is left of the newest arena into free buffers. Called with the lock held.
+		void int_retire_bump()
+		{
+			for(int c=sizeclasses-1; c>=0; c--)
+				for(size_t size=minsize<<c; bumpend-bump>=(ptrdiff_t) size; bump+=size)
+				{
+					async_io_buffer_header *h=new async_io_buffer_header(this, bump, size, c);
+					h->next=freelists[c];
+					freelists[c]=h;
+				}
+		}
+		// Called in unknown thread
+		async_io_buffer allocate(async_file_io_dispatcher_base *parent, size_t length)
+		{
+			async_io_buffer ret;
+			int c=sizeclass(length);
+			async_io_buffer_header *h=nullptr;
+			while(!h && c<sizeclasses)
+			{
+				size_t size=minsize<<c;
+				{
+					lock_guard<lock_t> g(lock);
+					if((h=freelists[c]))
+					{
+						freelists[c]=h->next;
+						h->next=nullptr;
+						break;
+					}
+					if(bumpend-bump>=(ptrdiff_t) size)
+					{
+						h=new async_io_buffer_header(this, bump, size, c);
+						bump+=size;
+						break;
+					}
+					if(BUFFER_POOL_ARENAS==arenascount.load(std::memory_order_relaxed))
+						break;
+				}
+				// Map and register another arena outside the lock, as both may take a while. Only one thread grows
+				// the pool at a time, so the index it registers the arena as stays its own.
+				lock_guard<std::mutex> growing(growlock);
+				size_t idx;
+				{
+					lock_guard<lock_t> g(lock);
+					idx=arenascount.load(std::memory_order_relaxed);
+					if(BUFFER_POOL_ARENAS==idx || freelists[c] || bumpend-bump>=(ptrdiff_t) size)
+						continue; // Someone else got there first
+				}
+				char *addr=(char *) map_buffer_memory(BUFFER_POOL_ARENA, true);
+				int registered=parent->int_register_buffers(idx, addr, BUFFER_POOL_ARENA) ? (int) idx : -1;
+				lock_guard<lock_t> g(lock);
+				arenas[idx].addr=addr;
+				arenas[idx].registered=registered;
+				arenascount.store(idx+1, std::memory_order_release);
+				int_retire_bump();
+				bump=addr;
+				bumpend=addr+BUFFER_POOL_ARENA;
+			}
+			if(!h)
+			{
+				// Too big for an arena, or the arenas have run out
+				size_t size=(length+minsize-1)&~(minsize-1);
+				void *addr=map_buffer_memory(size, false);
+				try
+				{
+					h=new async_io_buffer_header(this, addr, size, -1);
+				}
+				catch(...)
+				{
+					unmap_buffer_memory(addr, size);
+					throw;
+				}
+			}
+			outstanding.fetch_add(1, std::memory_order_relaxed);
+			ret.h=h;
+			ret._data=h->data;
+			ret._size=h->size;
+			return ret;
+		}
+		// Returns the index an arena holding all of addr was registered with the backend as, or -1. Called in unknown thread.
+		int registered(const void *addr, size_t length) const
+		{
+			for(size_t n=0, no=arenascount.load(std::memory_order_acquire); n<no; n++)
+				if((const char *) addr>=arenas[n].addr && (const char *) addr+length<=arenas[n].addr+BUFFER_POOL_ARENA)
+					return arenas[n].registered;
+			return -1;
+		}
+	};
+	void intrusive_ptr_add_ref(async_io_buffer_header *h)
+	{
+		h->refcount.fetch_add(1, std::memory_order_relaxed);
+	}
+	void intrusive_ptr_release(async_io_buffer_header *h)
+	{
+		if(1==h->refcount.fetch_sub(1, std::memory_order_acq_rel))
+			h->pool->recycle(h);
+	}
+
+	/* Op states are carved from per-shard slabs and returned to them when their last reference goes, so in
+	steady state making an op allocates nothing. Users may hold states long after their dispatcher has gone,
+	so like the buffer pool this deletes itself once the dispatcher and every state handed out have.
+	*/
+	struct async_io_op_state_pool
+	{
+		static const size_t shards=64, slabsize=64; // As many shards as the dispatcher has for op records
+		typedef boost::detail::spinlock lock_t;
+		struct shard_t
+		{
+			lock_t lock;
+			async_io_op_state *freelist;
+			std::vector<std::unique_ptr<async_io_op_state[]>> slabs;
+
+			shard_t() : freelist(nullptr)
+			{
+				// Boost's spinlock is so lightweight it has no constructor ...
+				lock.unlock();
+			}
+		};
+		std::atomic<size_t> outstanding; // States handed out, plus one while the dispatcher lives
+		std::once_flag ownerset;
+		std::weak_ptr<async_file_io_dispatcher_base> owner;
+		shard_t states[shards];
+
+		async_io_op_state_pool() : outstanding(1) { }
+		// Called by the dispatcher as it dies
+		void release_owner()
+		{
+			if(1==outstanding.fetch_sub(1, std::memory_order_acq_rel))
+				delete this;
+		}
+		// Called in unknown thread
+		async_io_op_state *allocate(async_file_io_dispatcher_base *parent, size_t id)
+		{
+			std::call_once(ownerset, [this, parent]{ owner=parent->shared_from_this(); });
+			shard_t &shard=states[id & (shards-1)];
+			async_io_op_state *s;
+			{
+				lock_guard<lock_t> g(shard.lock);
+				if(!shard.freelist)
+				{
+					shard.slabs.push_back(std::unique_ptr<async_io_op_state[]>(new async_io_op_state[slabsize]));
+					async_io_op_state *slab=shard.slabs.back().get();
+					for(size_t n=0; n<slabsize; n++)
+					{
+						slab[n].shard=(unsigned)(id & (shards-1));
+						slab[n].pool=this;
+						slab[n].next=shard.freelist;
+						shard.freelist=slab+n;
+					}
+				}
+				s=shard.freelist;
+				shard.freelist=s->next;
+			}
+			s->next=nullptr;
+			outstanding.fetch_add(1, std::memory_order_relaxed);
+			return s;
+		}
+		// Called in unknown thread once a state has been emptied
+		void recycle(async_io_op_state *s)
+		{
+			{
+				shard_t &shard=states[s->shard];
+				lock_guard<lock_t> g(shard.lock);
+				s->next=shard.freelist;
+				shard.freelist=s;
+			}
+			if(1==outstanding.fetch_sub(1, std::memory_order_acq_rel))
+				delete this;
+		}
+	};
+
+	struct async_file_io_dispatcher_base_p
+	{
+		thread_pool &pool;
+		file_flags flagsforce, flagsmask;
+
+		typedef boost::detail::spinlock fdslock_t;
+		typedef boost::detail::spinlock opslock_t;
+		/* In flight ops are sharded by id so submission and completion on different cores rarely contend.
+		Never hold more than one shard's lock at once. Each shard keeps a free list of op records and an
+		intrusive hash table of the in flight ones, so in steady state neither allocates.
+		*/
+		struct opsshard_t
+		{
+			static const size_t slabsize=64;
+			opslock_t lock;
+			size_t count;
+			std::vector<async_file_io_dispatcher_op *> buckets; // Always a power of two long
+			async_file_io_dispatcher_op *freelist;
+			std::vector<std::unique_ptr<async_file_io_dispatcher_op[]>> slabs;
+			std::shared_ptr<async_file_io_dispatcher_base> self; // Keeps the dispatcher alive while this shard has ops in flight
+
+			opsshard_t() : count(0), buckets(256), freelist(nullptr) { }
+			size_t bucket(size_t id) const { return (id/opsshards) & (buckets.size()-1); }
+			async_file_io_dispatcher_op *find(size_t id) const
+			{
+				async_file_io_dispatcher_op *op=buckets[bucket(id)];
+				while(op && op->id!=id)
+					op=op->hashnext;
+				return op;
+			}
+			void insert(async_file_io_dispatcher_op *op)
+			{
+				if(count>=buckets.size())
+				{
+					std::vector<async_file_io_dispatcher_op *> old(buckets.size()*2);
+					old.swap(buckets);
+					for(auto i : old)
+						while(i)
+						{
+							auto next=i->hashnext;
+							i->hashnext=buckets[bucket(i->id)];
+							buckets[bucket(i->id)]=i;
+							i=next;
+						}
+				}
+				async_file_io_dispatcher_op *&head=buckets[bucket(op->id)];
+				op->hashnext=head;
+				head=op;
+				++count;
+			}
+			async_file_io_dispatcher_op *erase(size_t id)
+			{
+				for(async_file_io_dispatcher_op **i=&buckets[bucket(id)]; *i; i=&(*i)->hashnext)
+					if((*i)->id==id)
+					{
+						async_file_io_dispatcher_op *op=*i;
+						*i=op->hashnext;
+						op->hashnext=nullptr;
+						--count;
+						return op;
+					}
+				return nullptr;
+			}
+			async_file_io_dispatcher_op *allocate()
+			{
+				if(!freelist)
+				{
+					slabs.push_back(std::unique_ptr<async_file_io_dispatcher_op[]>(new async_file_io_dispatcher_op[slabsize]));
+					async_file_io_dispatcher_op *slab=slabs.back().get();
+					for(size_t n=0; n<slabsize; n++)
+					{
+						slab[n].hashnext=freelist;
+						freelist=slab+n;
+					}
+				}
+				async_file_io_dispatcher_op *op=freelist;
+				freelist=op->hashnext;
+				op->hashnext=nullptr;
+				return op;
+			}
+			void deallocate(async_file_io_dispatcher_op *op)
+			{
+				op->id=0;
+				op->h.reset();
+				op->boundf.reset();
+				op->completionnext=op->completionshead=op->completionstail=nullptr;
+				op->jointo=nullptr;
+				op->hashnext=freelist;
+				freelist=op;
+			}
+		};
+		static const size_t opsshards=64; // Must be a power of two
+		fdslock_t fdslock; std::unordered_map<void *, std::weak_ptr<async_io_handle>> fds;
+		std::atomic<size_t> monotoniccount, opscount;
+		std::atomic<size_t> groupfsyncs; // How many fsyncs sync groups have issued
+		opsshard_t ops[opsshards];
+		async_io_buffer_pool *bufferpool;
+		async_io_op_state_pool *opstates;
+
+		async_file_io_dispatcher_base_p(thread_pool &_pool, file_flags _flagsforce, file_flags _flagsmask) : pool(_pool),
+			flagsforce(_flagsforce), flagsmask(_flagsmask), monotoniccount(0), opscount(0), groupfsyncs(0), bufferpool(new async_io_buffer_pool), opstates(new async_io_op_state_pool)
+		{
+			// Boost's spinlock is so lightweight it has no constructor ...
+			fdslock.unlock();
+			ANNOTATE_RWLOCK_CREATE(&fdslock);
+			for(auto &shard : ops)
+				shard.lock.unlock();
+		}
+		~async_file_io_dispatcher_base_p()
+		{
+			opstates->release_owner();
+			bufferpool->release_owner();
+			ANNOTATE_RWLOCK_DESTROY(&fdslock);
+		}
+		opsshard_t &opsshard(size_t id) { return ops[id & (opsshards-1)]; }
+	};
+	class async_file_io_dispatcher_compat;
+	class async_file_io_dispatcher_windows;
+	class async_file_io_dispatcher_linux;
+	class async_file_io_dispatcher_qnx;
+	struct immediate_async_ops
+	{
+		typedef std::pair<async_file_io_dispatcher_op *, std::shared_ptr<detail::async_io_handle>> item_t;
+		// Most calls make just one or two ops, so the first few needn't touch the heap
+		static const size_t inline_items=4;
+		item_t inlineitems[inline_items];
+		size_t inlinecount;
+		std::vector<item_t> toexecute;
+
+		immediate_async_ops() : inlinecount(0) { }
+		// Runs op when this is destructed
+		void enqueue(async_file_io_dispatcher_op *op, std::shared_ptr<detail::async_io_handle> h)
+		{
+			if(inlinecount<inline_items)
+			{
+				inlineitems[inlinecount].first=op;
+				inlineitems[inlinecount++].second=std::move(h);
+			}
+			else
+				toexecute.push_back(std::make_pair(op, std::move(h)));
+		}
+		~immediate_async_ops()
+		{
+			for(size_t n=0; n<inlinecount; n++)
+				run_async_file_io_dispatcher_op(inlineitems[n].first, std::move(inlineitems[n].second));
+			for(auto &i : toexecute)
+				run_async_file_io_dispatcher_op(i.first, std::move(i.second));
+		}
+	private:
+		immediate_async_ops(const immediate_async_ops &);
+		immediate_async_ops &operator=(const immediate_async_ops &);
+		immediate_async_ops(immediate_async_ops &&);
+		immediate_async_ops &operator=(immediate_async_ops &&);
+	};
+}
+
+namespace detail
+{
+	// Anyone waiting for an op to complete sleeps here, hashed by op, so op states needn't each carry a mutex and condvar
+	struct async_io_op_state_waiters_t
+	{
+		std::mutex lock;
+		std::condition_variable cond;
+	};
+	static async_io_op_state_waiters_t &async_io_op_state_waiters(const async_io_op_state *s)
+	{
+		static async_io_op_state_waiters_t waiters[16];
+		return waiters[(((size_t) s)/64) & 15];
+	}
+}
+
+// Called in unknown thread
+void detail::async_io_op_state::set(std::shared_ptr<async_io_handle> h, exception_ptr e)
+{
+	result=std::move(h);
+	exception=std::move(e);
+	if(state.fetch_or(1)&2)
+	{
+		async_io_op_state_waiters_t &waiters=async_io_op_state_waiters(this);
+		// Waiters check readiness under this lock, so taking it means none can miss this notify
+		{
+			lock_guard<std::mutex> lockh(waiters.lock);
+		}
+		waiters.cond.notify_all();
+	}
+}
+
+void detail::async_io_op_state::int_wait() const
+{
+	async_io_op_state_waiters_t &waiters=async_io_op_state_waiters(this);
+	std::unique_lock<std::mutex> lockh(waiters.lock);
+	if(const_cast<std::atomic<int> &>(state).fetch_or(2)&1)
+		return;
+	while(!(state&1))
+		waiters.cond.wait(lockh);
+}
+
+// Called in unknown thread when the last reference to this state goes
+void detail::async_io_op_state::recycle() const
+{
+	async_io_op_state *s=const_cast<async_io_op_state *>(this);
+	// The result may hold the last reference to the dispatcher and so to my pool, so only drop it once I'm back in the pool
+	std::shared_ptr<async_io_handle> h(std::move(s->result));
+	exception_ptr e(std::move(s->exception));
+	s->state.store(0, std::memory_order_relaxed);
+	pool->recycle(s);
+}
+
+std::shared_ptr<async_file_io_dispatcher_base> detail::async_io_op_state::parent() const
+{
+	return pool->owner.lock();
+}
+
+async_file_io_dispatcher_base::async_file_io_dispatcher_base(thread_pool &threadpool, file_flags flagsforce, file_flags flagsmask) : p(new detail::async_file_io_dispatcher_base_p(threadpool, flagsforce, flagsmask))
+{
+}
+
+async_file_io_dispatcher_base::~async_file_io_dispatcher_base()
+{
+	int_wait_for_ops();
+	delete p;
+}
+
+async_io_buffer async_file_io_dispatcher_base::allocate_buffer(size_t length)
+{
+	if(!length)
+		throw std::runtime_error("Inputs are invalid.");
+	return p->bufferpool->allocate(this, length);
+}
+
+bool async_file_io_dispatcher_base::int_register_buffers(size_t idx, void *addr, size_t length)
+{
+	return false;
+}
+
+int async_file_io_dispatcher_base::int_registered_buffers(const void *addr, size_t length) const
+{
+	return p->bufferpool->registered(addr, length);
+}
+
+void async_file_io_dispatcher_base::int_wait_for_ops()
+{
+	for(;;)
+	{
+		std::vector<boost::intrusive_ptr<detail::async_io_op_state>> outstanding;
+		outstanding.reserve(p->opscount);
+		for(auto &shard : p->ops)
+		{
+			lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(shard.lock);
+			for(auto op : shard.buckets)
+				for(; op; op=op->hashnext)
+					outstanding.push_back(op->h);
+		}
+		if(outstanding.empty()) break;
+		for(auto &op : outstanding)
+			op->wait();
+	}
+}
+
+void async_file_io_dispatcher_base::int_add_io_handle(void *key, std::shared_ptr<detail::async_io_handle> h)
+{
+	lock_guard<detail::async_file_io_dispatcher_base_p::fdslock_t> lockh(p->fdslock);
 	ANNOTATE_RWLOCK_ACQUIRED(&p->fdslock, 1);
 	p->fds.insert(make_pair(key, std::weak_ptr<detail::async_io_handle>(h)));
 	ANNOTATE_RWLOCK_RELEASED(&p->fdslock, 1);
@@ -351,8 +1776,16 @@ file_flags async_file_io_dispatcher_base::fileflags(file_flags flags) const
 
 size_t async_file_io_dispatcher_base::wait_queue_depth() const
 {
-	lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(p->opslock);
-	return p->ops.size();
+	return p->opscount;
+}
+
+void async_file_io_dispatcher_base::set_file_handle_cache(size_t)
+{
+}
+
+size_t async_file_io_dispatcher_base::fsync_count() const
+{
+	return p->groupfsyncs;
 }
 
 size_t async_file_io_dispatcher_base::count() const
@@ -379,7 +1812,6 @@ std::vector<async_io_op> async_file_io_dispatcher_base::completion(const std::ve
 	ret.reserve(callbacks.size());
 	std::vector<async_io_op>::const_iterator i;
 	std::vector<std::pair<async_op_flags, std::function<async_file_io_dispatcher_base::completion_t>>>::const_iterator c;
-	lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(p->opslock);
 	detail::immediate_async_ops immediates;
 	if(ops.empty())
 	{
@@ -395,84 +1827,71 @@ std::vector<async_io_op> async_file_io_dispatcher_base::completion(const std::ve
 // Called in unknown thread
 void async_file_io_dispatcher_base::complete_async_op(size_t id, std::shared_ptr<detail::async_io_handle> h, exception_ptr e)
 {
-	lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(p->opslock);
+	// If I was the last op in flight in my shard, I hold its reference to this dispatcher, and my state's
+	// result may hold another, so both must be released after everything else
+	std::shared_ptr<async_file_io_dispatcher_base> self;
+	boost::intrusive_ptr<detail::async_io_op_state> state;
 	detail::immediate_async_ops immediates;
-	// Find me in ops, remove my completions and delete me from extant ops
-	std::unordered_map<size_t, detail::async_file_io_dispatcher_op>::iterator it(p->ops.find(id));
-	if(p->ops.end()==it)
+	detail::async_file_io_dispatcher_op *completions;
 	{
-#ifndef NDEBUG
-		std::vector<size_t> opsids;
-		for(auto &i : p->ops)
-			opsids.push_back(i.first);
-		std::sort(opsids.begin(), opsids.end());
-#endif
-		throw std::runtime_error("Failed to find this operation in list of currently executing operations");
+		// Find me in ops, remove my completions and recycle me
+		detail::async_file_io_dispatcher_base_p::opsshard_t &shard=p->opsshard(id);
+		lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(shard.lock);
+		detail::async_file_io_dispatcher_op *op=shard.erase(id);
+		if(!op)
+			throw std::runtime_error("Failed to find this operation in list of currently executing operations");
+		// Anyone who can no longer find me must find my result instead
+		state=std::move(op->h);
+		state->set(h, e);
+		completions=op->completionshead;
+		shard.deallocate(op);
+		if(!shard.count)
+			self=std::move(shard.self);
+		--p->opscount;
 	}
-	if(!it->second.completions.empty())
+	// Only set inside a thread pool worker running ops, never in user threads
+	detail::inline_continuation *next=detail::current_inline_continuation;
+	while(completions)
 	{
-		// Remove completions as we're about to modify p->ops which will invalidate it
-		std::vector<detail::async_file_io_dispatcher_op::completion_t> completions(std::move(it->second.completions));
-		for(auto &c : completions)
+		// Enqueue each completion
+		detail::async_file_io_dispatcher_op *c=completions;
+		completions=c->completionnext;
+		c->completionnext=nullptr;
+		if(c->jointo)
 		{
-			// Enqueue each completion
-			it=p->ops.find(c.first);
-			if(p->ops.end()==it)
-				throw std::runtime_error("Failed to find this completion operation in list of currently executing operations");
-			if(!!(it->second.flags & async_op_flags::ImmediateCompletion))
-			{
-				// If he was set up with a detached future, use that instead
-				if(it->second.detached_promise)
-				{
-					*it->second.h=it->second.detached_promise->get_future();
-					immediates.enqueue(std::bind(c.second, h));
-				}
-				else
-					*it->second.h=immediates.enqueue(std::bind(c.second, h));
-			}
-			else
+			// Recycle the link before counting down, as the join may be run and recycled the moment I do
+			detail::async_file_io_dispatcher_op *j=c->jointo;
 			{
-				// If he was set up with a detached future, use that instead
-				if(it->second.detached_promise)
-				{
-					*it->second.h=it->second.detached_promise->get_future();
-					threadpool().enqueue(std::bind(c.second, h));
-				}
-				else
-					*it->second.h=threadpool().enqueue(std::bind(c.second, h));
+				detail::async_file_io_dispatcher_base_p::opsshard_t &joinshard=p->opsshard(j->id);
+				lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(joinshard.lock);
+				joinshard.deallocate(c);
 			}
-			DEBUG_PRINT("C %u > %u %p\n", (unsigned) id, (unsigned) c.first, h.get());
+			if(--j->joinsremaining)
+				continue;
+			c=j;
 		}
-		// Restore it to my id
-		it=p->ops.find(id);
-		if(p->ops.end()==it)
+		DEBUG_PRINT("C %u > %u %p\n", (unsigned) id, (unsigned) c->id, h.get());
+		if(!!(c->flags & async_op_flags::ImmediateCompletion))
+			immediates.enqueue(c, h);
+		else if(next && !next->op && next->run<MAX_INLINE_CONTINUATIONS)
 		{
-	#ifndef NDEBUG
-			std::vector<size_t> opsids;
-			for(auto &i : p->ops)
-				opsids.push_back(i.first);
-			std::sort(opsids.begin(), opsids.end());
-	#endif
-			throw std::runtime_error("Failed to find this operation in list of currently executing operations");
+			// This worker is about to go idle, so have it run the first continuation itself
+			next->op=c;
+			next->h=h;
 		}
-	}
-	if(it->second.detached_promise)
-	{
-		if(e)
-			it->second.detached_promise->set_exception(e);
 		else
-			it->second.detached_promise->set_value(h);
+			threadpool().post(std::bind(&detail::run_async_file_io_dispatcher_ops, c, h));
 	}
-	p->ops.erase(it);
 	DEBUG_PRINT("R %u %p\n", (unsigned) id, h.get());
 }
 
 // Called in unknown thread
-template<class F, class... Args> std::shared_ptr<detail::async_io_handle> async_file_io_dispatcher_base::invoke_async_op_completions(size_t id, std::shared_ptr<detail::async_io_handle> h, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, Args...), Args... args)
+template<class F, class... Args> std::shared_ptr<detail::async_io_handle> async_file_io_dispatcher_base::invoke_async_op_completions(size_t id, std::shared_ptr<detail::async_io_handle> h, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, Args...), Args &... args)
 {
 	try
 	{
-		completion_returntype ret((static_cast<F *>(this)->*f)(id, h, args...));
+		// My arguments are only ever used the once, so move them into the implementation rather than copy them
+		completion_returntype ret((static_cast<F *>(this)->*f)(id, h, std::move(args)...));
 		// If boolean is false, reschedule completion notification setting it to ret.second, otherwise complete now
 		if(ret.first)
 		{
@@ -480,21 +1899,12 @@ template<class F, class... Args> std::shared_ptr<detail::async_io_handle> async_
 		}
 		else
 		{
-			// Make sure this was set up for deferred completion
-	#ifndef NDEBUG
-			lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(p->opslock);
-			std::unordered_map<size_t, detail::async_file_io_dispatcher_op>::iterator it(p->ops.find(id));
-			if(p->ops.end()==it)
-			{
+			// Make sure this was set up for deferred completion. It may already have been completed by another thread.
 	#ifndef NDEBUG
-				std::vector<size_t> opsids;
-				for(auto &i : p->ops)
-					opsids.push_back(i.first);
-				std::sort(opsids.begin(), opsids.end());
-	#endif
-				throw std::runtime_error("Failed to find this operation in list of currently executing operations");
-			}
-			if(!it->second.detached_promise)
+			detail::async_file_io_dispatcher_base_p::opsshard_t &shard=p->opsshard(id);
+			lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(shard.lock);
+			detail::async_file_io_dispatcher_op *op=shard.find(id);
+			if(op && !(op->flags & async_op_flags::DetachedFuture))
 			{
 				// If this trips, it means a completion handler tried to defer signalling
 				// completion but it hadn't been set up with a detached future
@@ -512,7 +1922,6 @@ template<class F, class... Args> std::shared_ptr<detail::async_io_handle> async_
 		DEBUG_PRINT("E %u begin\n", (unsigned) id);
 		complete_async_op(id, h, e);
 		DEBUG_PRINT("E %u end\n", (unsigned) id);
-		throw;
 	}
 	catch(const std::exception_ptr &)
 #else
@@ -523,84 +1932,188 @@ template<class F, class... Args> std::shared_ptr<detail::async_io_handle> async_
 		DEBUG_PRINT("E %u begin\n", (unsigned) id);
 		complete_async_op(id, h, e);
 		DEBUG_PRINT("E %u end\n", (unsigned) id);
-		throw;
 	}
+	// The exception now lives in my op state, so there is nobody to rethrow it to
+	return h;
 }
 
-// You MUST hold opslock before entry!
-template<class F, class... Args> async_io_op async_file_io_dispatcher_base::chain_async_op(detail::immediate_async_ops &immediates, int optype, const async_io_op &precondition, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, Args...), Args... args)
-{	
-	size_t thisid=0;
-	while(!(thisid=++p->monotoniccount));
-#if 0 //ndef NDEBUG
-	if(!p->ops.empty())
-	{
-		std::vector<size_t> opsids;
-		for(auto &i : p->ops)
-			opsids.push_back(i.first);
-		std::sort(opsids.begin(), opsids.end());
-		assert(thisid==opsids.back()+1);
-	}
-#endif
+template<class F, class... Args> void async_file_io_dispatcher_base::bind_async_op(detail::op_function &boundf, size_t id, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, Args...), Args... args)
+{
 	// Wrap supplied implementation routine with a completion dispatcher
 	auto wrapperf=&async_file_io_dispatcher_base::invoke_async_op_completions<F, Args...>;
 	// Bind supplied implementation routine to this, unique id and any args they passed
-	typename detail::async_file_io_dispatcher_op::completion_t boundf(std::make_pair(thisid, std::bind(wrapperf, this, thisid, std::placeholders::_1, f, args...)));
-	// Make a new async_io_op ready for returning
-	async_io_op ret(shared_from_this(), thisid);
+	boundf=detail::op_function(std::bind(wrapperf, this, id, std::placeholders::_1, f, std::move(args)...));
+}
+
+// Called in unknown thread
+template<class F, class A> std::shared_ptr<detail::async_io_handle> async_file_io_dispatcher_base::invoke_batch_op(const detail::batch_op_function &boundf, size_t id, std::shared_ptr<detail::async_io_handle> h, const async_batch_op_req &req)
+{
+	auto f=reinterpret_cast<completion_returntype (F::*)(size_t, std::shared_ptr<detail::async_io_handle>, A)>(boundf.impl);
+	// The plan keeps its request for next time, so the implementation gets a copy
+	A arg(detail::batch_op_arg<A>::get(req));
+	return boundf.parent->invoke_async_op_completions<F, A>(id, std::move(h), f, arg);
+}
+
+template<class F, class A> void async_file_io_dispatcher_base::bind_plan_op(detail::batch_op_function &boundf, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, A))
+{
+	boundf.invoke=&async_file_io_dispatcher_base::invoke_batch_op<F, A>;
+	boundf.parent=this;
+	boundf.impl=reinterpret_cast<detail::batch_op_function::impl_t>(f);
+}
+
+// Called in unknown thread
+void async_file_io_dispatcher_base::int_chain_async_op(detail::immediate_async_ops &immediates, detail::async_file_io_dispatcher_op *op, const async_io_op &precondition)
+{
+	DEBUG_PRINT("I %u < %u (%s)\n", (unsigned) op->id, (unsigned) precondition.id, detail::optypes[static_cast<int>(op->optype)]);
 	bool done=false;
 	if(precondition.id)
 	{
-		// If still in flight, chain boundf to be executed when precondition completes
-		auto dep(p->ops.find(precondition.id));
-		if(p->ops.end()!=dep)
+		// If still in flight, chain myself to be executed when precondition completes
+		detail::async_file_io_dispatcher_base_p::opsshard_t &depshard=p->opsshard(precondition.id);
+		lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(depshard.lock);
+		detail::async_file_io_dispatcher_op *dep=depshard.find(precondition.id);
+		if(dep)
 		{
-			dep->second.completions.push_back(boundf);
+			if(dep->completionstail)
+				dep->completionstail->completionnext=op;
+			else
+				dep->completionshead=op;
+			dep->completionstail=op;
 			done=true;
 		}
 	}
-	auto undep=NiallsCPP11Utilities::Undoer([done, this, precondition](){
-		if(done)
-		{
-			auto dep(p->ops.find(precondition.id));
-			dep->second.completions.pop_back();
-		}
-	});
 	if(!done)
 	{
 		// Bind input handle now and queue immediately to next available thread worker
 		std::shared_ptr<detail::async_io_handle> h;
-		// Boost's shared_future has get() as non-const which is weird, because it doesn't
-		// delete the data after retrieval.
-		if(precondition.h->valid())
-			h=const_cast<shared_future<std::shared_ptr<detail::async_io_handle>> &>(*precondition.h).get();
-		else if(precondition.id)
+		if(precondition.id)
 		{
-			// It should never happen that precondition.id is valid but removed from extant ops
-			// which indicates it completed and yet h remains invalid
-			assert(0);
-			std::terminate();
+			// Ops become ready before they are removed from extant ops, so this never blocks. Like
+			// complete_async_op() hand on the handle even if the precondition errored, else whether
+			// chaining throws would depend on who won the race.
+			assert(precondition.h->is_ready());
+			h=precondition.h->result;
 		}
-		if(!!(flags & async_op_flags::ImmediateCompletion))
-			*ret.h=immediates.enqueue(std::bind(boundf.second, h)).share();
+		if(!!(op->flags & async_op_flags::ImmediateCompletion))
+			immediates.enqueue(op, h);
 		else
-			*ret.h=threadpool().enqueue(std::bind(boundf.second, h)).share();
+			threadpool().post(std::bind(&detail::run_async_file_io_dispatcher_ops, op, h));
 	}
-	auto opsit=p->ops.insert(std::make_pair(thisid, detail::async_file_io_dispatcher_op((detail::OpType) optype, flags, ret.h)));
-	assert(opsit.second);
-	DEBUG_PRINT("I %u < %u (%s)\n", (unsigned) thisid, (unsigned) precondition.id, detail::optypes[static_cast<int>(optype)]);
-	auto unopsit=NiallsCPP11Utilities::Undoer([this, opsit, thisid](){
-		p->ops.erase(opsit.first);
+}
+
+// Called in unknown thread
+template<class F, class... Args> async_io_op async_file_io_dispatcher_base::chain_async_op(detail::immediate_async_ops &immediates, int optype, const async_io_op &precondition, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, Args...), Args... args)
+{	
+	size_t thisid=0;
+	while(!(thisid=++p->monotoniccount));
+	detail::op_function boundf;
+	bind_async_op(boundf, thisid, f, std::move(args)...);
+	// Make a new async_io_op ready for returning
+	async_io_op ret(p->opstates->allocate(this, thisid), thisid);
+	// Register myself before chaining onto my precondition, because it may complete and look me up at any moment
+	detail::async_file_io_dispatcher_base_p::opsshard_t &shard=p->opsshard(thisid);
+	detail::async_file_io_dispatcher_op *op;
+	{
+		lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(shard.lock);
+		op=shard.allocate();
+		op->id=thisid;
+		op->optype=(detail::OpType) optype;
+		op->flags=flags;
+		op->h=ret.h;
+		op->boundf=std::move(boundf);
+		shard.insert(op);
+		if(!shard.self)
+			shard.self=shared_from_this();
+		++p->opscount;
+	}
+	auto unopsit=NiallsCPP11Utilities::Undoer([this, &shard, thisid](){
+		std::shared_ptr<async_file_io_dispatcher_base> self;
+		lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(shard.lock);
+		shard.deallocate(shard.erase(thisid));
+		if(!shard.count)
+			self=std::move(shard.self);
+		--p->opscount;
 		DEBUG_PRINT("E R %u\n", (unsigned) thisid);
 	});
-	if(!!(flags & async_op_flags::DetachedFuture))
+	int_chain_async_op(immediates, op, precondition);
+	unopsit.dismiss();
+	return ret;
+}
+
+// Called in unknown thread
+template<class F, class... Args> async_io_op async_file_io_dispatcher_base::join_async_op(detail::immediate_async_ops &immediates, int optype, const std::vector<async_io_op> &preconditions, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, Args...), Args... args)
+{
+	size_t thisid=0;
+	while(!(thisid=++p->monotoniccount));
+	detail::op_function boundf;
+	bind_async_op(boundf, thisid, f, std::move(args)...);
+	async_io_op ret(p->opstates->allocate(this, thisid), thisid);
+	// Register myself along with a link for each precondition. I hold one count myself so
+	// I can't be run before I've finished chaining the links.
+	detail::async_file_io_dispatcher_base_p::opsshard_t &shard=p->opsshard(thisid);
+	detail::async_file_io_dispatcher_op *op;
+	// Links are never in the hash table, so until chained they are listed through their hashnext
+	detail::async_file_io_dispatcher_op *links=nullptr;
+	{
+		lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(shard.lock);
+		op=shard.allocate();
+		op->id=thisid;
+		op->optype=(detail::OpType) optype;
+		op->flags=flags;
+		op->h=ret.h;
+		op->boundf=std::move(boundf);
+		op->joinsremaining=preconditions.size()+1;
+		for(size_t n=0; n<preconditions.size(); n++)
+		{
+			detail::async_file_io_dispatcher_op *link=shard.allocate();
+			link->jointo=op;
+			link->hashnext=links;
+			links=link;
+		}
+		shard.insert(op);
+		if(!shard.self)
+			shard.self=shared_from_this();
+		++p->opscount;
+	}
+	DEBUG_PRINT("I %u < %u preconditions (%s)\n", (unsigned) thisid, (unsigned) preconditions.size(), detail::optypes[static_cast<int>(optype)]);
+	size_t alreadydone=1;
+	for(size_t n=0; n<preconditions.size(); n++)
 	{
-		opsit.first->second.detached_promise.reset(new promise<std::shared_ptr<detail::async_io_handle>>);
+		const async_io_op &precondition=preconditions[n];
+		detail::async_file_io_dispatcher_op *link=links;
+		links=link->hashnext;
+		link->hashnext=nullptr;
+		bool done=false;
+		if(precondition.id)
+		{
+			detail::async_file_io_dispatcher_base_p::opsshard_t &depshard=p->opsshard(precondition.id);
+			lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(depshard.lock);
+			detail::async_file_io_dispatcher_op *dep=depshard.find(precondition.id);
+			if(dep)
+			{
+				if(dep->completionstail)
+					dep->completionstail->completionnext=link;
+				else
+					dep->completionshead=link;
+				dep->completionstail=link;
+				done=true;
+			}
+		}
 		if(!done)
-			*opsit.first->second.h=opsit.first->second.detached_promise->get_future();
+		{
+			lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(shard.lock);
+			shard.deallocate(link);
+			++alreadydone;
+		}
+	}
+	if(!(op->joinsremaining-=alreadydone))
+	{
+		// Everything had already completed. My implementation fetches what it needs from my preconditions.
+		if(!!(flags & async_op_flags::ImmediateCompletion))
+			immediates.enqueue(op, std::shared_ptr<detail::async_io_handle>());
+		else
+			threadpool().post(std::bind(&detail::run_async_file_io_dispatcher_ops, op, std::shared_ptr<detail::async_io_handle>()));
 	}
-	unopsit.dismiss();
-	undep.dismiss();
 	return ret;
 }
 template<class F, class T> std::vector<async_io_op> async_file_io_dispatcher_base::chain_async_ops(int optype, const std::vector<async_io_op> &preconditions, const std::vector<T> &container, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, T))
@@ -610,7 +2123,6 @@ template<class F, class T> std::vector<async_io_op> async_file_io_dispatcher_bas
 	assert(preconditions.size()==container.size());
 	if(preconditions.size()!=container.size())
 		throw std::runtime_error("preconditions size does not match size of ops data");
-	lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(p->opslock);
 	detail::immediate_async_ops immediates;
 	auto precondition_it=preconditions.cbegin();
 	auto container_it=container.cbegin();
@@ -622,7 +2134,6 @@ template<class F> std::vector<async_io_op> async_file_io_dispatcher_base::chain_
 {
 	std::vector<async_io_op> ret;
 	ret.reserve(container.size());
-	lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(p->opslock);
 	detail::immediate_async_ops immediates;
 	for(auto &i : container)
 		ret.push_back(chain_async_op(immediates, optype, i, flags, f, i));
@@ -632,7 +2143,6 @@ template<class F> std::vector<async_io_op> async_file_io_dispatcher_base::chain_
 {
 	std::vector<async_io_op> ret;
 	ret.reserve(container.size());
-	lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(p->opslock);
 	detail::immediate_async_ops immediates;
 	for(auto &i : container)
 		ret.push_back(chain_async_op(immediates, optype, i.precondition, flags, f, i));
@@ -642,12 +2152,64 @@ template<class F, class T> std::vector<async_io_op> async_file_io_dispatcher_bas
 {
 	std::vector<async_io_op> ret;
 	ret.reserve(container.size());
-	lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(p->opslock);
 	detail::immediate_async_ops immediates;
 	for(auto &i : container)
 		ret.push_back(chain_async_op(immediates, optype, i.precondition, flags, f, i));
 	return ret;
 }
+template<class F> std::vector<async_io_op> async_file_io_dispatcher_base::chain_coalesced_writes(const std::vector<async_data_op_req<const void>> &container, async_op_flags flags, completion_returntype (F::*f)(size_t, std::shared_ptr<detail::async_io_handle>, async_data_op_req<const void>))
+{
+	if(container.size()<2)
+		return chain_async_ops((int) detail::OpType::write, container, flags, f);
+	// Order by precondition then offset, so writes adjacent in the same file end up next to one another
+	std::vector<size_t> order(container.size());
+	for(size_t n=0; n<order.size(); n++)
+		order[n]=n;
+	std::stable_sort(order.begin(), order.end(), [&container](size_t a, size_t b) {
+		if(container[a].precondition.id!=container[b].precondition.id)
+			return container[a].precondition.id<container[b].precondition.id;
+		return container[a].where<container[b].where;
+	});
+	std::vector<async_io_op> ret(container.size());
+	detail::immediate_async_ops immediates;
+	for(size_t n=0, m; n<order.size(); n=m)
+	{
+		const async_data_op_req<const void> &first=container[order[n]];
+		size_t bytes=boost::asio::buffer_size(first.buffers), buffers=first.buffers.size();
+		for(m=n+1; m<order.size(); m++)
+		{
+			const async_data_op_req<const void> &next=container[order[m]];
+			size_t nextbytes=boost::asio::buffer_size(next.buffers);
+			if(next.precondition.id!=first.precondition.id || next.where!=first.where+(off_t) bytes
+				|| bytes+nextbytes>MAX_COALESCED_WRITE || buffers+next.buffers.size()>MAX_COALESCED_WRITE_BUFFERS)
+				break;
+			bytes+=nextbytes;
+			buffers+=next.buffers.size();
+		}
+		if(m==n+1)
+		{
+			ret[order[n]]=chain_async_op(immediates, (int) detail::OpType::write, first.precondition, flags, f, first);
+			continue;
+		}
+		async_data_op_req<const void> coalesced(first);
+		coalesced.buffers.reserve(buffers);
+		for(size_t k=n+1; k<m; k++)
+			coalesced.buffers.insert(coalesced.buffers.end(), container[order[k]].buffers.begin(), container[order[k]].buffers.end());
+		async_io_op write(chain_async_op(immediates, (int) detail::OpType::write, first.precondition, flags, f, coalesced));
+		// The rest complete when the write doing their work does
+		for(size_t k=n+1; k<m; k++)
+			ret[order[k]]=chain_async_op(immediates, (int) detail::OpType::write, write, async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_base::docoalescedwrite, write);
+		ret[order[n]]=std::move(write);
+	}
+	return ret;
+}
+
+async_file_io_dispatcher_base::completion_returntype async_file_io_dispatcher_base::docoalescedwrite(size_t id, std::shared_ptr<detail::async_io_handle> h, async_io_op write)
+{
+	if(write.h->has_exception())
+		rethrow_exception(write.h->exception);
+	return std::make_pair(true, h);
+}
 
 namespace detail
 {
@@ -655,7 +2217,7 @@ namespace detail
 	{
 		std::atomic<size_t> togo;
 		std::vector<std::pair<size_t, std::shared_ptr<detail::async_io_handle>>> out;
-		std::vector<std::shared_ptr<shared_future<std::shared_ptr<detail::async_io_handle>>>> outsharedstates;
+		std::vector<boost::intrusive_ptr<detail::async_io_op_state>> outsharedstates;
 		barrier_count_completed_state(const std::vector<async_io_op> &ops) : togo(ops.size()), out(ops.size())
 		{
 			outsharedstates.reserve(ops.size());
@@ -675,13 +2237,12 @@ template<> async_file_io_dispatcher_base::completion_returntype async_file_io_di
 	state.first->out[idx]=std::make_pair(id, h); // This might look thread unsafe, but each idx is unique
 	if(--state.first->togo)
 		return std::make_pair(false, h);
-	exception_ptr this_e(async_io::make_exception_ptr(std::current_exception()));
 	// Last one just completed, so issue completions for everything in out except me
 	detail::barrier_count_completed_state &s=*state.first;
 	for(idx=0; idx<s.out.size(); idx++)
 	{
 		if(idx==state.second) continue;
-		shared_future<std::shared_ptr<detail::async_io_handle>> *thisresult=state.first->outsharedstates[idx].get();
+		detail::async_io_op_state *thisresult=state.first->outsharedstates[idx].get();
 		if(thisresult->has_exception())
 		{
 			// This seems excessive but I don't see any other legal way to extract the exception ...
@@ -708,10 +2269,10 @@ template<> async_file_io_dispatcher_base::completion_returntype async_file_io_di
 			complete_async_op(s.out[idx].first, s.out[idx].second);
 	}
 	idx=state.second;
-	// Am I being called because my precondition threw an exception so we're actually currently inside an exception catch?
-	// If so then duplicate the same exception throw
-	if(this_e)
-		rethrow_exception(this_e);
+	// Did my precondition throw an exception? If so then duplicate the same exception throw
+	detail::async_io_op_state *myresult=s.outsharedstates[idx].get();
+	if(myresult->has_exception())
+		rethrow_exception(myresult->exception);
 	else
 		return std::make_pair(true, h);
 }
@@ -719,8 +2280,9 @@ template<> async_file_io_dispatcher_base::completion_returntype async_file_io_di
 std::vector<async_io_op> async_file_io_dispatcher_base::barrier(const std::vector<async_io_op> &ops)
 {
 #if TRIPLEGIT_VALIDATE_INPUTS
+		// Not validate(), as that would throw errored inputs depending on whether they'd finished yet. We replicate them instead.
 		for(auto &i : ops)
-			if(!i.validate())
+			if(!i.h || !i.id)
 				throw std::runtime_error("Inputs are invalid.");
 #endif
 	// Create a shared state for the completions to be attached to all the items we are waiting upon
@@ -733,183 +2295,2486 @@ std::vector<async_io_op> async_file_io_dispatcher_base::barrier(const std::vecto
 	return chain_async_ops((int) detail::OpType::barrier, ops, statev, async_op_flags::ImmediateCompletion|async_op_flags::DetachedFuture, &async_file_io_dispatcher_base::dobarrier<std::pair<std::shared_ptr<detail::barrier_count_completed_state>, size_t>>);
 }
 
+// Called in unknown thread
+async_file_io_dispatcher_base::completion_returntype async_file_io_dispatcher_base::dojoin(size_t id, std::shared_ptr<detail::async_io_handle> h, std::shared_ptr<std::vector<async_io_op>> ops)
+{
+	// Which precondition completed last is a race, so always replicate the first, and the first error if any
+	for(auto &i : *ops)
+		if(i.h->has_exception())
+			rethrow_exception(i.h->exception);
+	return std::make_pair(true, ops->empty() ? h : ops->front().h->result);
+}
+
+async_io_op async_file_io_dispatcher_base::join(const std::vector<async_io_op> &ops)
+{
+#if TRIPLEGIT_VALIDATE_INPUTS
+		// Not validate(), as errored inputs are replicated rather than thrown
+		for(auto &i : ops)
+			if(!i.h || !i.id)
+				throw std::runtime_error("Inputs are invalid.");
+#endif
+	detail::immediate_async_ops immediates;
+	return join_async_op(immediates, (int) detail::OpType::join, ops, async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_base::dojoin, std::make_shared<std::vector<async_io_op>>(ops));
+}
 
 namespace detail {
-#if defined(WIN32)
-	class async_file_io_dispatcher_windows : public async_file_io_dispatcher_base
+	// Owns a mapped range of a file, unmapping it when the last async_io_mapping referring to it goes
+	struct async_io_mapping_region
 	{
-		// Called in unknown thread
-		completion_returntype dodir(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
-		{
-			BOOL ret=0;
-			req.flags=fileflags(req.flags);
-			if(!!(req.flags & (file_flags::Create|file_flags::CreateOnlyIfNotExist)))
-			{
-				ret=CreateDirectory(req.path.c_str(), NULL);
-				if(!ret && ERROR_ALREADY_EXISTS==GetLastError())
-				{
-					// Ignore already exists unless we were asked otherwise
-					if(!(req.flags & file_flags::CreateOnlyIfNotExist))
-						ret=1;
-				}
-				req.flags=req.flags&~(file_flags::Create|file_flags::CreateOnlyIfNotExist);
-			}
-			DWORD attr=GetFileAttributes(req.path.c_str());
-			if(INVALID_FILE_ATTRIBUTES!=attr && !(attr & FILE_ATTRIBUTE_DIRECTORY))
-				throw std::runtime_error("Not a directory");
-			if(!!(req.flags & file_flags::Read))
-				return dofile(id, _, req);
-			else
-			{
-				// Create empty handle so
-				auto ret=std::make_shared<async_io_handle_windows>(shared_from_this(), req.path);
-				return std::make_pair(true, ret);
-			}
-		}
-		// Called in unknown thread
-		completion_returntype dormdir(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
+		void *addr;
+		size_t length;
+		async_io_mapping_region(void *_addr, size_t _length) : addr(_addr), length(_length) { }
+		~async_io_mapping_region()
 		{
-			req.flags=fileflags(req.flags);
-			ERRHWINFN(RemoveDirectory(req.path.c_str()), req.path);
-			auto ret=std::make_shared<async_io_handle_windows>(shared_from_this(), req.path);
-			return std::make_pair(true, ret);
+#ifdef WIN32
+			UnmapViewOfFile(addr);
+#else
+			munmap(addr, length);
+#endif
 		}
-		// Called in unknown thread
-		completion_returntype dofile(size_t id, std::shared_ptr<detail::async_io_handle>, async_path_op_req req)
+		// Touches every page so none faults when later accessed
+		void prefault() const
 		{
-			DWORD access=0, creation=0, flags=FILE_ATTRIBUTE_NORMAL|FILE_FLAG_OVERLAPPED;
-			req.flags=fileflags(req.flags);
-			if(!!(req.flags & file_flags::Append)) access|=FILE_APPEND_DATA|SYNCHRONIZE;
-			else
-			{
-				if(!!(req.flags & file_flags::Read)) access|=GENERIC_READ;
-				if(!!(req.flags & file_flags::Write)) access|=GENERIC_WRITE;
-			}
-			if(!!(req.flags & file_flags::CreateOnlyIfNotExist)) creation|=CREATE_NEW;
-			else if(!!(req.flags & file_flags::Create)) creation|=CREATE_ALWAYS;
-			else if(!!(req.flags & file_flags::Truncate)) creation|=TRUNCATE_EXISTING;
-			else creation|=OPEN_EXISTING;
-			if(!!(req.flags & file_flags::WillBeSequentiallyAccessed))
-				flags|=FILE_FLAG_SEQUENTIAL_SCAN;
-			if(!!(req.flags & file_flags::OSDirect)) flags|=FILE_FLAG_NO_BUFFERING;
-			if(!!(req.flags & file_flags::OSSync)) flags|=FILE_FLAG_WRITE_THROUGH;
-			// If writing and autoflush and NOT synchronous, turn on autoflush
-			auto ret=std::make_shared<async_io_handle_windows>(shared_from_this(), req.path, (file_flags::AutoFlush|file_flags::Write)==(req.flags & (file_flags::AutoFlush|file_flags::Write|file_flags::OSSync)),
-				CreateFile(req.path.c_str(), access, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
-					NULL, creation, flags, NULL));
-			static_cast<async_io_handle_windows *>(ret.get())->do_add_io_handle_to_parent();
-			return std::make_pair(true, ret);
+#ifdef MADV_POPULATE_READ
+			if(!madvise(addr, length, MADV_POPULATE_READ))
+				return;
+#endif
+			volatile const char *page=(const char *) addr;
+			for(size_t n=0; n<length; n+=4096)
+				(void) page[n];
 		}
-		// Called in unknown thread
-		completion_returntype dormfile(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
+	};
+}
+
+// Called in unknown thread
+async_file_io_dispatcher_base::completion_returntype async_file_io_dispatcher_base::domap(size_t id, std::shared_ptr<detail::async_io_handle> h, std::pair<async_map_op_req, std::shared_ptr<promise<async_io_mapping>>> req)
+{
+	try
+	{
+		async_io_mapping ret;
+		off_t where=req.first.where;
+		size_t length=req.first.length;
+		map_flags flags=req.first.flags;
+#ifdef WIN32
+		HANDLE fh=(HANDLE) h->native_handle();
+		if(!length)
 		{
-			req.flags=fileflags(req.flags);
-			ERRHWINFN(DeleteFile(req.path.c_str()), req.path);
-			auto ret=std::make_shared<async_io_handle_windows>(shared_from_this(), req.path);
-			return std::make_pair(true, ret);
+			LARGE_INTEGER size;
+			ERRHWINFN(GetFileSizeEx(fh, &size), h->path());
+			if((off_t) size.QuadPart<=where)
+				throw std::runtime_error("Nothing to map");
+			length=(size_t)((off_t) size.QuadPart-where);
 		}
-		// Called in unknown thread
-		completion_returntype dosync(size_t id, std::shared_ptr<detail::async_io_handle> h, async_io_op)
+		// Views must start on an allocation granularity boundary
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		off_t start=where & ~(off_t)(si.dwAllocationGranularity-1);
+		HANDLE mh=CreateFileMapping(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+		ERRHWINFN(mh, h->path());
+		void *addr=MapViewOfFile(mh, FILE_MAP_READ, (DWORD)(start>>32), (DWORD) start, (SIZE_T)(where-start)+length);
+		// The view keeps the mapping alive
+		CloseHandle(mh);
+		ERRHWINFN(addr, h->path());
+		ret.region=std::make_shared<detail::async_io_mapping_region>(addr, (size_t)(where-start)+length);
+#else
+		int fd=(int)(size_t) h->native_handle();
+		if(!length)
 		{
-			async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
-			size_t bytestobesynced=p->write_count_since_fsync();
-			assert(p);
-			if(bytestobesynced)
-				ERRHWINFN(FlushFileBuffers(p->h->native_handle()), p->path());
-			p->byteswrittenatlastfsync+=(long) bytestobesynced;
-			return std::make_pair(true, h);
+			struct stat s;
+			ERRHOSFN(fstat(fd, &s), h->path());
+			if((off_t) s.st_size<=where)
+				throw std::runtime_error("Nothing to map");
+			length=(size_t)((off_t) s.st_size-where);
 		}
-		// Called in unknown thread
-		completion_returntype doclose(size_t id, std::shared_ptr<detail::async_io_handle> h, async_io_op)
+		off_t start=where & ~(off_t)(sysconf(_SC_PAGESIZE)-1);
+		int mapflags=MAP_SHARED;
+#ifdef MAP_POPULATE
+		if(!!(flags & map_flags::Populate))
+			mapflags|=MAP_POPULATE;
+#endif
+		void *addr=mmap(nullptr, (size_t)(where-start)+length, PROT_READ, mapflags, fd, start);
+		if(MAP_FAILED==addr)
+			ERRHOSFN(-1, h->path());
+		ret.region=std::make_shared<detail::async_io_mapping_region>(addr, (size_t)(where-start)+length);
+		if(!!(flags & map_flags::Sequential))
+			madvise(addr, ret.region->length, MADV_SEQUENTIAL);
+		if(!!(flags & map_flags::Random))
+			madvise(addr, ret.region->length, MADV_RANDOM);
+		if(!!(flags & map_flags::WillNeed))
+			madvise(addr, ret.region->length, MADV_WILLNEED);
+#endif
+		ret._data=(const char *) addr+(where-start);
+		ret._size=length;
+		ret._where=where;
+		if(!!(flags & map_flags::Prefault))
 		{
-			async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
-			assert(p);
-			// Windows doesn't provide an async fsync so do it synchronously
-			if(p->autoflush && p->write_count_since_fsync())
-				ERRHWINFN(FlushFileBuffers(p->h->native_handle()), p->path());
-			p->h->close();
-			p->h.reset();
-			return std::make_pair(true, h);
+			std::shared_ptr<detail::async_io_mapping_region> region(ret.region);
+			threadpool().post([region] { region->prefault(); });
 		}
-		// Called in unknown thread
-		void boost_asio_completion_handler(bool is_write, size_t id, std::shared_ptr<detail::async_io_handle> h, const boost::system::error_code &ec, size_t bytes_transferred)
+		req.second->set_value(std::move(ret));
+	}
+	catch(...)
+	{
+		req.second->set_exception(async_io::make_exception_ptr(current_exception()));
+		throw;
+	}
+	return std::make_pair(true, h);
+}
+
+std::pair<std::vector<future<async_io_mapping>>, std::vector<async_io_op>> async_file_io_dispatcher_base::map(const std::vector<async_map_op_req> &reqs)
+{
+#if TRIPLEGIT_VALIDATE_INPUTS
+		for(auto &i : reqs)
+			if(!i.validate())
+				throw std::runtime_error("Inputs are invalid.");
+#endif
+	std::vector<future<async_io_mapping>> retfutures;
+	std::vector<async_io_op> preconditions;
+	std::vector<std::pair<async_map_op_req, std::shared_ptr<promise<async_io_mapping>>>> container;
+	retfutures.reserve(reqs.size());
+	preconditions.reserve(reqs.size());
+	container.reserve(reqs.size());
+	for(auto &i : reqs)
+	{
+		auto p(std::make_shared<promise<async_io_mapping>>());
+		retfutures.push_back(p->get_future());
+		preconditions.push_back(i.precondition);
+		container.push_back(std::make_pair(i, std::move(p)));
+	}
+	return std::make_pair(std::move(retfutures), chain_async_ops((int) detail::OpType::map, preconditions, container, async_op_flags::None, &async_file_io_dispatcher_base::domap));
+}
+
+// Called in unknown thread
+async_file_io_dispatcher_base::completion_returntype async_file_io_dispatcher_base::docopy(size_t id, std::shared_ptr<detail::async_io_handle> h, std::shared_ptr<async_copy_op_req> req)
+{
+	docopychunk(id, std::move(req), 0);
+	// docopychunk() completes us once everything has been copied
+	return std::make_pair(false, h);
+}
+
+// Called in unknown thread
+void async_file_io_dispatcher_base::docopychunk(size_t id, std::shared_ptr<async_copy_op_req> req, off_t copied)
+{
+	std::shared_ptr<detail::async_io_handle> dst;
+	exception_ptr e;
+	try
+	{
+		// Replicate any error of either precondition
+		std::shared_ptr<detail::async_io_handle> src(req->src.h->get());
+		dst=req->dst.h->get();
+		off_t chunkend=std::min(req->length, copied+COPY_CHUNK);
+		while(copied<chunkend)
 		{
-			exception_ptr e;
-			if(ec)
-			{
-				// boost::system::system_error makes no attempt to ask windows for what the error code means :(
-				try
-				{
-					ERRGWINFN(ec.value(), h->path());
-				}
-				catch(...)
-				{
-					e=async_io::make_exception_ptr(current_exception());
-				}
-			}
-			else
-			{
-				async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
-				if(is_write)
-					p->byteswritten+=bytes_transferred;
-				else
-					p->bytesread+=bytes_transferred;
-			}
-			DEBUG_PRINT("H %u e=%u\n", (unsigned) id, (unsigned) ec.value());
-			complete_async_op(id, h, e);
+			size_t _copied=int_copy(src, req->srcoffset+copied, dst, req->dstoffset+copied, (size_t)(chunkend-copied));
+			if(!_copied)
+				throw std::runtime_error("Failed to copy all bytes");
+			copied+=_copied;
 		}
-		// Called in unknown thread
-		completion_returntype doread(size_t id, std::shared_ptr<detail::async_io_handle> h, async_data_op_req<void> req)
+		if(copied<req->length)
 		{
-			async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
-			assert(p);
-			DEBUG_PRINT("R %u %p (%c) @ %u, b=%u\n", (unsigned) id, h.get(), p->path().native().back(), (unsigned) req.where, (unsigned) req.buffers.size());
-#ifdef DEBUG_PRINTING
-			for(auto &b : req.buffers)
-				DEBUG_PRINT("  R %u: %p %u\n", (unsigned) id, boost::asio::buffer_cast<const void *>(b), (unsigned) boost::asio::buffer_size(b));
-#endif
-			boost::asio::async_read_at(*p->h, req.where, req.buffers, boost::bind(&async_file_io_dispatcher_windows::boost_asio_completion_handler, this, false, id, h, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
-			// Indicate we're not finished yet
-			return std::make_pair(false, h);
+			// Let anything else queued have a turn before the next chunk
+			threadpool().post(std::bind(&async_file_io_dispatcher_base::docopychunk, this, id, std::move(req), copied));
+			return;
 		}
-		// Called in unknown thread
-		completion_returntype dowrite(size_t id, std::shared_ptr<detail::async_io_handle> h, async_data_op_req<const void> req)
-		{
-			async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
-			assert(p);
-			DEBUG_PRINT("W %u %p (%c) @ %u, b=%u\n", (unsigned) id, h.get(), p->path().native().back(), (unsigned) req.where, (unsigned) req.buffers.size());
-#ifdef DEBUG_PRINTING
-			for(auto &b : req.buffers)
-				DEBUG_PRINT("  W %u: %p %u\n", (unsigned) id, boost::asio::buffer_cast<const void *>(b), (unsigned) boost::asio::buffer_size(b));
+	}
+	catch(...)
+	{
+		e=async_io::make_exception_ptr(current_exception());
+	}
+	complete_async_op(id, dst, e);
+}
+
+std::vector<async_io_op> async_file_io_dispatcher_base::copy(const std::vector<async_copy_op_req> &reqs)
+{
+#if TRIPLEGIT_VALIDATE_INPUTS
+	for(auto &i : reqs)
+		if(!i.validate())
+			throw std::runtime_error("Inputs are invalid.");
 #endif
-			boost::asio::async_write_at(*p->h, req.where, req.buffers, boost::bind(&async_file_io_dispatcher_windows::boost_asio_completion_handler, this, true, id, h, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
-			// Indicate we're not finished yet
-			return std::make_pair(false, h);
+	std::vector<async_io_op> ret;
+	ret.reserve(reqs.size());
+	detail::immediate_async_ops immediates;
+	for(auto &i : reqs)
+	{
+		std::vector<async_io_op> preconditions;
+		preconditions.reserve(2);
+		preconditions.push_back(i.src);
+		preconditions.push_back(i.dst);
+		ret.push_back(join_async_op(immediates, (int) detail::OpType::copy, preconditions, async_op_flags::DetachedFuture, &async_file_io_dispatcher_base::docopy, std::make_shared<async_copy_op_req>(i)));
+	}
+	return ret;
+}
+
+namespace detail {
+#ifdef WIN32
+	static std::chrono::system_clock::time_point to_time_point(const FILETIME &ft)
+	{
+		// FILETIMEs count 100ns intervals since 1601
+		long long t=(((long long) ft.dwHighDateTime<<32)|ft.dwLowDateTime)-116444736000000000LL;
+		return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(t*100)));
+	}
+	static std::filesystem::file_type to_file_type(DWORD attribs)
+	{
+		if(attribs & FILE_ATTRIBUTE_REPARSE_POINT)
+			return std::filesystem::symlink_file;
+		return (attribs & FILE_ATTRIBUTE_DIRECTORY) ? std::filesystem::directory_file : std::filesystem::regular_file;
+	}
+	static void fill_stat(stat_t &out, const WIN32_FILE_ATTRIBUTE_DATA &data)
+	{
+		out.type=to_file_type(data.dwFileAttributes);
+		out.size=((off_t) data.nFileSizeHigh<<32)|data.nFileSizeLow;
+		out.atim=to_time_point(data.ftLastAccessTime);
+		out.mtim=to_time_point(data.ftLastWriteTime);
+		out.birthtim=to_time_point(data.ftCreationTime);
+		out.have=out.have|metadata_flags::Type|metadata_flags::Size|metadata_flags::Atime|metadata_flags::Mtime|metadata_flags::Birthtime;
+	}
+	// An open handle also says which volume and file it is and how many links there are to it
+	static void fill_stat(stat_t &out, const BY_HANDLE_FILE_INFORMATION &info)
+	{
+		out.dev=info.dwVolumeSerialNumber;
+		out.ino=((unsigned long long) info.nFileIndexHigh<<32)|info.nFileIndexLow;
+		out.type=to_file_type(info.dwFileAttributes);
+		out.nlink=info.nNumberOfLinks;
+		out.size=((off_t) info.nFileSizeHigh<<32)|info.nFileSizeLow;
+		out.atim=to_time_point(info.ftLastAccessTime);
+		out.mtim=to_time_point(info.ftLastWriteTime);
+		out.birthtim=to_time_point(info.ftCreationTime);
+		out.have=out.have|metadata_flags::Dev|metadata_flags::Ino|metadata_flags::Type|metadata_flags::Nlink|metadata_flags::Size|metadata_flags::Atime|metadata_flags::Mtime|metadata_flags::Birthtime;
+	}
+#else
+	static std::chrono::system_clock::time_point to_time_point(const struct timespec &ts)
+	{
+		return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::seconds(ts.tv_sec)+std::chrono::nanoseconds(ts.tv_nsec)));
+	}
+	static std::filesystem::file_type to_file_type(mode_t mode)
+	{
+		switch(mode & S_IFMT)
+		{
+		case S_IFREG: return std::filesystem::regular_file;
+		case S_IFDIR: return std::filesystem::directory_file;
+		case S_IFLNK: return std::filesystem::symlink_file;
+		case S_IFBLK: return std::filesystem::block_file;
+		case S_IFCHR: return std::filesystem::character_file;
+		case S_IFIFO: return std::filesystem::fifo_file;
+		case S_IFSOCK: return std::filesystem::socket_file;
+		default: return std::filesystem::type_unknown;
+		}
+	}
+	static std::filesystem::file_type to_file_type(unsigned char d_type)
+	{
+		switch(d_type)
+		{
+		case DT_REG: return std::filesystem::regular_file;
+		case DT_DIR: return std::filesystem::directory_file;
+		case DT_LNK: return std::filesystem::symlink_file;
+		case DT_BLK: return std::filesystem::block_file;
+		case DT_CHR: return std::filesystem::character_file;
+		case DT_FIFO: return std::filesystem::fifo_file;
+		case DT_SOCK: return std::filesystem::socket_file;
+		default: return std::filesystem::type_unknown;
+		}
+	}
+	// Everything a struct stat has, which is everything but when the item was created
+	static void fill_stat(stat_t &out, const struct stat &s)
+	{
+		out.dev=s.st_dev;
+		out.ino=s.st_ino;
+		out.type=to_file_type(s.st_mode);
+		out.perms=s.st_mode & 07777;
+		out.nlink=(unsigned) s.st_nlink;
+		out.uid=s.st_uid;
+		out.gid=s.st_gid;
+		out.size=s.st_size;
+		out.allocated=(off_t) s.st_blocks*512;
+#ifdef __APPLE__
+		out.atim=to_time_point(s.st_atimespec);
+		out.mtim=to_time_point(s.st_mtimespec);
+		out.ctim=to_time_point(s.st_ctimespec);
+#else
+		out.atim=to_time_point(s.st_atim);
+		out.mtim=to_time_point(s.st_mtim);
+		out.ctim=to_time_point(s.st_ctim);
+#endif
+		out.have=out.have|(metadata_flags::All&~metadata_flags::Birthtime);
+	}
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+	// The statx() fields needed for the metadata wanted
+	static unsigned statx_mask(metadata_flags wanted)
+	{
+		unsigned mask=0;
+		if(!!(wanted & metadata_flags::Type)) mask|=STATX_TYPE;
+		if(!!(wanted & metadata_flags::Perms)) mask|=STATX_MODE;
+		if(!!(wanted & metadata_flags::Nlink)) mask|=STATX_NLINK;
+		if(!!(wanted & metadata_flags::Uid)) mask|=STATX_UID;
+		if(!!(wanted & metadata_flags::Gid)) mask|=STATX_GID;
+		if(!!(wanted & metadata_flags::Ino)) mask|=STATX_INO;
+		if(!!(wanted & metadata_flags::Size)) mask|=STATX_SIZE;
+		if(!!(wanted & metadata_flags::Allocated)) mask|=STATX_BLOCKS;
+		if(!!(wanted & metadata_flags::Atime)) mask|=STATX_ATIME;
+		if(!!(wanted & metadata_flags::Mtime)) mask|=STATX_MTIME;
+		if(!!(wanted & metadata_flags::Ctime)) mask|=STATX_CTIME;
+		if(!!(wanted & metadata_flags::Birthtime)) mask|=STATX_BTIME;
+		return mask;
+	}
+	static std::chrono::system_clock::time_point to_time_point(const struct statx_timestamp &ts)
+	{
+		return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::seconds(ts.tv_sec)+std::chrono::nanoseconds(ts.tv_nsec)));
+	}
+	// Only what the filing system returned. The device is always returned.
+	static void fill_stat(stat_t &out, const struct statx &sx)
+	{
+		out.dev=((unsigned long long) sx.stx_dev_major<<32)|sx.stx_dev_minor;
+		out.have=out.have|metadata_flags::Dev;
+		if(sx.stx_mask & STATX_TYPE) { out.type=to_file_type((mode_t) sx.stx_mode); out.have=out.have|metadata_flags::Type; }
+		if(sx.stx_mask & STATX_MODE) { out.perms=sx.stx_mode & 07777; out.have=out.have|metadata_flags::Perms; }
+		if(sx.stx_mask & STATX_NLINK) { out.nlink=sx.stx_nlink; out.have=out.have|metadata_flags::Nlink; }
+		if(sx.stx_mask & STATX_UID) { out.uid=sx.stx_uid; out.have=out.have|metadata_flags::Uid; }
+		if(sx.stx_mask & STATX_GID) { out.gid=sx.stx_gid; out.have=out.have|metadata_flags::Gid; }
+		if(sx.stx_mask & STATX_INO) { out.ino=sx.stx_ino; out.have=out.have|metadata_flags::Ino; }
+		if(sx.stx_mask & STATX_SIZE) { out.size=sx.stx_size; out.have=out.have|metadata_flags::Size; }
+		if(sx.stx_mask & STATX_BLOCKS) { out.allocated=sx.stx_blocks*512; out.have=out.have|metadata_flags::Allocated; }
+		if(sx.stx_mask & STATX_ATIME) { out.atim=to_time_point(sx.stx_atime); out.have=out.have|metadata_flags::Atime; }
+		if(sx.stx_mask & STATX_MTIME) { out.mtim=to_time_point(sx.stx_mtime); out.have=out.have|metadata_flags::Mtime; }
+		if(sx.stx_mask & STATX_CTIME) { out.ctim=to_time_point(sx.stx_ctime); out.have=out.have|metadata_flags::Ctime; }
+		if(sx.stx_mask & STATX_BTIME) { out.birthtim=to_time_point(sx.stx_btime); out.have=out.have|metadata_flags::Birthtime; }
+	}
+#endif
+	// Fetches the metadata of path within dirfd with statx() where possible, so only what's wanted is fetched
+	static void stat_at(stat_t &out, int dirfd, const char *path, int flags, metadata_flags wanted, const std::filesystem::path &errpath)
+	{
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+		struct statx sx;
+		if(!statx(dirfd, path, flags|AT_NO_AUTOMOUNT, statx_mask(wanted), &sx))
+		{
+			fill_stat(out, sx);
+			return;
+		}
+		if(ENOSYS!=errno)
+			ERRHOSFN(-1, errpath);
+#endif
+		struct stat s;
+		ERRHOSFN(fstatat(dirfd, path, &s, flags), errpath);
+		fill_stat(out, s);
+	}
+#endif
+}
+
+const stat_t &directory_entry::fetch_stat(std::shared_ptr<detail::async_io_handle> dirh, metadata_flags wanted)
+{
+	if(!(wanted & ~stat.have))
+		return stat;
+	std::filesystem::path path(dirh->path()/leafname);
+#ifdef WIN32
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	ERRHWINFN(GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &data), path);
+	detail::fill_stat(stat, data);
+#else
+	// Look up the leafname within the directory if it's open, which saves walking its path
+	int dirfd=(int)(size_t) dirh->native_handle();
+	const char *name=leafname.c_str();
+	if(dirfd<0)
+	{
+		dirfd=AT_FDCWD;
+		name=path.c_str();
+	}
+	detail::stat_at(stat, dirfd, name, AT_SYMLINK_NOFOLLOW, wanted, path);
+#endif
+	return stat;
+}
+
+// Called in unknown thread
+async_file_io_dispatcher_base::completion_returntype async_file_io_dispatcher_base::doenumerate(size_t id, std::shared_ptr<detail::async_io_handle> h, std::pair<async_enumerate_op_req, std::shared_ptr<promise<std::pair<std::vector<directory_entry>, bool>>>> req)
+{
+	try
+	{
+		std::vector<directory_entry> ret;
+		size_t maxitems=req.first.maxitems;
+		auto &filter=req.first.filter;
+		bool more=false;
+		ret.reserve(std::min(maxitems, (size_t) 1024));
+		// Returns true once the batch is full
+		auto add=[&](const char *leafname, unsigned long long ino, std::filesystem::file_type type) -> bool {
+			if('.'==leafname[0] && (!leafname[1] || ('.'==leafname[1] && !leafname[2])))
+				return false;
+			directory_entry entry(leafname, ino, type);
+			if(filter && !filter(entry))
+				return false;
+			ret.push_back(std::move(entry));
+			return ret.size()==maxitems;
+		};
+#ifdef WIN32
+		detail::async_io_handle_windows *p=static_cast<detail::async_io_handle_windows *>(h.get());
+		WIN32_FIND_DATA wfd;
+		BOOL found;
+		if(req.first.restart || INVALID_HANDLE_VALUE==p->findh)
+		{
+			if(INVALID_HANDLE_VALUE!=p->findh)
+				FindClose(p->findh);
+			p->findh=FindFirstFileEx((h->path()/"*").c_str(), FindExInfoBasic, &wfd, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+			found=INVALID_HANDLE_VALUE!=p->findh;
+			if(!found && ERROR_FILE_NOT_FOUND!=GetLastError())
+				ERRHWINFN(0, h->path());
+		}
+		else
+			found=FindNextFile(p->findh, &wfd);
+		for(; found; found=FindNextFile(p->findh, &wfd))
+			if(add(std::filesystem::path(wfd.cFileName).string().c_str(), 0, detail::to_file_type(wfd.dwFileAttributes)))
+			{
+				more=true;
+				break;
+			}
+		if(!found && ERROR_NO_MORE_FILES!=GetLastError() && ERROR_FILE_NOT_FOUND!=GetLastError())
+			ERRHWINFN(0, h->path());
+#else
+		int fd=(int)(size_t) h->native_handle();
+		if(fd<0)
+			throw std::runtime_error("Directories must be opened with file_flags::Read to be enumerated");
+#ifdef __linux__
+		if(req.first.restart && -1==lseek(fd, 0, SEEK_SET))
+			ERRHOSFN(-1, h->path());
+		std::unique_ptr<char[]> buffer(new char[ENUMERATE_BUFFER]);
+		struct linux_dirent64
+		{
+			unsigned long long d_ino;
+			long long d_off;
+			unsigned short d_reclen;
+			unsigned char d_type;
+			char d_name[1];
+		};
+		while(!more)
+		{
+			long bytes=syscall(SYS_getdents64, fd, buffer.get(), ENUMERATE_BUFFER);
+			ERRHOSFN(bytes, h->path());
+			if(!bytes)
+				break;
+			for(long n=0; n<bytes; )
+			{
+				const linux_dirent64 *d=(const linux_dirent64 *)(buffer.get()+n);
+				n+=d->d_reclen;
+				if(add(d->d_name, d->d_ino, detail::to_file_type(d->d_type)))
+				{
+					// Leave the rest of what was read for the next batch. Offsets may be hash cookies, so mustn't be truncated to int.
+					if(n<bytes && -1==lseek(fd, d->d_off, SEEK_SET))
+						ERRHOSFN(-1, h->path());
+					more=true;
+					break;
+				}
+			}
+		}
+#else
+		detail::async_io_handle_posix *p=static_cast<detail::async_io_handle_posix *>(h.get());
+		if(!p->enumerator)
+		{
+			int dupfd=dup(fd);
+			ERRHOSFN(dupfd, h->path());
+			if(!(p->enumerator=fdopendir(dupfd)))
+			{
+				posix_close(dupfd);
+				ERRHOSFN(-1, h->path());
+			}
+		}
+		else if(req.first.restart)
+			rewinddir(p->enumerator);
+		for(;;)
+		{
+			// Only a null readdir() with errno set is an error
+			errno=0;
+			struct dirent *d=readdir(p->enumerator);
+			if(!d)
+			{
+				if(errno)
+					ERRHOSFN(-1, h->path());
+				break;
+			}
+			if(add(d->d_name, d->d_ino, detail::to_file_type(d->d_type)))
+			{
+				more=true;
+				break;
+			}
+		}
+#endif
+#endif
+		req.second->set_value(std::make_pair(std::move(ret), more));
+	}
+	catch(...)
+	{
+		req.second->set_exception(async_io::make_exception_ptr(current_exception()));
+		throw;
+	}
+	return std::make_pair(true, h);
+}
+
+std::pair<std::vector<future<std::pair<std::vector<directory_entry>, bool>>>, std::vector<async_io_op>> async_file_io_dispatcher_base::enumerate(const std::vector<async_enumerate_op_req> &reqs)
+{
+#if TRIPLEGIT_VALIDATE_INPUTS
+		for(auto &i : reqs)
+			if(!i.validate())
+				throw std::runtime_error("Inputs are invalid.");
+#endif
+	std::vector<future<std::pair<std::vector<directory_entry>, bool>>> retfutures;
+	std::vector<async_io_op> preconditions;
+	std::vector<std::pair<async_enumerate_op_req, std::shared_ptr<promise<std::pair<std::vector<directory_entry>, bool>>>>> container;
+	retfutures.reserve(reqs.size());
+	preconditions.reserve(reqs.size());
+	container.reserve(reqs.size());
+	for(auto &i : reqs)
+	{
+		auto p(std::make_shared<promise<std::pair<std::vector<directory_entry>, bool>>>());
+		retfutures.push_back(p->get_future());
+		preconditions.push_back(i.precondition);
+		container.push_back(std::make_pair(i, std::move(p)));
+	}
+	return std::make_pair(std::move(retfutures), chain_async_ops((int) detail::OpType::enumerate, preconditions, container, async_op_flags::None, &async_file_io_dispatcher_base::doenumerate));
+}
+
+namespace detail {
+	// Returns where a batch op keeps its precondition, which depends on its kind
+	static async_io_op &batch_op_precondition(async_batch_op_req &req)
+	{
+		switch(req.kind)
+		{
+		case async_batch_op_req::op_kind::dir:
+		case async_batch_op_req::op_kind::rmdir:
+		case async_batch_op_req::op_kind::file:
+		case async_batch_op_req::op_kind::rmfile:
+			return req.path.precondition;
+		case async_batch_op_req::op_kind::read:
+			return req.readreq.precondition;
+		case async_batch_op_req::op_kind::write:
+			return req.writereq.precondition;
+		default:
+			return req.op;
+		}
+	}
+	static const async_io_op &batch_op_precondition(const async_batch_op_req &req)
+	{
+		return batch_op_precondition(const_cast<async_batch_op_req &>(req));
+	}
+	// Validates a batch op whose precondition has been resolved
+	static bool validate_batch_op(const async_batch_op_req &req)
+	{
+		switch(req.kind)
+		{
+		case async_batch_op_req::op_kind::dir:
+		case async_batch_op_req::op_kind::rmdir:
+		case async_batch_op_req::op_kind::file:
+		case async_batch_op_req::op_kind::rmfile:
+			return req.path.validate();
+		case async_batch_op_req::op_kind::read:
+			return req.readreq.validate();
+		case async_batch_op_req::op_kind::write:
+			return req.writereq.validate();
+		default:
+			return req.op.validate();
+		}
+	}
+	// Validates buffers as async_data_op_req does, for an op of parent
+	template<class B> static bool validate_batch_buffers(const std::vector<B> &buffers, const async_file_io_dispatcher_base *parent)
+	{
+		if(buffers.empty()) return false;
+		for(auto &b : buffers)
+		{
+			if(!boost::asio::buffer_cast<const void *>(b) || !boost::asio::buffer_size(b)) return false;
+#ifdef WIN32
+			// Only the POSIX backends bounce buffer unaligned OSDirect i/o
+			if(!!(parent->fileflags(file_flags::None)&file_flags::OSDirect))
+			{
+				if(((size_t)boost::asio::buffer_cast<const void *>(b) & 4095) || (boost::asio::buffer_size(b) & 4095)) return false;
+			}
+#endif
+		}
+		return true;
+	}
+	// Validates a batch op of parent. A precondition within the batch is known good, so only the rest is checked.
+	static bool validate_batch_op(const async_batch_op_req &req, const async_file_io_dispatcher_base *parent)
+	{
+		if(req.precondition==async_batch_op_req::npos)
+			return validate_batch_op(req);
+		switch(req.kind)
+		{
+		case async_batch_op_req::op_kind::dir:
+		case async_batch_op_req::op_kind::rmdir:
+		case async_batch_op_req::op_kind::file:
+		case async_batch_op_req::op_kind::rmfile:
+			return !req.path.path.empty();
+		case async_batch_op_req::op_kind::read:
+			return validate_batch_buffers(req.readreq.buffers, parent);
+		case async_batch_op_req::op_kind::write:
+			return validate_batch_buffers(req.writereq.buffers, parent);
+		default:
+			return true;
+		}
+	}
+}
+
+std::vector<async_io_op> async_file_io_dispatcher_base::submit(const async_op_batch &batch)
+{
+	std::shared_ptr<const detail::async_op_plan_ops> plan(int_compile(batch));
+	boost::intrusive_ptr<detail::async_op_plan_instance> instance(plan->acquire(plan));
+	return int_submit(*instance);
+}
+
+async_op_plan async_file_io_dispatcher_base::compile(const async_op_batch &batch)
+{
+	async_op_plan ret;
+	ret.parent=shared_from_this();
+	ret.ops=int_compile(batch);
+	ret.no=batch.size();
+	return ret;
+}
+
+std::vector<async_io_op> async_file_io_dispatcher_base::submit(const async_op_plan &plan, const async_op_plan_params &params)
+{
+	if(!plan.ops || plan.parent.lock().get()!=this)
+		throw std::runtime_error("Plan was not compiled by this dispatcher.");
+	const size_t no=plan.no;
+	// Parameters get patched straight into an instance recycled from an earlier submission, which puts them back
+	// when done with, including if something here throws
+	boost::intrusive_ptr<detail::async_op_plan_instance> instance(plan.ops->acquire(plan.ops));
+	auto patch=[&instance, no](size_t idx) -> async_batch_op_req & {
+		if(idx>=no)
+			throw std::runtime_error("Plan parameter refers to an op not in the plan.");
+		return instance->patch(idx);
+	};
+	for(auto &i : params.paths)
+	{
+		async_batch_op_req &req=patch(i.first);
+		if(req.kind!=async_batch_op_req::op_kind::dir && req.kind!=async_batch_op_req::op_kind::rmdir && req.kind!=async_batch_op_req::op_kind::file && req.kind!=async_batch_op_req::op_kind::rmfile)
+			throw std::runtime_error("Plan path parameter refers to an op without a path.");
+		req.path.path=i.second;
+	}
+	for(auto &i : params.readbuffers)
+	{
+		async_batch_op_req &req=patch(i.first);
+		if(req.kind!=async_batch_op_req::op_kind::read)
+			throw std::runtime_error("Plan read buffers parameter refers to an op which is not a read.");
+		req.readreq.buffers=i.second;
+	}
+	for(auto &i : params.writebuffers)
+	{
+		async_batch_op_req &req=patch(i.first);
+		if(req.kind!=async_batch_op_req::op_kind::write)
+			throw std::runtime_error("Plan write buffers parameter refers to an op which is not a write.");
+		req.writereq.buffers=i.second;
+	}
+	for(auto &i : params.offsets)
+	{
+		async_batch_op_req &req=patch(i.first);
+		switch(req.kind)
+		{
+		case async_batch_op_req::op_kind::read:
+			req.readreq.where=i.second;
+			break;
+		case async_batch_op_req::op_kind::write:
+			req.writereq.where=i.second;
+			break;
+		case async_batch_op_req::op_kind::truncate:
+			req.newsize=i.second;
+			break;
+		default:
+			throw std::runtime_error("Plan offset parameter refers to an op without an offset.");
+		}
+	}
+	for(auto &i : params.preconditions)
+	{
+		async_batch_op_req &req=patch(i.first);
+		if(req.precondition!=async_batch_op_req::npos)
+			throw std::runtime_error("Plan precondition parameter refers to an op whose precondition is within the plan.");
+		detail::batch_op_precondition(req)=i.second;
+	}
+#if TRIPLEGIT_VALIDATE_INPUTS
+	// Only what has been patched needs validating, the rest was validated when compiled
+	for(auto idx : instance->patched)
+	{
+		if(!detail::validate_batch_op(instance->reqs[idx], this))
+			throw std::runtime_error("Inputs are invalid.");
+	}
+#endif
+	return int_submit(*instance);
+}
+
+std::shared_ptr<detail::async_op_plan_ops> async_file_io_dispatcher_base::int_compile(const async_op_batch &batch)
+{
+	static const detail::OpType optypes[]={
+		detail::OpType::dir,
+		detail::OpType::rmdir,
+		detail::OpType::file,
+		detail::OpType::rmfile,
+		detail::OpType::sync,
+		detail::OpType::close,
+		detail::OpType::read,
+		detail::OpType::write,
+		detail::OpType::truncate
+	};
+	auto ret=std::make_shared<detail::async_op_plan_ops>();
+	const size_t no=batch.size();
+	ret->ops.reserve(no);
+	for(size_t n=0; n<no; n++)
+	{
+		ret->ops.push_back(detail::async_op_plan_ops::op_t(batch[n]));
+		detail::async_op_plan_ops::op_t &op=ret->ops.back();
+		op.optype=optypes[static_cast<size_t>(op.req.kind)];
+		op.flags=bind_batch_op(op.boundf, op.req);
+		if(op.req.precondition==async_batch_op_req::npos)
+			ret->roots.push_back(n);
+		else
+			ret->ops[op.req.precondition].dependants++;
+	}
+	// Lay out each op's dependants together, in the order they were added
+	size_t first=0;
+	for(auto &op : ret->ops)
+	{
+		op.firstdependant=first;
+		first+=op.dependants;
+		op.dependants=0;
+	}
+	ret->dependants.resize(first);
+	for(size_t n=0; n<no; n++)
+		if(ret->ops[n].req.precondition!=async_batch_op_req::npos)
+		{
+			detail::async_op_plan_ops::op_t &precondition=ret->ops[ret->ops[n].req.precondition];
+			ret->dependants[precondition.firstdependant+precondition.dependants++]=n;
+		}
+#if TRIPLEGIT_VALIDATE_INPUTS
+	for(auto &op : ret->ops)
+	{
+		if(!detail::validate_batch_op(op.req, this))
+			throw std::runtime_error("Inputs are invalid.");
+	}
+#endif
+	return ret;
+}
+
+std::vector<async_io_op> async_file_io_dispatcher_base::int_submit(detail::async_op_plan_instance &instance)
+{
+	static const size_t opsshards=detail::async_file_io_dispatcher_base_p::opsshards;
+	std::vector<async_io_op> ret;
+	const detail::async_op_plan_ops &ops=*instance.plan;
+	const size_t no=ops.ops.size();
+	if(!no)
+		return ret;
+	// Reserve a run of ids for the whole batch at once, never including zero
+	size_t firstid;
+	do
+	{
+		firstid=p->monotoniccount.fetch_add(no)+1;
+	} while(!firstid || firstid+no-1<firstid);
+	ret.reserve(no);
+	for(size_t n=0; n<no; n++)
+		ret.push_back(async_io_op(p->opstates->allocate(this, firstid+n), firstid+n));
+	// Fill in and register a record for each op, taking each shard's lock just once
+	std::vector<detail::async_file_io_dispatcher_op *> &records=instance.records;
+	records.resize(no);
+	for(size_t s=0; s<no && s<opsshards; s++)
+	{
+		detail::async_file_io_dispatcher_base_p::opsshard_t &shard=p->opsshard(firstid+s);
+		lock_guard<detail::async_file_io_dispatcher_base_p::opslock_t> opslockh(shard.lock);
+		for(size_t n=s; n<no; n+=opsshards)
+		{
+			const detail::async_op_plan_ops::op_t &planop=ops.ops[n];
+			detail::async_op_plan_thunk thunk={ &instance, &planop.boundf, &instance.req(n), firstid+n };
+			detail::async_file_io_dispatcher_op *op=shard.allocate();
+			op->id=firstid+n;
+			op->optype=planop.optype;
+			op->flags=planop.flags;
+			op->h=ret[n].h;
+			op->boundf=detail::op_function(std::move(thunk));
+			shard.insert(op);
+			records[n]=op;
+		}
+		if(!shard.self)
+			shard.self=shared_from_this();
+	}
+	p->opscount+=no;
+	// Nothing here can run until a root is chained below and nobody else knows these ids yet, so each op's
+	// in plan dependants can be linked onto it directly without looking anything up or taking any locks
+	for(size_t n=0; n<no; n++)
+	{
+		const detail::async_op_plan_ops::op_t &planop=ops.ops[n];
+		detail::async_file_io_dispatcher_op *op=records[n];
+		for(size_t d=planop.firstdependant; d<planop.firstdependant+planop.dependants; d++)
+		{
+			detail::async_file_io_dispatcher_op *dependant=records[ops.dependants[d]];
+			if(op->completionstail)
+				op->completionstail->completionnext=dependant;
+			else
+				op->completionshead=dependant;
+			op->completionstail=dependant;
+		}
+	}
+	detail::immediate_async_ops immediates;
+	for(auto n : ops.roots)
+		int_chain_async_op(immediates, records[n], detail::batch_op_precondition(instance.req(n)));
+	return ret;
+}
+
+
+namespace detail {
+#if defined(WIN32)
+	class async_file_io_dispatcher_windows : public async_file_io_dispatcher_base
+	{
+		// Called in unknown thread
+		completion_returntype dodir(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
+		{
+			req.path=detail::absolute_path(_, req);
+			BOOL ret=0;
+			req.flags=fileflags(req.flags);
+			if(!!(req.flags & (file_flags::Create|file_flags::CreateOnlyIfNotExist)))
+			{
+				ret=CreateDirectory(req.path.c_str(), NULL);
+				if(!ret && ERROR_ALREADY_EXISTS==GetLastError())
+				{
+					// Ignore already exists unless we were asked otherwise
+					if(!(req.flags & file_flags::CreateOnlyIfNotExist))
+						ret=1;
+				}
+				req.flags=req.flags&~(file_flags::Create|file_flags::CreateOnlyIfNotExist);
+			}
+			DWORD attr=GetFileAttributes(req.path.c_str());
+			if(INVALID_FILE_ATTRIBUTES!=attr && !(attr & FILE_ATTRIBUTE_DIRECTORY))
+				throw std::runtime_error("Not a directory");
+			if(!!(req.flags & file_flags::Read))
+				return dofile(id, _, req);
+			else
+			{
+				// Create empty handle so
+				auto ret=std::make_shared<async_io_handle_windows>(shared_from_this(), req.path);
+				return std::make_pair(true, ret);
+			}
+		}
+		// Called in unknown thread
+		completion_returntype dormdir(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
+		{
+			req.path=detail::absolute_path(_, req);
+			req.flags=fileflags(req.flags);
+			ERRHWINFN(RemoveDirectory(req.path.c_str()), req.path);
+			auto ret=std::make_shared<async_io_handle_windows>(shared_from_this(), req.path);
+			return std::make_pair(true, ret);
+		}
+		// Called in unknown thread
+		completion_returntype dofile(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
+		{
+			DWORD access=0, creation=0, flags=FILE_ATTRIBUTE_NORMAL|FILE_FLAG_OVERLAPPED;
+			req.path=detail::absolute_path(_, req);
+			req.flags=fileflags(req.flags);
+			if(!!(req.flags & file_flags::Append)) access|=FILE_APPEND_DATA|SYNCHRONIZE;
+			else
+			{
+				if(!!(req.flags & file_flags::Read)) access|=GENERIC_READ;
+				if(!!(req.flags & file_flags::Write)) access|=GENERIC_WRITE;
+			}
+			if(!!(req.flags & file_flags::CreateOnlyIfNotExist)) creation|=CREATE_NEW;
+			else if(!!(req.flags & file_flags::Create)) creation|=CREATE_ALWAYS;
+			else if(!!(req.flags & file_flags::Truncate)) creation|=TRUNCATE_EXISTING;
+			else creation|=OPEN_EXISTING;
+			if(!!(req.flags & file_flags::WillBeSequentiallyAccessed))
+				flags|=FILE_FLAG_SEQUENTIAL_SCAN;
+			if(!!(req.flags & file_flags::OSDirect)) flags|=FILE_FLAG_NO_BUFFERING;
+			if(!!(req.flags & file_flags::OSSync)) flags|=FILE_FLAG_WRITE_THROUGH;
+			// If writing and autoflush and NOT synchronous, turn on autoflush
+			auto ret=std::make_shared<async_io_handle_windows>(shared_from_this(), req.path, (file_flags::AutoFlush|file_flags::Write)==(req.flags & (file_flags::AutoFlush|file_flags::Write|file_flags::OSSync)),
+				CreateFile(req.path.c_str(), access, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+					NULL, creation, flags, NULL));
+			static_cast<async_io_handle_windows *>(ret.get())->do_add_io_handle_to_parent();
+			if(!!(req.flags & file_flags::OSDirect))
+				ret->blocksize=4096;
+			return std::make_pair(true, ret);
+		}
+		// Called in unknown thread
+		completion_returntype dormfile(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
+		{
+			req.path=detail::absolute_path(_, req);
+			req.flags=fileflags(req.flags);
+			ERRHWINFN(DeleteFile(req.path.c_str()), req.path);
+			auto ret=std::make_shared<async_io_handle_windows>(shared_from_this(), req.path);
+			return std::make_pair(true, ret);
+		}
+		// Called in unknown thread
+		completion_returntype dosync(size_t id, std::shared_ptr<detail::async_io_handle> h, async_io_op)
+		{
+			async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
+			size_t bytestobesynced=p->write_count_since_fsync();
+			assert(p);
+			if(bytestobesynced)
+				ERRHWINFN(FlushFileBuffers(p->h->native_handle()), p->path());
+			p->byteswrittenatlastfsync+=(long) bytestobesynced;
+			return std::make_pair(true, h);
+		}
+		// Called in unknown thread. Windows has neither a data only nor a ranged flush.
+		completion_returntype dosyncrange(size_t id, std::shared_ptr<detail::async_io_handle> h, async_sync_op_req req)
+		{
+			return dosync(id, h, req.precondition);
+		}
+		// Called in unknown thread
+		completion_returntype doclose(size_t id, std::shared_ptr<detail::async_io_handle> h, async_io_op)
+		{
+			async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
+			assert(p);
+			// Windows doesn't provide an async fsync so do it synchronously
+			if(p->autoflush && p->write_count_since_fsync())
+				ERRHWINFN(FlushFileBuffers(p->h->native_handle()), p->path());
+			p->h->close();
+			p->h.reset();
+			return std::make_pair(true, h);
+		}
+		// Called in unknown thread
+		void boost_asio_completion_handler(bool is_write, size_t id, std::shared_ptr<detail::async_io_handle> h, const boost::system::error_code &ec, size_t bytes_transferred)
+		{
+			exception_ptr e;
+			if(ec)
+			{
+				// boost::system::system_error makes no attempt to ask windows for what the error code means :(
+				try
+				{
+					ERRGWINFN(ec.value(), h->path());
+				}
+				catch(...)
+				{
+					e=async_io::make_exception_ptr(current_exception());
+				}
+			}
+			else
+			{
+				async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
+				if(is_write)
+					p->byteswritten+=bytes_transferred;
+				else
+					p->bytesread+=bytes_transferred;
+			}
+			DEBUG_PRINT("H %u e=%u\n", (unsigned) id, (unsigned) ec.value());
+			complete_async_op(id, h, e);
+		}
+		// Called in unknown thread
+		completion_returntype doread(size_t id, std::shared_ptr<detail::async_io_handle> h, async_data_op_req<void> req)
+		{
+			async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
+			assert(p);
+			DEBUG_PRINT("R %u %p (%c) @ %u, b=%u\n", (unsigned) id, h.get(), p->path().native().back(), (unsigned) req.where, (unsigned) req.buffers.size());
+#ifdef DEBUG_PRINTING
+			for(auto &b : req.buffers)
+				DEBUG_PRINT("  R %u: %p %u\n", (unsigned) id, boost::asio::buffer_cast<const void *>(b), (unsigned) boost::asio::buffer_size(b));
+#endif
+			boost::asio::async_read_at(*p->h, req.where, req.buffers, boost::bind(&async_file_io_dispatcher_windows::boost_asio_completion_handler, this, false, id, h, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+			// Indicate we're not finished yet
+			return std::make_pair(false, h);
+		}
+		// Called in unknown thread
+		completion_returntype dowrite(size_t id, std::shared_ptr<detail::async_io_handle> h, async_data_op_req<const void> req)
+		{
+			async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
+			assert(p);
+			DEBUG_PRINT("W %u %p (%c) @ %u, b=%u\n", (unsigned) id, h.get(), p->path().native().back(), (unsigned) req.where, (unsigned) req.buffers.size());
+#ifdef DEBUG_PRINTING
+			for(auto &b : req.buffers)
+				DEBUG_PRINT("  W %u: %p %u\n", (unsigned) id, boost::asio::buffer_cast<const void *>(b), (unsigned) boost::asio::buffer_size(b));
+#endif
+			boost::asio::async_write_at(*p->h, req.where, req.buffers, boost::bind(&async_file_io_dispatcher_windows::boost_asio_completion_handler, this, true, id, h, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+			// Indicate we're not finished yet
+			return std::make_pair(false, h);
+		}
+		// Called in unknown thread
+		completion_returntype dotruncate(size_t id, std::shared_ptr<detail::async_io_handle> h, off_t _newsize)
+		{
+			async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
+			assert(p);
+			DEBUG_PRINT("T %u %p (%c)\n", (unsigned) id, h.get(), p->path().native().back());
+			// This is a bit tricky ... overlapped files ignore their file position except in this one
+			// case, but clearly here we have a race condition. No choice but to rinse and repeat I guess.
+			LARGE_INTEGER size={0}, newsize;
+			newsize.QuadPart=_newsize;
+			while(size.QuadPart!=newsize.QuadPart)
+			{
+				ERRHWINFN(SetFilePointerEx(p->h->native_handle(), newsize, NULL, FILE_BEGIN), p->path());
+				ERRHWINFN(SetEndOfFile(p->h->native_handle()), p->path());
+				ERRHWINFN(GetFileSizeEx(p->h->native_handle(), &size), p->path());
+			}
+			return std::make_pair(true, h);
+		}
+		// Called in unknown thread
+		completion_returntype dopreallocate(size_t id, std::shared_ptr<detail::async_io_handle> h, detail::preallocate_range r)
+		{
+			async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
+			assert(p);
+			DEBUG_PRINT("P %u %p (%c)\n", (unsigned) id, h.get(), p->path().native().back());
+			FILE_STANDARD_INFO si;
+			ERRHWINFN(GetFileInformationByHandleEx(p->h->native_handle(), FileStandardInfo, &si, sizeof(si)), p->path());
+			LONGLONG end=(LONGLONG)(r.offset+r.length);
+			// Shrinking the allocation would truncate the file
+			if(end>si.AllocationSize.QuadPart)
+			{
+				FILE_ALLOCATION_INFO ai;
+				ai.AllocationSize.QuadPart=end;
+				ERRHWINFN(SetFileInformationByHandle(p->h->native_handle(), FileAllocationInfo, &ai, sizeof(ai)), p->path());
+			}
+			if(!(r.mode & preallocate_flags::KeepSize) && end>si.EndOfFile.QuadPart)
+			{
+				FILE_END_OF_FILE_INFO ei;
+				ei.EndOfFile.QuadPart=end;
+				ERRHWINFN(SetFileInformationByHandle(p->h->native_handle(), FileEndOfFileInfo, &ei, sizeof(ei)), p->path());
+			}
+			if(!!(r.mode & preallocate_flags::ZeroRange) && (LONGLONG) r.offset<si.EndOfFile.QuadPart)
+			{
+				// Anything past the old end of file is already zero
+				FILE_ZERO_DATA_INFORMATION zi;
+				DWORD bytes;
+				zi.FileOffset.QuadPart=(LONGLONG) r.offset;
+				zi.BeyondFinalZero.QuadPart=std::min(end, si.EndOfFile.QuadPart);
+				ERRHWINFN(DeviceIoControl(p->h->native_handle(), FSCTL_SET_ZERO_DATA, &zi, sizeof(zi), NULL, 0, &bytes, NULL), p->path());
+				p->byteswritten+=(off_t)(zi.BeyondFinalZero.QuadPart-zi.FileOffset.QuadPart);
+			}
+			return std::make_pair(true, h);
+		}
+		// Called in unknown thread
+		completion_returntype dostat(size_t id, std::shared_ptr<detail::async_io_handle> h, detail::stat_req r)
+		{
+			try
+			{
+				stat_t ret;
+				async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
+				if(r.byhandle() && p->h)
+				{
+					BY_HANDLE_FILE_INFORMATION info;
+					ERRHWINFN(GetFileInformationByHandle(p->h->native_handle(), &info), p->path());
+					detail::fill_stat(ret, info);
+				}
+				else
+				{
+					// Directories not opened for reading have no handle
+					std::filesystem::path path(r.byhandle() ? h->path() : detail::absolute_path(h, r.req));
+					WIN32_FILE_ATTRIBUTE_DATA data;
+					ERRHWINFN(GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &data), path);
+					detail::fill_stat(ret, data);
+				}
+				r.result->set_value(std::move(ret));
+			}
+			catch(...)
+			{
+				r.result->set_exception(async_io::make_exception_ptr(current_exception()));
+				throw;
+			}
+			return std::make_pair(true, h);
+		}
+		// Called in unknown thread. Windows has no way of copying a range between two open files, so copy through a pooled buffer.
+		virtual size_t int_copy(std::shared_ptr<detail::async_io_handle> src, off_t srcoffset, std::shared_ptr<detail::async_io_handle> dst, off_t dstoffset, size_t length)
+		{
+			async_io_handle_windows *s=static_cast<async_io_handle_windows *>(src.get()), *d=static_cast<async_io_handle_windows *>(dst.get());
+			async_io_buffer buffer(allocate_buffer(std::min(length, (size_t) COPY_BUFFER)));
+			boost::system::error_code ec;
+			size_t bytesread=s->h->read_some_at(srcoffset, boost::asio::buffer(buffer.data(), std::min(length, buffer.size())), ec);
+			if(boost::asio::error::eof==ec)
+				return 0;
+			if(ec)
+				ERRGWINFN(ec.value(), s->path());
+			s->bytesread+=bytesread;
+			size_t byteswritten=boost::asio::write_at(*d->h, dstoffset, boost::asio::buffer(buffer.data(), bytesread), ec);
+			d->byteswritten+=byteswritten;
+			if(ec)
+				ERRGWINFN(ec.value(), d->path());
+			return byteswritten;
+		}
+
+	public:
+		async_file_io_dispatcher_windows(thread_pool &threadpool, file_flags flagsforce, file_flags flagsmask) : async_file_io_dispatcher_base(threadpool, flagsforce, flagsmask)
+		{
+		}
+
+		virtual async_op_flags bind_batch_op(detail::batch_op_function &boundf, const async_batch_op_req &req)
+		{
+			switch(req.kind)
+			{
+			case async_batch_op_req::op_kind::dir:
+				bind_plan_op(boundf, &async_file_io_dispatcher_windows::dodir);
+				break;
+			case async_batch_op_req::op_kind::rmdir:
+				bind_plan_op(boundf, &async_file_io_dispatcher_windows::dormdir);
+				break;
+			case async_batch_op_req::op_kind::file:
+				bind_plan_op(boundf, &async_file_io_dispatcher_windows::dofile);
+				break;
+			case async_batch_op_req::op_kind::rmfile:
+				bind_plan_op(boundf, &async_file_io_dispatcher_windows::dormfile);
+				break;
+			case async_batch_op_req::op_kind::sync:
+				bind_plan_op(boundf, &async_file_io_dispatcher_windows::dosync);
+				break;
+			case async_batch_op_req::op_kind::close:
+				bind_plan_op(boundf, &async_file_io_dispatcher_windows::doclose);
+				break;
+			case async_batch_op_req::op_kind::read:
+				bind_plan_op(boundf, &async_file_io_dispatcher_windows::doread);
+				return async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion;
+			case async_batch_op_req::op_kind::write:
+				bind_plan_op(boundf, &async_file_io_dispatcher_windows::dowrite);
+				return async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion;
+			case async_batch_op_req::op_kind::truncate:
+				bind_plan_op(boundf, &async_file_io_dispatcher_windows::dotruncate);
+				break;
+			}
+			return async_op_flags::None;
+		}
+		virtual std::vector<async_io_op> dir(const std::vector<async_path_op_req> &reqs)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::dir, reqs, async_op_flags::None, &async_file_io_dispatcher_windows::dodir);
+		}
+		virtual std::vector<async_io_op> rmdir(const std::vector<async_path_op_req> &reqs)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::rmdir, reqs, async_op_flags::None, &async_file_io_dispatcher_windows::dormdir);
+		}
+		virtual std::vector<async_io_op> file(const std::vector<async_path_op_req> &reqs)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::file, reqs, async_op_flags::None, &async_file_io_dispatcher_windows::dofile);
+		}
+		virtual std::vector<async_io_op> rmfile(const std::vector<async_path_op_req> &reqs)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::rmfile, reqs, async_op_flags::None, &async_file_io_dispatcher_windows::dormfile);
+		}
+		virtual std::vector<async_io_op> sync(const std::vector<async_io_op> &ops)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : ops)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::sync, ops, async_op_flags::None, &async_file_io_dispatcher_windows::dosync);
+		}
+		virtual std::vector<async_io_op> sync(const std::vector<async_sync_op_req> &reqs)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::sync, detail::sync_preconditions(reqs), reqs, async_op_flags::None, &async_file_io_dispatcher_windows::dosyncrange);
+		}
+		virtual std::vector<async_io_op> close(const std::vector<async_io_op> &ops)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : ops)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::close, ops, async_op_flags::None, &async_file_io_dispatcher_windows::doclose);
+		}
+		virtual std::vector<async_io_op> read(const std::vector<async_data_op_req<void>> &reqs)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::read, reqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_windows::doread);
+		}
+		virtual std::vector<async_io_op> write(const std::vector<async_data_op_req<const void>> &reqs)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_coalesced_writes(reqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_windows::dowrite);
+		}
+		virtual std::vector<async_io_op> truncate(const std::vector<async_io_op> &ops, const std::vector<off_t> &sizes)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : ops)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::truncate, ops, sizes, async_op_flags::None, &async_file_io_dispatcher_windows::dotruncate);
+		}
+		virtual std::vector<async_io_op> preallocate(const std::vector<async_io_op> &ops, const std::vector<off_t> &offsets, const std::vector<off_t> &lengths, preallocate_flags mode)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : ops)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+			for(auto &i : lengths)
+				if(!i)
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::preallocate, ops, detail::make_preallocate_ranges(ops, offsets, lengths, mode), async_op_flags::None, &async_file_io_dispatcher_windows::dopreallocate);
+		}
+		virtual std::pair<std::vector<future<stat_t>>, std::vector<async_io_op>> stat(const std::vector<async_io_op> &ops, metadata_flags wanted)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : ops)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			std::vector<detail::stat_req> reqs;
+			auto ret(detail::make_stat_reqs(reqs, ops, wanted));
+			return std::make_pair(std::move(ret), chain_async_ops((int) detail::OpType::stat, ops, reqs, async_op_flags::None, &async_file_io_dispatcher_windows::dostat));
+		}
+		virtual std::pair<std::vector<future<stat_t>>, std::vector<async_io_op>> stat(const std::vector<async_path_op_req> &reqs, metadata_flags wanted)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			std::vector<detail::stat_req> statreqs;
+			std::vector<async_io_op> preconditions;
+			auto ret(detail::make_stat_reqs(statreqs, preconditions, reqs, wanted));
+			return std::make_pair(std::move(ret), chain_async_ops((int) detail::OpType::stat, preconditions, statreqs, async_op_flags::None, &async_file_io_dispatcher_windows::dostat));
+		}
+	};
+#endif
+	/* Handles to containing directories on POSIX, shared by everything opened within them. Directories are sharded
+	by path hash and no lock is held while one is opened, so lookups in other directories never wait on a syscall.
+	Concurrent lookups of a directory being opened wait for that open rather than opening it again. The most
+	recently used directories of each shard are kept open by strong references so bursts of creations don't reopen
+	them every time their last file closes. Expired entries are swept out as a shard grows.
+	*/
+	class dircache_t
+	{
+		typedef std::shared_ptr<async_io_handle> handle_ptr;
+		typedef std::list<std::pair<std::filesystem::path, handle_ptr>> hot_t;
+		struct entry
+		{
+			std::weak_ptr<async_io_handle> h;
+			shared_future<handle_ptr> opening; // Valid while the first lookup opens the directory
+			bool hot;
+			hot_t::iterator hotit; // Where in the shard's hot list, if hot
+			entry() : hot(false) { }
+		};
+		struct shard_t
+		{
+			typedef boost::detail::spinlock lock_t;
+			lock_t lock;
+			std::unordered_map<std::filesystem::path, entry> entries;
+			hot_t hot; // Most recently used first
+			size_t sweepat;
+			shard_t() : sweepat(64)
+			{
+				// Boost's spinlock is so lightweight it has no constructor ...
+				lock.unlock();
+			}
+			// Makes path the most recently used. Call with lock held.
+			void touch(const std::filesystem::path &path, entry &e, const handle_ptr &h)
+			{
+				if(e.hot)
+				{
+					hot.splice(hot.begin(), hot, e.hotit);
+					return;
+				}
+				e.hot=true;
+				hot.push_front(std::make_pair(path, h));
+				e.hotit=hot.begin();
+				if(hot.size()>DIRCACHE_HOT/DIRCACHE_SHARDS)
+				{
+					auto it=entries.find(hot.back().first);
+					if(entries.end()!=it)
+						it->second.hot=false;
+					hot.pop_back();
+				}
+			}
+			// Drops entries whose directory nothing uses any more. Call with lock held.
+			void sweep()
+			{
+				if(entries.size()<sweepat)
+					return;
+				for(auto it=entries.begin(); it!=entries.end();)
+				{
+					if(!it->second.opening.valid() && it->second.h.expired())
+						it=entries.erase(it);
+					else
+						++it;
+				}
+				sweepat=std::max((size_t) 64, entries.size()*2);
+			}
+		};
+		shard_t shards[DIRCACHE_SHARDS];
+		shard_t &shard(const std::filesystem::path &path) { return shards[std::hash<std::filesystem::path>()(path) % DIRCACHE_SHARDS]; }
+	public:
+		//! Returns a handle to the directory at path, opening it if needed
+		handle_ptr get(const std::filesystem::path &path)
+		{
+			shard_t &s=shard(path);
+			for(;;)
+			{
+				shared_future<handle_ptr> wait;
+				promise<handle_ptr> opened;
+				{
+					lock_guard<shard_t::lock_t> g(s.lock);
+					entry &e=s.entries[path];
+					if(e.opening.valid())
+						wait=e.opening;
+					else
+					{
+						handle_ptr h(e.h.lock());
+						if(h)
+						{
+							s.touch(path, e, h);
+							return h;
+						}
+						s.sweep();
+						e.opening=opened.get_future();
+					}
+				}
+				if(wait.valid())
+				{
+					// If the open failed, try it ourselves so we throw its error
+					handle_ptr h(wait.get());
+					if(h)
+						return h;
+					continue;
+				}
+				handle_ptr h;
+				try
+				{
+					h=std::make_shared<async_io_handle_posix>(std::shared_ptr<async_file_io_dispatcher_base>(), std::shared_ptr<detail::async_io_handle>(),
+						path, false, posix_open(path.c_str(), O_RDONLY, 0x1b0/*660*/));
+				}
+				catch(...)
+				{
+					{
+						lock_guard<shard_t::lock_t> g(s.lock);
+						s.entries.erase(path);
+					}
+					opened.set_value(handle_ptr());
+					throw;
+				}
+				{
+					lock_guard<shard_t::lock_t> g(s.lock);
+					entry &e=s.entries[path];
+					e.opening=shared_future<handle_ptr>();
+					e.h=h;
+					s.touch(path, e, h);
+				}
+				opened.set_value(h);
+				return h;
+			}
+		}
+		/*! Forgets the directory at path, as a new directory there must not be confused with it. Directories only get
+		removed once empty, so any within it have already been removed and forgotten. */
+		void erase(const std::filesystem::path &path)
+		{
+			shard_t &s=shard(path);
+			lock_guard<shard_t::lock_t> g(s.lock);
+			auto it=s.entries.find(path);
+			if(s.entries.end()==it || it->second.opening.valid())
+				return;
+			if(it->second.hot)
+				s.hot.erase(it->second.hotit);
+			s.entries.erase(it);
+		}
+		//! True if child is parent or anywhere within it
+		static bool is_within(const std::filesystem::path &child, const std::filesystem::path &parent)
+		{
+			auto pit=parent.begin(), cit=child.begin();
+			for(; pit!=parent.end() && cit!=child.end(); ++pit, ++cit)
+				if(*pit!=*cit)
+					return false;
+			return pit==parent.end();
+		}
+	};
+	/* Read only file handles on POSIX keyed by path and open flags. Every file() of the same key gets the same handle
+	while any of them is in use. After the last close() the cache keeps the fd open, so the next file() only needs
+	a new handle around it once it has checked the path still refers to the same file. Idle fds beyond the limit are
+	closed least recently used first, as are all idle fds once the dispatcher nears the process' limit on open files.
+	Only weak references to handles are kept, as handles keep their dispatcher alive.
+	*/
+	class filecache_t
+	{
+		typedef std::shared_ptr<async_io_handle> handle_ptr;
+		typedef std::pair<std::filesystem::path, file_flags> key_t;
+		struct entry
+		{
+			std::weak_ptr<async_io_handle> h;
+			size_t users;
+			int idlefd; // The fd kept open when users is zero
+			std::list<key_t>::iterator idle;
+			entry() : users(0), idlefd(-1) { }
+		};
+		// A path is rarely open with more than a few different flags, so its entries are just kept together
+		typedef std::vector<std::pair<file_flags, entry>> byflags_t;
+		typedef boost::detail::spinlock lock_t;
+		lock_t lock;
+		std::atomic<size_t> limit;
+		size_t fdlimit;
+		std::unordered_map<std::filesystem::path, byflags_t> entries;
+		std::list<key_t> idle; // Most recently closed first
+		// Returns the entry for key, if any. Call with lock held.
+		entry *find(const key_t &key)
+		{
+			auto it=entries.find(key.first);
+			if(entries.end()==it)
+				return nullptr;
+			for(auto &i : it->second)
+				if(i.first==key.second)
+					return &i.second;
+			return nullptr;
+		}
+		// Returns the entry for key, adding it if need be. Call with lock held.
+		entry &find_or_add(const key_t &key)
+		{
+			byflags_t &byflags=entries[key.first];
+			for(auto &i : byflags)
+				if(i.first==key.second)
+					return i.second;
+			byflags.push_back(std::make_pair(key.second, entry()));
+			return byflags.back().second;
+		}
+		// Forgets the entry for key. Call with lock held.
+		void remove(const key_t &key)
+		{
+			auto it=entries.find(key.first);
+			if(entries.end()==it)
+				return;
+			for(auto i=it->second.begin(); i!=it->second.end(); ++i)
+				if(i->first==key.second)
+				{
+					it->second.erase(i);
+					break;
+				}
+			if(it->second.empty())
+				entries.erase(it);
+		}
+		// Unlinks the least recently used idle fd, which the caller closes after unlocking
+		int evict_one()
+		{
+			key_t key(idle.back());
+			int fd=find(key)->idlefd;
+			idle.pop_back();
+			remove(key);
+			return fd;
+		}
+		// Unlinks every idle fd of one path's entries, which the caller closes after unlocking
+		void evict_all(const byflags_t &byflags, std::vector<int> &evicted)
+		{
+			for(auto &i : byflags)
+			{
+				// Handles in use keep their fd until closed, which finding no entry here does normally
+				if(!i.second.users && -1!=i.second.idlefd)
+				{
+					evicted.push_back(i.second.idlefd);
+					idle.erase(i.second.idle);
+				}
+			}
+		}
+		static void close_fds(const std::vector<int> &fds)
+		{
+			for(auto &fd : fds)
+				posix_close(fd);
+		}
+		// True if path still refers to the file open as fd
+		static bool is_same_file(int fd, const std::filesystem::path &path)
+		{
+#ifdef WIN32
+			return true;
+#else
+			struct stat a, b;
+			if(-1==fstat(fd, &a) || -1==posix_statat(AT_FDCWD, path.c_str(), &b))
+				return false;
+			return a.st_dev==b.st_dev && a.st_ino==b.st_ino;
+#endif
+		}
+	public:
+		filecache_t() : limit(0), fdlimit((size_t) -1)
+		{
+			// Boost's spinlock is so lightweight it has no constructor ...
+			lock.unlock();
+		}
+		~filecache_t()
+		{
+			std::vector<int> evicted;
+			while(!idle.empty())
+				evicted.push_back(evict_one());
+			close_fds(evicted);
+		}
+		//! True if opens with these flags may share a handle
+		static bool cacheable(file_flags flags)
+		{
+			return file_flags::Read==(flags & (file_flags::Read|file_flags::Write|file_flags::Append|file_flags::Truncate|file_flags::Create|file_flags::CreateOnlyIfNotExist));
+		}
+		bool enabled() const { return !!limit; }
+		void set_limit(size_t _limit)
+		{
+			std::vector<int> evicted;
+			{
+				lock_guard<lock_t> g(lock);
+				limit=_limit;
+#ifndef WIN32
+				// Leave a quarter of the process' fds for everything else
+				struct rlimit r;
+				if(!getrlimit(RLIMIT_NOFILE, &r) && RLIM_INFINITY!=r.rlim_cur)
+					fdlimit=(size_t) r.rlim_cur-(size_t) r.rlim_cur/4;
+#endif
+				while(idle.size()>limit)
+					evicted.push_back(evict_one());
+			}
+			close_fds(evicted);
+		}
+		/*! Returns the handle in use at path with these flags if there is one, else wraps an idle fd there if there is one.
+		The idle fd is taken out of the cache before checking and wrapping it, so other lookups never wait on either. */
+		handle_ptr get(const std::filesystem::path &path, file_flags flags, const std::function<handle_ptr(int)> &wrap)
+		{
+			key_t key(path, flags);
+			int fd;
+			{
+				lock_guard<lock_t> g(lock);
+				entry *e=find(key);
+				if(!e)
+					return handle_ptr();
+				if(e->users)
+				{
+					handle_ptr h(e->h.lock());
+					if(h)
+						e->users++;
+					else
+						remove(key); // Dropped without being closed, which closed its fd
+					return h;
+				}
+				if(-1==e->idlefd)
+					return handle_ptr();
+				fd=e->idlefd;
+				idle.erase(e->idle);
+				remove(key);
+			}
+			// Replaced by something else since it was closed? Then the caller must open what is there now.
+			if(!is_same_file(fd, path))
+			{
+				posix_close(fd);
+				return handle_ptr();
+			}
+			handle_ptr h;
+			try
+			{
+				h=wrap(fd);
+			}
+			catch(...)
+			{
+				posix_close(fd);
+				throw;
+			}
+			// If another open of the same key got in meanwhile this handle simply isn't shared, and closes normally
+			lock_guard<lock_t> g(lock);
+			entry &e=find_or_add(key);
+			if(e.users ? e.h.expired() : -1==e.idlefd)
+			{
+				e.h=h;
+				e.users=1;
+			}
+			return h;
+		}
+		//! Shares a handle just opened unless another of the same key got there first. open is how many handles the dispatcher has open.
+		bool add(const std::filesystem::path &path, file_flags flags, const handle_ptr &h, size_t open)
+		{
+			std::vector<int> evicted;
+			{
+				lock_guard<lock_t> g(lock);
+				entry &e=find_or_add(key_t(path, flags));
+				if(e.users ? !e.h.expired() : -1!=e.idlefd)
+					return false;
+				e.h=h;
+				e.users=1;
+				while(open+idle.size()>=fdlimit && !idle.empty())
+					evicted.push_back(evict_one());
+			}
+			close_fds(evicted);
+			return true;
+		}
+		//! Called by close() of a handle which may be shared. Returns false if it is not, else its fd is kept open here.
+		bool release(const handle_ptr &h, file_flags flags)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			std::vector<int> evicted;
+			{
+				lock_guard<lock_t> g(lock);
+				key_t key(h->path(), flags);
+				entry *e=find(key);
+				if(!e || !e->users || e->h.lock()!=h)
+					return false;
+				if(!--e->users)
+				{
+					if(p->readahead)
+						p->readahead->invalidate(true);
+					e->idlefd=p->release_fd();
+					e->h.reset();
+					idle.push_front(key);
+					e->idle=idle.begin();
+					while(idle.size()>limit)
+						evicted.push_back(evict_one());
+				}
+			}
+			close_fds(evicted);
+			return true;
+		}
+		//! Forgets every handle of path, or of anything within it if a directory, as a new file there must not be confused with it
+		void erase(const std::filesystem::path &path, bool within)
+		{
+			std::vector<int> evicted;
+			{
+				lock_guard<lock_t> g(lock);
+				if(!within)
+				{
+					auto it=entries.find(path);
+					if(entries.end()!=it)
+					{
+						evict_all(it->second, evicted);
+						entries.erase(it);
+					}
+				}
+				else
+				{
+					for(auto it=entries.begin(); it!=entries.end();)
+					{
+						if(dircache_t::is_within(it->first, path))
+						{
+							evict_all(it->second, evicted);
+							it=entries.erase(it);
+						}
+						else
+							++it;
+					}
+				}
+			}
+			close_fds(evicted);
+		}
+		//! Closes every idle fd, returning how many there were
+		size_t evict_idle()
+		{
+			std::vector<int> evicted;
+			{
+				lock_guard<lock_t> g(lock);
+				while(!idle.empty())
+					evicted.push_back(evict_one());
+			}
+			close_fds(evicted);
+			return evicted.size();
+		}
+	};
+	class async_file_io_dispatcher_compat : public async_file_io_dispatcher_base
+	{
+	protected:
+		// Reads and writes of up to this many buffers gather them on the stack rather than the heap
+		static const size_t inline_iovecs=16;
+		// Keep a cache of handles to containing directories on POSIX
+		dircache_t dircache;
+		// And optionally one of read only file handles
+		filecache_t filecache;
+		// Called in unknown thread. Returns the shared handle for a read only open if the cache has one.
+		std::shared_ptr<detail::async_io_handle> get_cached_file_handle(const std::filesystem::path &path, std::shared_ptr<detail::async_io_handle> dirh, file_flags flags)
+		{
+			if(!filecache.enabled() || !filecache_t::cacheable(flags))
+				return std::shared_ptr<detail::async_io_handle>();
+			return filecache.get(path, flags, [this, &dirh, &path, flags](int fd) -> std::shared_ptr<detail::async_io_handle> {
+				auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), dirh, path, false, fd);
+				static_cast<async_io_handle_posix *>(ret.get())->do_add_io_handle_to_parent();
+				static_cast<async_io_handle_posix *>(ret.get())->do_discover_block_size(flags);
+				static_cast<async_io_handle_posix *>(ret.get())->do_enable_readahead(flags);
+				static_cast<async_io_handle_posix *>(ret.get())->cacheflags=flags;
+				static_cast<async_io_handle_posix *>(ret.get())->cached=true;
+				return ret;
+			});
+		}
+		// Called in unknown thread. Shares a read only handle just opened if the cache is enabled.
+		void cache_file_handle(std::shared_ptr<detail::async_io_handle> h, file_flags flags)
+		{
+			if(!filecache.enabled() || !filecache_t::cacheable(flags))
+				return;
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			if(filecache.add(h->path(), flags, h, count()))
+			{
+				p->cacheflags=flags;
+				p->cached=true;
+			}
+		}
+		std::shared_ptr<detail::async_io_handle> get_handle_to_containing_dir(const std::filesystem::path &path)
+		{
+			return dircache.get(path.parent_path());
+		}
+		// Where to look up a path request: relative to the open directory of its precondition if it was made
+		// relative to one, else by absolute path
+		struct path_at
+		{
+			int dirfd;
+			std::filesystem::path path, abspath;
+		};
+		static path_at resolve_path(const std::shared_ptr<detail::async_io_handle> &dirh, const async_path_op_req &req)
+		{
+			path_at ret;
+			ret.dirfd=AT_FDCWD;
+			ret.abspath=detail::absolute_path(dirh, req);
+			ret.path=ret.abspath;
+#ifndef WIN32
+			if(req.is_relative() && static_cast<async_io_handle_posix *>(dirh.get())->fd>=0)
+			{
+				ret.dirfd=static_cast<async_io_handle_posix *>(dirh.get())->fd;
+				ret.path=req.path;
+			}
+#endif
+			return ret;
+		}
+
+		// Called in unknown thread
+		completion_returntype dodir(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
+		{
+			int ret=0;
+			path_at at=resolve_path(_, req);
+			req.flags=fileflags(req.flags);
+			bool syncdir=false;
+			if(!!(req.flags & (file_flags::Create|file_flags::CreateOnlyIfNotExist)))
+			{
+#ifdef __linux__
+				// Need to fsync the containing directory, otherwise the directory isn't guaranteed to appear where we just created it
+				syncdir=!!(req.flags & (file_flags::AutoFlush|file_flags::OSSync));
+#endif
+				ret=posix_mkdirat(at.dirfd, at.path.c_str(), 0x1f8/*770*/);
+				if(-1==ret && EEXIST==errno)
+				{
+					// Ignore already exists unless we were asked otherwise
+					if(!(req.flags & file_flags::CreateOnlyIfNotExist))
+						ret=0;
+				}
+				req.flags=req.flags&~(file_flags::Create|file_flags::CreateOnlyIfNotExist);
+			}
+
+			struct stat s={0};
+			ret=posix_statat(at.dirfd, at.path.c_str(), &s);
+			if(0==ret && !S_ISDIR(s.st_mode))
+				throw std::runtime_error("Not a directory");
+			if(file_flags::Read==(req.flags & file_flags::Read))
+			{
+				completion_returntype ret=dofile(id, _, req);
+				// Creations in the same directory at the same time share its fsyncs
+				if(syncdir)
+					return dogroupsync(id, get_handle_to_containing_dir(at.abspath), ret.second);
+				return ret;
+			}
+			else
+			{
+				// Create dummy handle so
+				std::shared_ptr<detail::async_io_handle> dirh;
+				if(syncdir)
+					req.flags=req.flags|file_flags::FastDirectoryEnumeration;
+				if(!!(req.flags & file_flags::FastDirectoryEnumeration))
+					dirh=get_handle_to_containing_dir(at.abspath);
+				auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), dirh, at.abspath, false, -999);
+				// Creations in the same directory at the same time share its fsyncs
+				if(syncdir)
+					return dogroupsync(id, dirh, ret);
+				return std::make_pair(true, ret);
+			}
+		}
+		// Called in unknown thread
+		completion_returntype dormdir(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
+		{
+			path_at at=resolve_path(_, req);
+			req.flags=fileflags(req.flags);
+			ERRHOSFN(posix_rmdirat(at.dirfd, at.path.c_str()), at.abspath);
+			dircache.erase(at.abspath);
+			filecache.erase(at.abspath, true);
+			auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), std::shared_ptr<detail::async_io_handle>(), at.abspath, false, -999);
+			return std::make_pair(true, ret);
+		}
+		// Translates file_flags into flags for posix_open()
+		static int posix_open_flags(file_flags _flags)
+		{
+			int flags=0;
+			if(!!(_flags & file_flags::Read) && !!(_flags & file_flags::Write)) flags|=O_RDWR;
+			else if(!!(_flags & file_flags::Read)) flags|=O_RDONLY;
+			else if(!!(_flags & file_flags::Write)) flags|=O_WRONLY;
+			if(!!(_flags & file_flags::Append)) flags|=O_APPEND;
+			if(!!(_flags & file_flags::Truncate)) flags|=O_TRUNC;
+			if(!!(_flags & file_flags::CreateOnlyIfNotExist)) flags|=O_EXCL|O_CREAT;
+			else if(!!(_flags & file_flags::Create)) flags|=O_CREAT;
+#ifdef O_DIRECT
+			if(!!(_flags & file_flags::OSDirect)) flags|=O_DIRECT;
+#endif
+#ifdef O_SYNC
+			if(!!(_flags & file_flags::OSSync)) flags|=O_SYNC;
+#endif
+			return flags;
+		}
+		// Called in unknown thread
+		completion_returntype dofile(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
+		{
+			std::shared_ptr<detail::async_io_handle> dirh;
+			path_at at=resolve_path(_, req);
+			req.flags=fileflags(req.flags);
+			int flags=posix_open_flags(req.flags);
+#ifdef __linux__
+			// Need to fsync the containing directory, otherwise the file isn't guaranteed to appear where we just created it
+			if((flags & O_CREAT) && !!(req.flags & (file_flags::AutoFlush|file_flags::OSSync)))
+				req.flags=req.flags|file_flags::FastDirectoryEnumeration;
+#endif
+			if(!!(req.flags & file_flags::FastDirectoryEnumeration))
+				dirh=get_handle_to_containing_dir(at.abspath);
+			if(auto cached=get_cached_file_handle(at.abspath, dirh, req.flags))
+				return std::make_pair(true, cached);
+			int fd=posix_openat(at.dirfd, at.path.c_str(), flags, 0x1b0/*660*/);
+			// Out of fds? Let go of idle cached handles and try again.
+			if(-1==fd && EMFILE==errno && filecache.evict_idle())
+				fd=posix_openat(at.dirfd, at.path.c_str(), flags, 0x1b0/*660*/);
+			// If writing and autoflush and NOT synchronous, turn on autoflush
+			auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), dirh, at.abspath, (file_flags::AutoFlush|file_flags::Write)==(req.flags & (file_flags::AutoFlush|file_flags::Write|file_flags::OSSync)),
+				fd);
+			static_cast<async_io_handle_posix *>(ret.get())->do_add_io_handle_to_parent();
+			static_cast<async_io_handle_posix *>(ret.get())->do_discover_block_size(req.flags);
+			static_cast<async_io_handle_posix *>(ret.get())->do_enable_readahead(req.flags);
+			cache_file_handle(ret, req.flags);
+#ifdef __linux__
+			// Creations in the same directory at the same time share its fsyncs
+			if(!!(req.flags & (file_flags::Create|file_flags::CreateOnlyIfNotExist)) && !!(req.flags & (file_flags::AutoFlush|file_flags::OSSync)))
+				return dogroupsync(id, dirh, ret);
+#endif
+			return std::make_pair(true, ret);
+		}
+		// Called in unknown thread
+		completion_returntype dormfile(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
+		{
+			path_at at=resolve_path(_, req);
+			req.flags=fileflags(req.flags);
+			ERRHOSFN(posix_unlinkat(at.dirfd, at.path.c_str()), at.abspath);
+			filecache.erase(at.abspath, false);
+			auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), std::shared_ptr<detail::async_io_handle>(), at.abspath, false, -999);
+			return std::make_pair(true, ret);
+		}
+		// Called in unknown thread
+		completion_returntype dosync(size_t id, std::shared_ptr<detail::async_io_handle> h, async_io_op)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			if(!p->write_count_since_fsync())
+			{
+				p->has_ever_been_fsynced=true;
+				return std::make_pair(true, h);
+			}
+			return dogroupsync(id, h, h);
+		}
+		// Called in unknown thread. Fsyncs h then completes op id with ret, unless an fsync of h is in flight
+		// in which case op id completes after the next one.
+		completion_returntype dogroupsync(size_t id, std::shared_ptr<detail::async_io_handle> h, std::shared_ptr<detail::async_io_handle> ret)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			if(!p->syncs.join(id, ret))
+				return std::make_pair(false, ret);
+			off_t written=p->byteswritten;
+			++async_file_io_dispatcher_base::p->groupfsyncs;
+			int result=posix_fsync(p->fd), errcode=errno;
+			if(!result)
+				p->synced(written);
+			sync_group::waiters_t waiters(p->syncs.next());
+			if(!waiters.empty())
+				threadpool().post(std::bind(&async_file_io_dispatcher_compat::dosyncgroup, this, h, std::move(waiters)));
+			if(result)
+				ERRGOSFN(errcode, p->path());
+			return std::make_pair(true, ret);
+		}
+		// Called in unknown thread. Performs one fsync on behalf of all the syncs which arrived during the last one.
+		void dosyncgroup(std::shared_ptr<detail::async_io_handle> h, sync_group::waiters_t waiters)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			exception_ptr e;
+			try
+			{
+				off_t written=p->byteswritten;
+				++async_file_io_dispatcher_base::p->groupfsyncs;
+				ERRHOSFN(posix_fsync(p->fd), p->path());
+				p->synced(written);
+			}
+			catch(...)
+			{
+				e=async_io::make_exception_ptr(current_exception());
+			}
+			DEBUG_PRINT("S %u syncs shared one fsync of %p\n", (unsigned) waiters.size(), h.get());
+			for(auto &w : waiters)
+				complete_async_op(w.first, w.second, e);
+			waiters=p->syncs.next();
+			if(!waiters.empty())
+				threadpool().post(std::bind(&async_file_io_dispatcher_compat::dosyncgroup, this, h, std::move(waiters)));
+		}
+		// Called in unknown thread
+		completion_returntype dosyncrange(size_t id, std::shared_ptr<detail::async_io_handle> h, async_sync_op_req req)
+		{
+			if(sync_kind::Full==req.kind)
+				return dosync(id, h, req.precondition);
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			if(!p->write_count_since_fsync())
+				return std::make_pair(true, h);
+#ifdef __linux__
+			if(sync_kind::Data!=req.kind)
+			{
+				ERRHOSFN(sync_file_range(p->fd, req.offset, req.length, sync_file_range_flags(req.kind)), p->path());
+				return std::make_pair(true, h);
+			}
+#endif
+			// Elsewhere a ranged sync syncs all the data
+			off_t written=p->byteswritten;
+			ERRHOSFN(posix_fdatasync(p->fd), p->path());
+			p->synced(written);
+			return std::make_pair(true, h);
+		}
+#ifdef __linux__
+		static unsigned sync_file_range_flags(sync_kind kind)
+		{
+			return sync_kind::WriteAndWait==kind ? SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER : SYNC_FILE_RANGE_WRITE;
+		}
+#endif
+		// Called in unknown thread
+		completion_returntype doclose(size_t id, std::shared_ptr<detail::async_io_handle> h, async_io_op)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			// Shared read only handles stay open for reuse
+			if(p->cached && filecache.release(h, p->cacheflags))
+				return std::make_pair(true, h);
+			if(p->readahead)
+				p->readahead->invalidate(true);
+			if(p->autoflush && p->write_count_since_fsync())
+				ERRHOSFN(posix_fsync(p->fd), p->path());
+			ERRHOSFN(posix_close(p->fd), p->path());
+			p->fd=-1;
+			return std::make_pair(true, h);
+		}
+		// Called in unknown thread after a read of a read ahead handle. If it continued a sequential run, fills the windows following it.
+		void do_readahead(std::shared_ptr<detail::async_io_handle> h, off_t where, size_t length)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			std::vector<std::pair<size_t, off_t>> fills;
+			size_t generation=p->readahead->advance(where, length, fills);
+			if(fills.empty())
+				return;
+#ifdef POSIX_FADV_WILLNEED
+			// Have the kernel start on what lies beyond the windows too
+			posix_fadvise(p->fd, fills.back().second+READAHEAD_WINDOW, READAHEAD_WINDOW*READAHEAD_WINDOWS, POSIX_FADV_WILLNEED);
+#endif
+			for(auto &i : fills)
+			{
+				size_t slot=i.first;
+				off_t at=i.second;
+				threadpool().post([h, p, slot, at, generation] {
+					iovec v;
+					v.iov_base=p->readahead->windows[slot].data.get();
+					v.iov_len=READAHEAD_WINDOW;
+					// Speculative, so failure just means nothing was read ahead
+					p->readahead->filled(slot, generation, preadv(p->fd, &v, 1, at));
+				});
+			}
+		}
+		// Called in unknown thread. Satisfies a read of a read ahead handle from its windows if they hold all of it.
+		bool do_readahead_serve(std::shared_ptr<detail::async_io_handle> h, const async_data_op_req<void> &req)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			if(!p->readahead->serve(req.buffers, req.where))
+				return false;
+			size_t length=boost::asio::buffer_size(req.buffers);
+			p->bytesread+=length;
+			do_readahead(h, req.where, length);
+			return true;
+		}
+		// Copies length bytes between data and the bytes of vecs starting offset bytes in
+		static void copy_buffers(const std::vector<iovec> &vecs, size_t offset, char *data, size_t length, bool tovecs)
+		{
+			for(auto &v : vecs)
+			{
+				if(!length)
+					break;
+				if(offset>=v.iov_len)
+				{
+					offset-=v.iov_len;
+					continue;
+				}
+				size_t amount=std::min(length, v.iov_len-offset);
+				if(tovecs)
+					memcpy((char *) v.iov_base+offset, data, amount);
+				else
+					memcpy(data, (char *) v.iov_base+offset, amount);
+				data+=amount;
+				length-=amount;
+				offset=0;
+			}
+		}
+		// Appends the pieces of vecs covering length bytes starting offset bytes in, returning false if any isn't aligned
+		static bool slice_buffers(std::vector<iovec> &out, const std::vector<iovec> &vecs, size_t offset, size_t length, size_t alignment)
+		{
+			for(auto &v : vecs)
+			{
+				if(!length)
+					break;
+				if(offset>=v.iov_len)
+				{
+					offset-=v.iov_len;
+					continue;
+				}
+				iovec piece;
+				piece.iov_base=(char *) v.iov_base+offset;
+				piece.iov_len=std::min(length, v.iov_len-offset);
+				if(((size_t) piece.iov_base | piece.iov_len) & (alignment-1))
+					return false;
+				out.push_back(piece);
+				length-=piece.iov_len;
+				offset=0;
+			}
+			return true;
+		}
+		/* Called in unknown thread. Does OSDirect i/o which isn't aligned to the handle's block size by doing the aligned
+		body straight to or from the caller's buffers where those are aligned too, and the partial blocks at either end
+		through a bounce buffer. Writes read-modify-write those edge blocks, so anything else writing the same blocks
+		concurrently may be lost. Returns how many of the caller's bytes were transferred.
+		*/
+		ssize_t do_unaligned_direct_io(async_io_handle_posix *p, const std::vector<iovec> &vecs, off_t where, bool iswrite)
+		{
+			const off_t blocksize=(off_t) p->blocksize;
+			size_t length=0;
+			for(auto &v : vecs)
+				length+=v.iov_len;
+			off_t start=where & ~(blocksize-1), end=(where+(off_t) length+blocksize-1) & ~(blocksize-1);
+			off_t bodystart=(where==start) ? start : start+blocksize, bodyend=(where+(off_t) length==end) ? end : end-blocksize;
+			// Runs of the aligned span which go through the bounce buffer, in file order
+			std::vector<std::pair<off_t, size_t>> bounced;
+			std::vector<iovec> body;
+			if(bodystart<bodyend && slice_buffers(body, vecs, (size_t)(bodystart-where), (size_t)(bodyend-bodystart), (size_t) blocksize))
+			{
+				if(start<bodystart)
+					bounced.push_back(std::make_pair(start, (size_t)(bodystart-start)));
+				if(bodyend<end)
+					bounced.push_back(std::make_pair(bodyend, (size_t)(end-bodyend)));
+			}
+			else
+			{
+				body.clear();
+				bounced.push_back(std::make_pair(start, (size_t)(end-start)));
+			}
+			size_t bouncelength=0;
+			for(auto &b : bounced)
+				bouncelength+=b.second;
+			async_io_buffer bounce(allocate_buffer(bouncelength));
+			std::vector<iovec> io;
+			io.reserve(body.size()+2);
+			iovec v;
+			v.iov_base=bounce.data();
+			for(auto &b : bounced)
+			{
+				v.iov_len=b.second;
+				if(b.first!=start)
+					io.insert(io.end(), body.begin(), body.end());
+				io.push_back(v);
+				v.iov_base=(char *) v.iov_base+b.second;
+			}
+			if(bounced.back().first==start)
+				io.insert(io.end(), body.begin(), body.end());
+			if(iswrite)
+			{
+				struct stat s;
+				ERRHOSFN(fstat(p->fd, &s), p->path());
+				// Fetch the existing contents of the edge blocks, anything past the end of the file being zeros. Write only
+				// handles need a second handle to read them through.
+				int readfd=p->fd;
+				auto closereadfd=NiallsCPP11Utilities::Undoer([p, &readfd](){ if(readfd!=p->fd) posix_close(readfd); });
+				auto readedge=[p, &readfd, &s, blocksize](char *buffer, off_t at) {
+					if(at>=(off_t) s.st_size)
+						return;
+					if(readfd==p->fd && O_WRONLY==(fcntl(p->fd, F_GETFL) & O_ACCMODE))
+						ERRHOSFN(readfd=posix_open(p->path().c_str(), posix_open_flags(file_flags::Read|file_flags::OSDirect), 0), p->path());
+					ERRHOSFN((int) pread(readfd, buffer, (size_t) blocksize, at), p->path());
+				};
+				memset(bounce.data(), 0, bouncelength);
+				char *edge=(char *) bounce.data();
+				for(auto &b : bounced)
+				{
+					off_t bend=b.first+(off_t) b.second;
+					if(b.first<where)
+						readedge(edge, b.first);
+					if(bend>where+(off_t) length && (bend-blocksize>b.first || b.first>=where))
+						readedge(edge+b.second-blocksize, bend-blocksize);
+					off_t from=std::max(b.first, where), to=std::min(bend, where+(off_t) length);
+					copy_buffers(vecs, (size_t)(from-where), edge+(from-b.first), (size_t)(to-from), false);
+					edge+=b.second;
+				}
+				ssize_t byteswritten=0;
+				for(size_t n=0; n<io.size(); n+=IOV_MAX)
+				{
+					ssize_t _byteswritten;
+					ERRHOSFN((int) (_byteswritten=pwritev(p->fd, (&io.front())+n, std::min((int) (io.size()-n), IOV_MAX), start+byteswritten)), p->path());
+					byteswritten+=_byteswritten;
+				}
+				if(byteswritten!=(ssize_t)(end-start))
+					throw std::runtime_error("Failed to write all buffers");
+				// Writing whole blocks may have extended the file past where the caller's write ended
+				if(end>(off_t) s.st_size && where+(off_t) length<end)
+					ERRHOSFN(posix_ftruncate(p->fd, std::max((off_t) s.st_size, where+(off_t) length)), p->path());
+				return (ssize_t) length;
+			}
+			ssize_t bytesread=0;
+			for(size_t n=0; n<io.size(); n+=IOV_MAX)
+			{
+				ssize_t _bytesread;
+				ERRHOSFN((int) (_bytesread=preadv(p->fd, (&io.front())+n, std::min((int) (io.size()-n), IOV_MAX), start+bytesread)), p->path());
+				bytesread+=_bytesread;
+				if(!_bytesread)
+					break;
+			}
+			// Only what was read before the end of the file is valid
+			off_t validend=std::min(start+bytesread, where+(off_t) length);
+			if(validend<=where)
+				return 0;
+			char *edge=(char *) bounce.data();
+			for(auto &b : bounced)
+			{
+				off_t from=std::max(b.first, where), to=std::min(b.first+(off_t) b.second, validend);
+				if(from<to)
+					copy_buffers(vecs, (size_t)(from-where), edge+(from-b.first), (size_t)(to-from), true);
+				edge+=b.second;
+			}
+			return (ssize_t)(validend-where);
 		}
 		// Called in unknown thread
-		completion_returntype dotruncate(size_t id, std::shared_ptr<detail::async_io_handle> h, off_t _newsize)
+		virtual size_t int_copy(std::shared_ptr<detail::async_io_handle> src, off_t srcoffset, std::shared_ptr<detail::async_io_handle> dst, off_t dstoffset, size_t length)
 		{
-			async_io_handle_windows *p=static_cast<async_io_handle_windows *>(h.get());
-			assert(p);
+			size_t copied=do_copy(src, srcoffset, dst, dstoffset, length);
+			src->bytesread+=copied;
+			dst->byteswritten+=copied;
+			return copied;
+		}
+		// Called in unknown thread. Copies within the kernel if it can, otherwise through a pooled buffer.
+		size_t do_copy(std::shared_ptr<detail::async_io_handle> src, off_t srcoffset, std::shared_ptr<detail::async_io_handle> dst, off_t dstoffset, size_t length)
+		{
+			async_io_handle_posix *s=static_cast<async_io_handle_posix *>(src.get()), *d=static_cast<async_io_handle_posix *>(dst.get());
+			// Anything read ahead of the destination may be stale however this exits
+			auto unreadahead=NiallsCPP11Utilities::Undoer([d](){ if(d->readahead) d->readahead->invalidate(); });
+#ifdef __linux__
+			// Neither copy_file_range nor splice can do unaligned OSDirect i/o
+			if(!((s->blocksize && (srcoffset & (s->blocksize-1))) || (d->blocksize && (dstoffset & (d->blocksize-1)))))
+			{
+				loff_t in=(loff_t) srcoffset, out=(loff_t) dstoffset;
+#ifdef __NR_copy_file_range
+				ssize_t ret=(ssize_t) syscall(__NR_copy_file_range, s->fd, &in, d->fd, &out, length, 0);
+				if(ret>=0)
+					return (size_t) ret;
+				// Older kernels can't copy between filing systems, and some filing systems can't copy at all
+				if(EXDEV!=errno && ENOSYS!=errno && EOPNOTSUPP!=errno && EINVAL!=errno)
+					ERRHOSFN(-1, d->path());
+#endif
+				// Otherwise splice through a pipe. Unlike sendfile this writes at an explicit offset, so copies into
+				// the same handle at the same time can't move one another's file position.
+				int pipefds[2];
+				if(-1!=pipe2(pipefds, O_CLOEXEC))
+				{
+					auto closepipe=NiallsCPP11Utilities::Undoer([&pipefds](){ posix_close(pipefds[0]); posix_close(pipefds[1]); });
+					size_t copied=0;
+					bool cantsplice=false;
+					while(copied<length)
+					{
+						ssize_t inpipe=splice(s->fd, &in, pipefds[1], NULL, length-copied, SPLICE_F_MOVE);
+						if(!inpipe)
+							break;
+						if(inpipe<0)
+						{
+							// Some filing systems can't splice, so copy through a buffer instead
+							if(!copied && (EINVAL==errno || ENOSYS==errno))
+							{
+								cantsplice=true;
+								break;
+							}
+							ERRHOSFN(-1, s->path());
+						}
+						for(ssize_t outpipe; inpipe; inpipe-=outpipe, copied+=(size_t) outpipe)
+							ERRHOSFN((int)(outpipe=splice(pipefds[0], NULL, d->fd, &out, (size_t) inpipe, SPLICE_F_MOVE)), d->path());
+					}
+					if(!cantsplice)
+						return copied;
+				}
+			}
+#endif
+			async_io_buffer buffer(allocate_buffer(std::min(length, (size_t) COPY_BUFFER)));
+			std::vector<iovec> vecs(1);
+			vecs.front().iov_base=buffer.data();
+			vecs.front().iov_len=std::min(length, buffer.size());
+			ssize_t bytesread;
+			if(s->blocksize && !s->is_block_aligned(vecs, srcoffset))
+				bytesread=do_unaligned_direct_io(s, vecs, srcoffset, false);
+			else
+				ERRHOSFN((int) (bytesread=pread(s->fd, vecs.front().iov_base, vecs.front().iov_len, srcoffset)), s->path());
+			if(bytesread<=0)
+				return 0;
+			vecs.front().iov_len=(size_t) bytesread;
+			ssize_t byteswritten;
+			if(d->blocksize && !d->is_block_aligned(vecs, dstoffset))
+				byteswritten=do_unaligned_direct_io(d, vecs, dstoffset, true);
+			else
+				ERRHOSFN((int) (byteswritten=pwrite(d->fd, vecs.front().iov_base, vecs.front().iov_len, dstoffset)), d->path());
+			if(byteswritten!=bytesread)
+				throw std::runtime_error("Failed to write all buffers");
+			return (size_t) byteswritten;
+		}
+		// Called in unknown thread
+		completion_returntype doread(size_t id, std::shared_ptr<detail::async_io_handle> h, async_data_op_req<void> req)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			if(p->readahead && do_readahead_serve(h, req))
+				return std::make_pair(true, h);
+			ssize_t bytesread=0, bytestoread=0;
+			// Direct i/o may need to bounce the buffers, which wants them as a vector
+			iovec inlinevecs[inline_iovecs], *vecsp=inlinevecs;
+			std::vector<iovec> vecs;
+			const size_t novecs=req.buffers.size();
+			if(p->blocksize || novecs>inline_iovecs)
+			{
+				vecs.resize(novecs);
+				vecsp=vecs.data();
+			}
+			DEBUG_PRINT("R %u %p (%c) @ %u, b=%u\n", (unsigned) id, h.get(), p->path().native().back(), (unsigned) req.where, (unsigned) req.buffers.size());
+#ifdef DEBUG_PRINTING
+			for(auto &b : req.buffers)
+				DEBUG_PRINT("  R %u: %p %u\n", (unsigned) id, boost::asio::buffer_cast<const void *>(b), (unsigned) boost::asio::buffer_size(b));
+#endif
+			for(size_t n=0; n<novecs; n++)
+			{
+				vecsp[n].iov_base=boost::asio::buffer_cast<void *>(req.buffers[n]);
+				vecsp[n].iov_len=boost::asio::buffer_size(req.buffers[n]);
+				bytestoread+=vecsp[n].iov_len;
+			}
+			if(p->blocksize && !p->is_block_aligned(vecs, req.where))
+			{
+				bytesread=do_unaligned_direct_io(p, vecs, req.where, false);
+				p->bytesread+=bytesread;
+			}
+			else
+			{
+				for(size_t n=0; n<novecs; n+=IOV_MAX)
+				{
+					ssize_t _bytesread;
+					ERRHOSFN((int) (_bytesread=preadv(p->fd, vecsp+n, std::min((int) (novecs-n), IOV_MAX), req.where+bytesread)), p->path());
+					p->bytesread+=_bytesread;
+					bytesread+=_bytesread;
+				}
+			}
+			if(bytesread!=bytestoread)
+				throw std::runtime_error("Failed to read all buffers");
+			if(p->readahead)
+				do_readahead(h, req.where, bytestoread);
+			return std::make_pair(true, h);
+		}
+		// Called in unknown thread
+		completion_returntype dowrite(size_t id, std::shared_ptr<detail::async_io_handle> h, async_data_op_req<const void> req)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			// Anything read ahead may be stale however this exits
+			auto unreadahead=NiallsCPP11Utilities::Undoer([p](){ if(p->readahead) p->readahead->invalidate(); });
+			ssize_t byteswritten=0, bytestowrite=0;
+			// Direct i/o may need to bounce the buffers, which wants them as a vector
+			iovec inlinevecs[inline_iovecs], *vecsp=inlinevecs;
+			std::vector<iovec> vecs;
+			const size_t novecs=req.buffers.size();
+			if(p->blocksize || novecs>inline_iovecs)
+			{
+				vecs.resize(novecs);
+				vecsp=vecs.data();
+			}
+			DEBUG_PRINT("W %u %p (%c) @ %u, b=%u\n", (unsigned) id, h.get(), p->path().native().back(), (unsigned) req.where, (unsigned) req.buffers.size());
+#ifdef DEBUG_PRINTING
+			for(auto &b : req.buffers)
+				DEBUG_PRINT("  W %u: %p %u\n", (unsigned) id, boost::asio::buffer_cast<const void *>(b), (unsigned) boost::asio::buffer_size(b));
+#endif
+			for(size_t n=0; n<novecs; n++)
+			{
+				vecsp[n].iov_base=(void *) boost::asio::buffer_cast<const void *>(req.buffers[n]);
+				vecsp[n].iov_len=boost::asio::buffer_size(req.buffers[n]);
+				bytestowrite+=vecsp[n].iov_len;
+			}
+			if(p->blocksize && !p->is_block_aligned(vecs, req.where))
+			{
+				byteswritten=do_unaligned_direct_io(p, vecs, req.where, true);
+				p->byteswritten+=byteswritten;
+			}
+			else
+			{
+				for(size_t n=0; n<novecs; n+=IOV_MAX)
+				{
+					ssize_t _byteswritten;
+					ERRHOSFN((int) (_byteswritten=pwritev(p->fd, vecsp+n, std::min((int) (novecs-n), IOV_MAX), req.where+byteswritten)), p->path());
+					p->byteswritten+=_byteswritten;
+					byteswritten+=_byteswritten;
+				}
+			}
+			if(byteswritten!=bytestowrite)
+				throw std::runtime_error("Failed to write all buffers");
+			return std::make_pair(true, h);
+		}
+		// Called in unknown thread
+		completion_returntype dotruncate(size_t id, std::shared_ptr<detail::async_io_handle> h, off_t newsize)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
 			DEBUG_PRINT("T %u %p (%c)\n", (unsigned) id, h.get(), p->path().native().back());
-			// This is a bit tricky ... overlapped files ignore their file position except in this one
-			// case, but clearly here we have a race condition. No choice but to rinse and repeat I guess.
-			LARGE_INTEGER size={0}, newsize;
-			newsize.QuadPart=_newsize;
-			while(size.QuadPart!=newsize.QuadPart)
+			ERRHOSFN(posix_ftruncate(p->fd, newsize), p->path());
+			if(p->readahead)
+				p->readahead->invalidate();
+			return std::make_pair(true, h);
+		}
+		// Called in unknown thread. Stands in for fallocate() where the kernel or filing system can't do it.
+		void do_preallocate_emulated(async_io_handle_posix *p, const detail::preallocate_range &r)
+		{
+			struct stat s;
+			ERRHOSFN(fstat(p->fd, &s), p->path());
+			off_t end=r.offset+r.length;
+			if(!!(r.mode & preallocate_flags::KeepSize))
+				end=std::min(end, (off_t) s.st_size);
+			if(end<=r.offset)
+				return;
+			if(!!(r.mode & preallocate_flags::ZeroRange))
 			{
-				ERRHWINFN(SetFilePointerEx(p->h->native_handle(), newsize, NULL, FILE_BEGIN), p->path());
-				ERRHWINFN(SetEndOfFile(p->h->native_handle()), p->path());
-				ERRHWINFN(GetFileSizeEx(p->h->native_handle(), &size), p->path());
+				async_io_buffer zeros(allocate_buffer((size_t) std::min(end-r.offset, (off_t) COPY_BUFFER)));
+				memset(zeros.data(), 0, zeros.size());
+				for(off_t at=r.offset; at<end;)
+				{
+					std::vector<iovec> vecs(1);
+					vecs.front().iov_base=zeros.data();
+					vecs.front().iov_len=(size_t) std::min(end-at, (off_t) zeros.size());
+					ssize_t byteswritten;
+					if(p->blocksize && !p->is_block_aligned(vecs, at))
+						byteswritten=do_unaligned_direct_io(p, vecs, at, true);
+					else
+						ERRHOSFN((int) (byteswritten=pwrite(p->fd, vecs.front().iov_base, vecs.front().iov_len, at)), p->path());
+					p->byteswritten+=byteswritten;
+					at+=byteswritten;
+				}
+			}
+			else if(end>(off_t) s.st_size)
+			{
+#ifdef __APPLE__
+				ERRHOSFN(posix_ftruncate(p->fd, end), p->path());
+#else
+				int errcode=posix_fallocate(p->fd, r.offset, r.length);
+				if(errcode)
+					ERRGOSFN(errcode, p->path());
+#endif
+			}
+		}
+		// Called in unknown thread
+		completion_returntype dopreallocate(size_t id, std::shared_ptr<detail::async_io_handle> h, detail::preallocate_range r)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			DEBUG_PRINT("P %u %p (%c)\n", (unsigned) id, h.get(), p->path().native().back());
+			// Anything read ahead may be stale however this exits
+			auto unreadahead=NiallsCPP11Utilities::Undoer([p](){ if(p->readahead) p->readahead->invalidate(); });
+#ifdef __linux__
+			if(!fallocate(p->fd, fallocate_mode(r.mode), r.offset, r.length))
+			{
+				if(!!(r.mode & preallocate_flags::ZeroRange))
+					p->byteswritten+=r.length;
+				return std::make_pair(true, h);
+			}
+			if(EOPNOTSUPP!=errno && ENOSYS!=errno)
+				ERRHOSFN(-1, p->path());
+#endif
+			do_preallocate_emulated(p, r);
+			return std::make_pair(true, h);
+		}
+		// Called in unknown thread
+		completion_returntype dostat(size_t id, std::shared_ptr<detail::async_io_handle> h, detail::stat_req r)
+		{
+			try
+			{
+				stat_t ret;
+				async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+				// Only statx() knows when an item was created
+				if(r.byhandle() && p->fd>=0 && !!(r.wanted & metadata_flags::Birthtime))
+					detail::stat_at(ret, p->fd, "", AT_EMPTY_PATH, r.wanted, p->path());
+				else
+#endif
+				if(r.byhandle() && p->fd>=0)
+				{
+					// An open handle needs no lookup
+					struct stat s;
+					ERRHOSFN(fstat(p->fd, &s), p->path());
+					detail::fill_stat(ret, s);
+				}
+				else if(r.byhandle())
+				{
+					// Directories not opened for reading have no fd
+					detail::stat_at(ret, AT_FDCWD, p->path().c_str(), 0, r.wanted, p->path());
+				}
+				else
+				{
+					path_at at=resolve_path(h, r.req);
+					detail::stat_at(ret, at.dirfd, at.path.c_str(), 0, r.wanted, at.abspath);
+				}
+				r.result->set_value(std::move(ret));
+			}
+			catch(...)
+			{
+				r.result->set_exception(async_io::make_exception_ptr(current_exception()));
+				throw;
 			}
 			return std::make_pair(true, h);
 		}
+#ifdef __linux__
+		static int fallocate_mode(preallocate_flags mode)
+		{
+			int ret=0;
+			if(!!(mode & preallocate_flags::KeepSize)) ret|=FALLOC_FL_KEEP_SIZE;
+			if(!!(mode & preallocate_flags::ZeroRange)) ret|=FALLOC_FL_ZERO_RANGE;
+			return ret;
+		}
+#endif
+
 
 	public:
-		async_file_io_dispatcher_windows(thread_pool &threadpool, file_flags flagsforce, file_flags flagsmask) : async_file_io_dispatcher_base(threadpool, flagsforce, flagsmask)
+		async_file_io_dispatcher_compat(thread_pool &threadpool, file_flags flagsforce, file_flags flagsmask) : async_file_io_dispatcher_base(threadpool, flagsforce, flagsmask)
+		{
+		}
+
+
+		virtual void set_file_handle_cache(size_t idle)
 		{
+			filecache.set_limit(idle);
 		}
 
+		virtual async_op_flags bind_batch_op(detail::batch_op_function &boundf, const async_batch_op_req &req)
+		{
+			switch(req.kind)
+			{
+			case async_batch_op_req::op_kind::dir:
+				bind_plan_op(boundf, &async_file_io_dispatcher_compat::dodir);
+				return async_op_flags::DetachedFuture;
+			case async_batch_op_req::op_kind::rmdir:
+				bind_plan_op(boundf, &async_file_io_dispatcher_compat::dormdir);
+				break;
+			case async_batch_op_req::op_kind::file:
+				bind_plan_op(boundf, &async_file_io_dispatcher_compat::dofile);
+				return async_op_flags::DetachedFuture;
+			case async_batch_op_req::op_kind::rmfile:
+				bind_plan_op(boundf, &async_file_io_dispatcher_compat::dormfile);
+				break;
+			case async_batch_op_req::op_kind::sync:
+				bind_plan_op(boundf, &async_file_io_dispatcher_compat::dosync);
+				return async_op_flags::DetachedFuture;
+			case async_batch_op_req::op_kind::close:
+				bind_plan_op(boundf, &async_file_io_dispatcher_compat::doclose);
+				break;
+			case async_batch_op_req::op_kind::read:
+				bind_plan_op(boundf, &async_file_io_dispatcher_compat::doread);
+				break;
+			case async_batch_op_req::op_kind::write:
+				bind_plan_op(boundf, &async_file_io_dispatcher_compat::dowrite);
+				break;
+			case async_batch_op_req::op_kind::truncate:
+				bind_plan_op(boundf, &async_file_io_dispatcher_compat::dotruncate);
+				break;
+			}
+			return async_op_flags::None;
+		}
 		virtual std::vector<async_io_op> dir(const std::vector<async_path_op_req> &reqs)
 		{
 #if TRIPLEGIT_VALIDATE_INPUTS
@@ -917,7 +4782,7 @@ namespace detail {
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::dir, reqs, async_op_flags::None, &async_file_io_dispatcher_windows::dodir);
+			return chain_async_ops((int) detail::OpType::dir, reqs, async_op_flags::DetachedFuture, &async_file_io_dispatcher_compat::dodir);
 		}
 		virtual std::vector<async_io_op> rmdir(const std::vector<async_path_op_req> &reqs)
 		{
@@ -926,7 +4791,7 @@ namespace detail {
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::rmdir, reqs, async_op_flags::None, &async_file_io_dispatcher_windows::dormdir);
+			return chain_async_ops((int) detail::OpType::rmdir, reqs, async_op_flags::None, &async_file_io_dispatcher_compat::dormdir);
 		}
 		virtual std::vector<async_io_op> file(const std::vector<async_path_op_req> &reqs)
 		{
@@ -935,7 +4800,7 @@ namespace detail {
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::file, reqs, async_op_flags::None, &async_file_io_dispatcher_windows::dofile);
+			return chain_async_ops((int) detail::OpType::file, reqs, async_op_flags::DetachedFuture, &async_file_io_dispatcher_compat::dofile);
 		}
 		virtual std::vector<async_io_op> rmfile(const std::vector<async_path_op_req> &reqs)
 		{
@@ -944,312 +4809,980 @@ namespace detail {
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::rmfile, reqs, async_op_flags::None, &async_file_io_dispatcher_windows::dormfile);
+			return chain_async_ops((int) detail::OpType::rmfile, reqs, async_op_flags::None, &async_file_io_dispatcher_compat::dormfile);
+		}
+		virtual std::vector<async_io_op> sync(const std::vector<async_io_op> &ops)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : ops)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::sync, ops, async_op_flags::DetachedFuture, &async_file_io_dispatcher_compat::dosync);
+		}
+		virtual std::vector<async_io_op> sync(const std::vector<async_sync_op_req> &reqs)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::sync, detail::sync_preconditions(reqs), reqs, async_op_flags::DetachedFuture, &async_file_io_dispatcher_compat::dosyncrange);
+		}
+		virtual std::vector<async_io_op> close(const std::vector<async_io_op> &ops)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : ops)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::close, ops, async_op_flags::None, &async_file_io_dispatcher_compat::doclose);
+		}
+		virtual std::vector<async_io_op> read(const std::vector<async_data_op_req<void>> &reqs)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::read, reqs, async_op_flags::None, &async_file_io_dispatcher_compat::doread);
+		}
+		virtual std::vector<async_io_op> write(const std::vector<async_data_op_req<const void>> &reqs)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_coalesced_writes(reqs, async_op_flags::None, &async_file_io_dispatcher_compat::dowrite);
+		}
+		virtual std::vector<async_io_op> truncate(const std::vector<async_io_op> &ops, const std::vector<off_t> &sizes)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : ops)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::truncate, ops, sizes, async_op_flags::None, &async_file_io_dispatcher_compat::dotruncate);
+		}
+		virtual std::vector<async_io_op> preallocate(const std::vector<async_io_op> &ops, const std::vector<off_t> &offsets, const std::vector<off_t> &lengths, preallocate_flags mode)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : ops)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+			for(auto &i : lengths)
+				if(!i)
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::preallocate, ops, detail::make_preallocate_ranges(ops, offsets, lengths, mode), async_op_flags::None, &async_file_io_dispatcher_compat::dopreallocate);
+		}
+		virtual std::pair<std::vector<future<stat_t>>, std::vector<async_io_op>> stat(const std::vector<async_io_op> &ops, metadata_flags wanted)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : ops)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			std::vector<detail::stat_req> reqs;
+			auto ret(detail::make_stat_reqs(reqs, ops, wanted));
+			return std::make_pair(std::move(ret), chain_async_ops((int) detail::OpType::stat, ops, reqs, async_op_flags::None, &async_file_io_dispatcher_compat::dostat));
+		}
+		virtual std::pair<std::vector<future<stat_t>>, std::vector<async_io_op>> stat(const std::vector<async_path_op_req> &reqs, metadata_flags wanted)
+		{
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			std::vector<detail::stat_req> statreqs;
+			std::vector<async_io_op> preconditions;
+			auto ret(detail::make_stat_reqs(statreqs, preconditions, reqs, wanted));
+			return std::make_pair(std::move(ret), chain_async_ops((int) detail::OpType::stat, preconditions, statreqs, async_op_flags::None, &async_file_io_dispatcher_compat::dostat));
+		}
+	};
+
+#if defined(__linux__) && !defined(USE_POSIX_ON_LINUX)
+	/* A minimal io_uring submission and completion queue pair driven directly by syscalls so
+	we don't need liburing. The kernel signals completions through an eventfd which is watched
+	by the thread pool's io_service, so reaping completions needs no extra threads.
+	*/
+	class io_uring_ring : public std::enable_shared_from_this<io_uring_ring>
+	{
+	public:
+		// Each SQE submitted carries one of these as its user_data. It keeps alive anything
+		// the kernel reads from until the CQE arrives, after which it goes back to its ring for reuse.
+		struct op
+		{
+			typedef inline_function<void(int), 128> done_t;
+			done_t done;
+			std::vector<iovec> vecs;
+			std::filesystem::path path;
+			io_uring_ring *ring;
+			op *next; // In my ring's free list
+			struct recycle { void operator()(op *o) const { o->ring->recycle(o); } };
+		};
+		typedef std::unique_ptr<op, op::recycle> op_ptr;
+	private:
+		int fd;
+		io_uring_params params;
+		void *sqring, *cqring;
+		size_t sqringsize, cqringsize;
+		io_uring_sqe *sqes;
+		unsigned *sqhead, *sqtail, *sqmask, *sqentries, *sqflags, *sqarray;
+		unsigned *cqhead, *cqtail, *cqmask;
+		io_uring_cqe *cqes;
+		unsigned char supported[256];
+
+		typedef boost::detail::spinlock sqlock_t, cqlock_t, oplock_t;
+		sqlock_t sqlock;
+		cqlock_t cqlock;
+		std::vector<std::vector<std::pair<op *, int>>> sparecompletions; // Emptied by reap() and kept for the next, under cqlock
+		oplock_t oplock;
+		op *freeops;
+		std::mutex reaplock; bool stopped;
+		boost::asio::io_service &service;
+		boost::asio::posix::stream_descriptor evdesc;
+		unsigned long long evbuffer;
+
+		static int int_checkfd(int fd)
+		{
+			ERRHOS(fd);
+			return fd;
+		}
+		typedef std::vector<std::pair<op *, int>> completions_t;
+		// Takes everything off the completion queue. Called in unknown thread.
+		void drain(completions_t &done)
+		{
+			for(;;)
+			{
+				{
+					lock_guard<cqlock_t> cqlockh(cqlock);
+					unsigned head=*cqhead, tail=__atomic_load_n(cqtail, __ATOMIC_ACQUIRE);
+					done.reserve(done.size()+(tail-head));
+					for(; head!=tail; head++)
+					{
+						io_uring_cqe &cqe=cqes[head & *cqmask];
+						done.push_back(std::make_pair((op *)(size_t) cqe.user_data, cqe.res));
+					}
+					__atomic_store_n(cqhead, head, __ATOMIC_RELEASE);
+				}
+				// Completions which didn't fit wait in the kernel until asked for, and nothing else may ask
+				if(!(__atomic_load_n(sqflags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+					return;
+				syscall(__NR_io_uring_enter, fd, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+			}
+		}
+		static void complete(const completions_t &done)
+		{
+			for(auto &i : done)
+			{
+				op_ptr o(i.first);
+				if(o->done)
+					o->done(i.second);
+			}
+		}
+		// Called in unknown thread
+		void reap(const boost::system::error_code &ec)
+		{
+			if(ec) return;
+			completions_t done;
+			{
+				lock_guard<cqlock_t> cqlockh(cqlock);
+				if(!sparecompletions.empty())
+				{
+					done.swap(sparecompletions.back());
+					sparecompletions.pop_back();
+				}
+			}
+			drain(done);
+			// Rearm before running the completions so another worker can reap in parallel
+			arm();
+			complete(done);
+			done.clear();
+			lock_guard<cqlock_t> cqlockh(cqlock);
+			sparecompletions.push_back(std::move(done));
+		}
+	public:
+		io_uring_ring(boost::asio::io_service &_service, unsigned entries) : fd(-1), sqring(MAP_FAILED), cqring(MAP_FAILED), sqes((io_uring_sqe *) MAP_FAILED), freeops(nullptr), stopped(false), service(_service), evdesc(_service)
+		{
+			memset(&params, 0, sizeof(params));
+			memset(supported, 0, sizeof(supported));
+			params.flags=IORING_SETUP_CLAMP|IORING_SETUP_CQSIZE;
+			params.cq_entries=entries*4;
+			ERRHOS(fd=(int) syscall(__NR_io_uring_setup, entries, &params));
+			sqringsize=params.sq_off.array+params.sq_entries*sizeof(unsigned);
+			cqringsize=params.cq_off.cqes+params.cq_entries*sizeof(io_uring_cqe);
+			if(params.features & IORING_FEAT_SINGLE_MMAP)
+				sqringsize=cqringsize=std::max(sqringsize, cqringsize);
+			sqring=mmap(nullptr, sqringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+			if(MAP_FAILED==sqring) ERRHOS(-1);
+			if(params.features & IORING_FEAT_SINGLE_MMAP)
+				cqring=sqring;
+			else
+			{
+				cqring=mmap(nullptr, cqringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+				if(MAP_FAILED==cqring) ERRHOS(-1);
+			}
+			sqes=(io_uring_sqe *) mmap(nullptr, params.sq_entries*sizeof(io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+			if(MAP_FAILED==(void *) sqes) ERRHOS(-1);
+			sqhead=(unsigned *)((char *) sqring+params.sq_off.head);
+			sqtail=(unsigned *)((char *) sqring+params.sq_off.tail);
+			sqmask=(unsigned *)((char *) sqring+params.sq_off.ring_mask);
+			sqentries=(unsigned *)((char *) sqring+params.sq_off.ring_entries);
+			sqflags=(unsigned *)((char *) sqring+params.sq_off.flags);
+			sqarray=(unsigned *)((char *) sqring+params.sq_off.array);
+			cqhead=(unsigned *)((char *) cqring+params.cq_off.head);
+			cqtail=(unsigned *)((char *) cqring+params.cq_off.tail);
+			cqmask=(unsigned *)((char *) cqring+params.cq_off.ring_mask);
+			cqes=(io_uring_cqe *)((char *) cqring+params.cq_off.cqes);
+			// Find out which ops this kernel can do
+			std::vector<char> probebuffer(sizeof(io_uring_probe)+256*sizeof(io_uring_probe_op));
+			io_uring_probe *probe=(io_uring_probe *) &probebuffer.front();
+			if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256)>=0)
+				for(unsigned n=0; n<probe->ops_len && n<256; n++)
+					supported[n]=!!(probe->ops[n].flags & IO_URING_OP_SUPPORTED);
+			int evfd=int_checkfd(eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK));
+			evdesc.assign(evfd);
+			ERRHOS(syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &evfd, 1));
+			// Boost's spinlock is so lightweight it has no constructor ...
+			sqlock.unlock();
+			cqlock.unlock();
+			oplock.unlock();
+		}
+		~io_uring_ring()
+		{
+			while(freeops)
+			{
+				op *o=freeops;
+				freeops=o->next;
+				delete o;
+			}
+			if(MAP_FAILED!=(void *) sqes) munmap(sqes, params.sq_entries*sizeof(io_uring_sqe));
+			if(MAP_FAILED!=cqring && cqring!=sqring) munmap(cqring, cqringsize);
+			if(MAP_FAILED!=sqring) munmap(sqring, sqringsize);
+			if(fd>=0) posix_close(fd);
+		}
+		//! Returns true if this kernel supports the IORING_OP_* opcode
+		bool supports(int opcode) const { return opcode>=0 && opcode<256 && supported[opcode]; }
+		//! Registers an empty table of \em no fixed buffers, returning false if this kernel can't
+		bool register_buffer_table(unsigned no)
+		{
+			io_uring_rsrc_register r;
+			memset(&r, 0, sizeof(r));
+			r.nr=no;
+			r.flags=IORING_RSRC_REGISTER_SPARSE;
+			return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS2, &r, sizeof(r))>=0;
+		}
+		//! Registers a fixed buffer at \em idx in the table, returning false if the kernel refused, usually for want of lockable memory
+		bool register_buffer(unsigned idx, void *addr, size_t length)
+		{
+			iovec v;
+			v.iov_base=addr;
+			v.iov_len=length;
+			io_uring_rsrc_update2 u;
+			memset(&u, 0, sizeof(u));
+			u.offset=idx;
+			u.data=(__u64)(size_t) &v;
+			u.nr=1;
+			return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS_UPDATE, &u, sizeof(u))>=0;
 		}
-		virtual std::vector<async_io_op> sync(const std::vector<async_io_op> &ops)
+		//! Returns an empty op to submit, reusing one whose CQE has arrived if possible. Called in unknown thread.
+		op_ptr allocate()
 		{
-#if TRIPLEGIT_VALIDATE_INPUTS
-			for(auto &i : ops)
-				if(!i.validate())
-					throw std::runtime_error("Inputs are invalid.");
-#endif
-			return chain_async_ops((int) detail::OpType::sync, ops, async_op_flags::None, &async_file_io_dispatcher_windows::dosync);
+			op *o;
+			{
+				lock_guard<oplock_t> oplockh(oplock);
+				if((o=freeops))
+					freeops=o->next;
+			}
+			if(!o)
+			{
+				o=new op;
+				o->ring=this;
+			}
+			o->next=nullptr;
+			return op_ptr(o);
 		}
-		virtual std::vector<async_io_op> close(const std::vector<async_io_op> &ops)
+		//! Empties an op and keeps it for reuse. Called in unknown thread.
+		void recycle(op *o)
 		{
-#if TRIPLEGIT_VALIDATE_INPUTS
-			for(auto &i : ops)
-				if(!i.validate())
-					throw std::runtime_error("Inputs are invalid.");
-#endif
-			return chain_async_ops((int) detail::OpType::close, ops, async_op_flags::None, &async_file_io_dispatcher_windows::doclose);
+			o->done.reset();
+			o->vecs.clear();
+			o->path.clear();
+			lock_guard<oplock_t> oplockh(oplock);
+			o->next=freeops;
+			freeops=o;
 		}
-		virtual std::vector<async_io_op> read(const std::vector<async_data_op_req<void>> &reqs)
+		//! Returns a zeroed SQE
+		static io_uring_sqe prep(int opcode, int fd, const void *addr, unsigned len, unsigned long long off)
 		{
-#if TRIPLEGIT_VALIDATE_INPUTS
-			for(auto &i : reqs)
-				if(!i.validate())
-					throw std::runtime_error("Inputs are invalid.");
-#endif
-			return chain_async_ops((int) detail::OpType::read, reqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_windows::doread);
+			io_uring_sqe sqe;
+			memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode=(__u8) opcode;
+			sqe.fd=fd;
+			sqe.addr=(__u64)(size_t) addr;
+			sqe.len=len;
+			sqe.off=off;
+			return sqe;
 		}
-		virtual std::vector<async_io_op> write(const std::vector<async_data_op_req<const void>> &reqs)
+		//! Starts watching for completions. Called in unknown thread.
+		void arm()
 		{
-#if TRIPLEGIT_VALIDATE_INPUTS
-			for(auto &i : reqs)
-				if(!i.validate())
-					throw std::runtime_error("Inputs are invalid.");
-#endif
-			return chain_async_ops((int) detail::OpType::write, reqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_windows::dowrite);
+			lock_guard<std::mutex> reaplockh(reaplock);
+			if(stopped) return;
+			auto self(shared_from_this());
+			evdesc.async_read_some(boost::asio::buffer(&evbuffer, sizeof(evbuffer)), [self](const boost::system::error_code &ec, size_t) { self->reap(ec); });
 		}
-		virtual std::vector<async_io_op> truncate(const std::vector<async_io_op> &ops, const std::vector<off_t> &sizes)
+		//! Stops watching for completions. Any ops still in flight will never complete.
+		void stop()
 		{
-#if TRIPLEGIT_VALIDATE_INPUTS
-			for(auto &i : ops)
-				if(!i.validate())
-					throw std::runtime_error("Inputs are invalid.");
-#endif
-			return chain_async_ops((int) detail::OpType::truncate, ops, sizes, async_op_flags::None, &async_file_io_dispatcher_windows::dotruncate);
+			lock_guard<std::mutex> reaplockh(reaplock);
+			stopped=true;
+			boost::system::error_code ec;
+			evdesc.cancel(ec);
 		}
-	};
-#endif
-	class async_file_io_dispatcher_compat : public async_file_io_dispatcher_base
-	{
-		// Keep an optional weak reference counted index of containing directories on POSIX
-		typedef boost::detail::spinlock dircachelock_t;
-		dircachelock_t dircachelock; std::unordered_map<std::filesystem::path, std::weak_ptr<async_io_handle>> dircache;
-		std::shared_ptr<detail::async_io_handle> get_handle_to_containing_dir(const std::filesystem::path &path)
+		/*! Submits \em no SQEs, taking ownership of their ops. SQEs with IOSQE_IO_LINK set are linked to the next.
+		Called in unknown thread.
+		*/
+		void submit(io_uring_sqe *tosubmit, op_ptr *ops, unsigned no)
 		{
-			std::filesystem::path containingdir(path.parent_path());
-			std::shared_ptr<detail::async_io_handle> dirh;
-			lock_guard<dircachelock_t> dircachelockh(dircachelock);
-			do
+			assert(no<=*sqentries);
+			// Publish the SQEs under the lock, so linked ones stay contiguous
+			for(;;)
 			{
-				std::unordered_map<std::filesystem::path, std::weak_ptr<async_io_handle>>::iterator it=dircache.find(containingdir);
-				if(dircache.end()==it || it->second.expired())
 				{
-					if(dircache.end()!=it) dircache.erase(it);
-					dirh=std::make_shared<async_io_handle_posix>(std::shared_ptr<async_file_io_dispatcher_base>(), std::shared_ptr<detail::async_io_handle>(),
-						containingdir, false, posix_open(containingdir.c_str(), O_RDONLY, 0x1b0/*660*/));
-					auto _it=dircache.insert(std::make_pair(containingdir, std::weak_ptr<async_io_handle>(dirh)));
-					return dirh;
+					lock_guard<sqlock_t> sqlockh(sqlock);
+					unsigned tail=*sqtail;
+					// Others may have published SQEs they haven't yet entered the kernel with
+					if(*sqentries-(tail-__atomic_load_n(sqhead, __ATOMIC_ACQUIRE))>=no)
+					{
+						for(unsigned n=0; n<no; n++, tail++)
+						{
+							unsigned idx=tail & *sqmask;
+							sqes[idx]=tosubmit[n];
+							sqes[idx].user_data=(__u64)(size_t) ops[n].get();
+							sqarray[idx]=idx;
+						}
+						__atomic_store_n(sqtail, tail, __ATOMIC_RELEASE);
+						break;
+					}
 				}
-				else
-					dirh=std::shared_ptr<async_io_handle>(it->second);
-			} while(!dirh);
-			return dirh;
-		}
-
-		// Called in unknown thread
-		completion_returntype dodir(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
-		{
-			int ret=0;
-			req.flags=fileflags(req.flags);
-			if(!!(req.flags & (file_flags::Create|file_flags::CreateOnlyIfNotExist)))
+				std::this_thread::yield();
+			}
+			for(unsigned n=0; n<no; n++)
+				ops[n].release();
+			// Then enter the kernel outside it. The kernel consumes SQEs in order whoever enters, so as everyone
+			// only asks for as many as they published, between them they always submit all of them.
+			unsigned flags=0;
+			for(unsigned submitted=0; submitted<no;)
 			{
-				ret=posix_mkdir(req.path.c_str(), 0x1f8/*770*/);
-				if(-1==ret && EEXIST==errno)
+				int ret=(int) syscall(__NR_io_uring_enter, fd, no-submitted, 0, flags, nullptr, 0);
+				flags=0;
+				if(ret<0)
 				{
-					// Ignore already exists unless we were asked otherwise
-					if(!(req.flags & file_flags::CreateOnlyIfNotExist))
-						ret=0;
+					if(EBUSY==errno)
+					{
+						// The completion queue is full. The workers which would reap it may all be in here too, so
+						// reap it now and have the kernel move any completions it couldn't post into the space made.
+						completions_t done;
+						drain(done);
+						// The ops go back to me once complete, so keep me alive until they have
+						if(!done.empty())
+							service.post(std::bind([](const std::shared_ptr<io_uring_ring> &, const completions_t &done) { complete(done); }, shared_from_this(), std::move(done)));
+						flags=IORING_ENTER_GETEVENTS;
+						continue;
+					}
+					// Out of memory for a moment, or we were interrupted
+					if(EAGAIN==errno || EINTR==errno)
+					{
+						std::this_thread::yield();
+						continue;
+					}
+					ERRHOS(ret);
 				}
-				req.flags=req.flags&~(file_flags::Create|file_flags::CreateOnlyIfNotExist);
+				submitted+=ret;
 			}
+		}
+		//! Submits a single SQE. Called in unknown thread.
+		void submit(io_uring_sqe sqe, op_ptr o)
+		{
+			submit(&sqe, &o, 1);
+		}
+	};
 
-			struct stat s={0};
-			ret=posix_stat(req.path.c_str(), &s);
-			if(0==ret && !S_ISDIR(s.st_mode))
-				throw std::runtime_error("Not a directory");
-			if(file_flags::Read==(req.flags & file_flags::Read))
+	class async_file_io_dispatcher_linux : public async_file_io_dispatcher_compat
+	{
+		// Not in all kernel headers yet
+		static const int io_uring_op_ftruncate=55;
+		std::shared_ptr<io_uring_ring> ring;
+		bool fixedbuffers;
+
+		// Called in unknown thread
+		template<class F> void io_uring_completion_handler(size_t id, std::shared_ptr<detail::async_io_handle> h, F &&f, int res)
+		{
+			exception_ptr e;
+			completion_returntype ret(true, h);
+			try
 			{
-				return dofile(id, _, req);
+				ret=f(res);
 			}
-			else
+			catch(...)
 			{
-				// Create dummy handle so
-				std::shared_ptr<detail::async_io_handle> dirh;
-#ifdef __linux__
-				// Need to fsync the containing directory, otherwise the file isn't guaranteed to appear where we just created it
-				if(!!(req.flags & (file_flags::Create|file_flags::CreateOnlyIfNotExist)) && !!(req.flags & (file_flags::AutoFlush|file_flags::OSSync)))
-					req.flags=req.flags|file_flags::FastDirectoryEnumeration;
-#endif
-				if(!!(req.flags & file_flags::FastDirectoryEnumeration))
-					dirh=get_handle_to_containing_dir(req.path);
-				auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), dirh, req.path, false, -999);
-#ifdef __linux__
-				if(!!(req.flags & (file_flags::Create|file_flags::CreateOnlyIfNotExist)) && !!(req.flags & (file_flags::AutoFlush|file_flags::OSSync)))
-					posix_fsync(static_cast<async_io_handle_posix *>(dirh.get())->fd);
-#endif
-				return std::make_pair(true, ret);
+				e=async_io::make_exception_ptr(current_exception());
 			}
+			DEBUG_PRINT("H %u e=%d\n", (unsigned) id, res);
+			// If f chose to issue a follow on SQE, that will complete us instead
+			if(ret.first || e)
+				complete_async_op(id, ret.second, e);
+		}
+		// Called in unknown thread. Usually small enough to be kept inside the op rather than on the heap.
+		template<class F> io_uring_ring::op::done_t make_completion(size_t id, std::shared_ptr<detail::async_io_handle> h, F f)
+		{
+			return [this, id, h, f](int res) { io_uring_completion_handler(id, h, f, res); };
+		}
+		// Called in unknown thread
+		template<class F> io_uring_ring::op_ptr make_op(size_t id, std::shared_ptr<detail::async_io_handle> h, F f)
+		{
+			io_uring_ring::op_ptr o(ring->allocate());
+			o->done=make_completion(id, std::move(h), std::move(f));
+			return o;
+		}
+		/* Called in unknown thread. Runs f on the thread pool, completing op id with what it returns as if it were
+		an SQE's completion. Ops here complete immediately, so anything which may block must go this way instead
+		of running inline on whichever thread submitted or reaped them.
+		*/
+		completion_returntype post_blocking(size_t id, std::shared_ptr<detail::async_io_handle> h, std::function<completion_returntype()> f)
+		{
+			threadpool().post([this, id, h, f] { io_uring_completion_handler(id, h, [&f](int) { return f(); }, 0); });
+			return std::make_pair(false, h);
+		}
+
+		// Called in unknown thread
+		completion_returntype dodir(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
+		{
+			req.flags=fileflags(req.flags);
+			if(!(req.flags & (file_flags::Create|file_flags::CreateOnlyIfNotExist)))
+				return post_blocking(id, _, [this, id, _, req] { return async_file_io_dispatcher_compat::dodir(id, _, req); });
+			// Like the compat backend, only the stat afterwards decides success
+			path_at at=resolve_path(_, req);
+			async_path_op_req rest(req);
+			rest.flags=rest.flags&~(file_flags::Create|file_flags::CreateOnlyIfNotExist);
+			// Need to fsync the containing directory, otherwise the directory isn't guaranteed to appear where we just created it
+			bool syncdir=!!(req.flags & (file_flags::AutoFlush|file_flags::OSSync));
+			std::filesystem::path abspath(at.abspath);
+			auto o=make_op(id, _, [this, id, _, rest, syncdir, abspath](int) -> completion_returntype {
+				return post_blocking(id, _, [this, id, _, rest, syncdir, abspath]() -> completion_returntype {
+					completion_returntype ret=async_file_io_dispatcher_compat::dodir(id, _, rest);
+					if(!syncdir)
+						return ret;
+					// Complete only once the containing directory has been flushed, sharing that with other creations in it
+					submit_group_sync(id, get_handle_to_containing_dir(abspath), ret.second);
+					return std::make_pair(false, ret.second);
+				});
+			});
+			o->path=at.path;
+			io_uring_sqe sqe=io_uring_ring::prep(IORING_OP_MKDIRAT, at.dirfd, o->path.c_str(), 0x1f8/*770*/, 0);
+			ring->submit(sqe, std::move(o));
+			return std::make_pair(false, _);
 		}
 		// Called in unknown thread
 		completion_returntype dormdir(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
 		{
+			path_at at=resolve_path(_, req);
 			req.flags=fileflags(req.flags);
-			ERRHOSFN(posix_rmdir(req.path.c_str()), req.path);
-			auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), std::shared_ptr<detail::async_io_handle>(), req.path, false, -999);
-			return std::make_pair(true, ret);
+			auto o=make_op(id, _, [this, at](int res) -> completion_returntype {
+				if(res<0) ERRGOSFN(-res, at.abspath);
+				dircache.erase(at.abspath);
+				filecache.erase(at.abspath, true);
+				auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), std::shared_ptr<detail::async_io_handle>(), at.abspath, false, -999);
+				return std::make_pair(true, ret);
+			});
+			o->path=at.path;
+			io_uring_sqe sqe=io_uring_ring::prep(IORING_OP_UNLINKAT, at.dirfd, o->path.c_str(), 0, 0);
+			sqe.unlink_flags=AT_REMOVEDIR;
+			ring->submit(sqe, std::move(o));
+			return std::make_pair(false, _);
 		}
 		// Called in unknown thread
-		completion_returntype dofile(size_t id, std::shared_ptr<detail::async_io_handle>, async_path_op_req req)
+		completion_returntype dofile(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
 		{
-			int flags=0;
-			std::shared_ptr<detail::async_io_handle> dirh;
+			path_at at=resolve_path(_, req);
+			async_path_op_req origreq(req);
 			req.flags=fileflags(req.flags);
-			if(!!(req.flags & file_flags::Read) && !!(req.flags & file_flags::Write)) flags|=O_RDWR;
-			else if(!!(req.flags & file_flags::Read)) flags|=O_RDONLY;
-			else if(!!(req.flags & file_flags::Write)) flags|=O_WRONLY;
-			if(!!(req.flags & file_flags::Append)) flags|=O_APPEND;
-			if(!!(req.flags & file_flags::Truncate)) flags|=O_TRUNC;
-			if(!!(req.flags & file_flags::CreateOnlyIfNotExist)) flags|=O_EXCL|O_CREAT;
-			else if(!!(req.flags & file_flags::Create)) flags|=O_CREAT;
-#ifdef O_DIRECT
-			if(!!(req.flags & file_flags::OSDirect)) flags|=O_DIRECT;
-#endif
-#ifdef O_SYNC
-			if(!!(req.flags & file_flags::OSSync)) flags|=O_SYNC;
-#endif
-#ifdef __linux__
+			int flags=posix_open_flags(req.flags);
 			// Need to fsync the containing directory, otherwise the file isn't guaranteed to appear where we just created it
-			if((flags & O_CREAT) && !!(req.flags & (file_flags::AutoFlush|file_flags::OSSync)))
+			bool syncdir=(flags & O_CREAT) && !!(req.flags & (file_flags::AutoFlush|file_flags::OSSync));
+			if(syncdir)
 				req.flags=req.flags|file_flags::FastDirectoryEnumeration;
-#endif
+			// Opening the containing directory may block, so is done from the thread pool
 			if(!!(req.flags & file_flags::FastDirectoryEnumeration))
-				dirh=get_handle_to_containing_dir(req.path);
+			{
+				return post_blocking(id, _, [this, id, _, at, origreq, req, flags, syncdir]() -> completion_returntype {
+					return doopen(id, _, at, origreq, req, flags, syncdir, get_handle_to_containing_dir(at.abspath));
+				});
+			}
+			return doopen(id, _, at, origreq, req, flags, syncdir, std::shared_ptr<detail::async_io_handle>());
+		}
+		// Called in unknown thread
+		completion_returntype doopen(size_t id, std::shared_ptr<detail::async_io_handle> _, const path_at &at, const async_path_op_req &origreq, const async_path_op_req &req, int flags, bool syncdir, std::shared_ptr<detail::async_io_handle> dirh)
+		{
+			if(auto cached=get_cached_file_handle(at.abspath, dirh, req.flags))
+				return std::make_pair(true, cached);
 			// If writing and autoflush and NOT synchronous, turn on autoflush
-			auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), dirh, req.path, (file_flags::AutoFlush|file_flags::Write)==(req.flags & (file_flags::AutoFlush|file_flags::Write|file_flags::OSSync)),
-				posix_open(req.path.c_str(), flags, 0x1b0/*660*/));
-#ifdef __linux__
-			if(!!(req.flags & (file_flags::Create|file_flags::CreateOnlyIfNotExist)) && !!(req.flags & (file_flags::AutoFlush|file_flags::OSSync)))
-				posix_fsync(static_cast<async_io_handle_posix *>(dirh.get())->fd);
-#endif
-			static_cast<async_io_handle_posix *>(ret.get())->do_add_io_handle_to_parent();
-			return std::make_pair(true, ret);
+			bool autoflush=(file_flags::AutoFlush|file_flags::Write)==(req.flags & (file_flags::AutoFlush|file_flags::Write|file_flags::OSSync));
+			std::filesystem::path abspath(at.abspath);
+			auto o=make_op(id, _, [this, id, _, dirh, req, origreq, abspath, autoflush, syncdir](int res) -> completion_returntype {
+				// Out of fds? Let go of idle cached handles and try again.
+				if(-EMFILE==res && filecache.evict_idle())
+					return post_blocking(id, _, [this, id, _, origreq] { return async_file_io_dispatcher_compat::dofile(id, _, origreq); });
+				if(res<0) ERRGOSFN(-res, abspath);
+				auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), dirh, abspath, autoflush, res);
+				static_cast<async_io_handle_posix *>(ret.get())->do_add_io_handle_to_parent();
+				static_cast<async_io_handle_posix *>(ret.get())->do_discover_block_size(req.flags);
+				static_cast<async_io_handle_posix *>(ret.get())->do_enable_readahead(req.flags);
+				cache_file_handle(ret, req.flags);
+				if(!syncdir)
+					return std::make_pair(true, ret);
+				// Complete only once the containing directory has been flushed, sharing that with other creations in it
+				submit_group_sync(id, dirh, ret);
+				return std::make_pair(false, ret);
+			});
+			o->path=at.path;
+			io_uring_sqe sqe=io_uring_ring::prep(IORING_OP_OPENAT, at.dirfd, o->path.c_str(), 0x1b0/*660*/, 0);
+			sqe.open_flags=flags;
+			ring->submit(sqe, std::move(o));
+			return std::make_pair(false, _);
 		}
 		// Called in unknown thread
 		completion_returntype dormfile(size_t id, std::shared_ptr<detail::async_io_handle> _, async_path_op_req req)
 		{
+			path_at at=resolve_path(_, req);
 			req.flags=fileflags(req.flags);
-			ERRHOSFN(posix_unlink(req.path.c_str()), req.path);
-			auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), std::shared_ptr<detail::async_io_handle>(), req.path, false, -999);
-			return std::make_pair(true, ret);
+			auto o=make_op(id, _, [this, at](int res) -> completion_returntype {
+				if(res<0) ERRGOSFN(-res, at.abspath);
+				filecache.erase(at.abspath, false);
+				auto ret=std::make_shared<async_io_handle_posix>(shared_from_this(), std::shared_ptr<detail::async_io_handle>(), at.abspath, false, -999);
+				return std::make_pair(true, ret);
+			});
+			o->path=at.path;
+			io_uring_sqe sqe=io_uring_ring::prep(IORING_OP_UNLINKAT, at.dirfd, o->path.c_str(), 0, 0);
+			ring->submit(sqe, std::move(o));
+			return std::make_pair(false, _);
 		}
 		// Called in unknown thread
 		completion_returntype dosync(size_t id, std::shared_ptr<detail::async_io_handle> h, async_io_op)
 		{
 			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
-			size_t bytestobesynced=p->write_count_since_fsync();
-			if(bytestobesynced)
-				ERRHOSFN(posix_fsync(p->fd), p->path());
-			p->has_ever_been_fsynced=true;
-			p->byteswrittenatlastfsync+=(long) bytestobesynced;
-			return std::make_pair(true, h);
+			if(!p->write_count_since_fsync())
+			{
+				p->has_ever_been_fsynced=true;
+				return std::make_pair(true, h);
+			}
+			// Group commit: if an fsync is in flight we complete after the next one instead
+			submit_group_sync(id, h, h);
+			return std::make_pair(false, h);
+		}
+		// Called in unknown thread. Fsyncs h then completes op id with ret, unless an fsync of h is in flight
+		// in which case op id completes after the next one.
+		void submit_group_sync(size_t id, std::shared_ptr<detail::async_io_handle> h, std::shared_ptr<detail::async_io_handle> ret)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			if(!p->syncs.join(id, ret))
+				return;
+			off_t written=p->byteswritten;
+			auto o=make_op(id, ret, [this, p, h, ret, written](int res) -> completion_returntype {
+				if(res>=0)
+					p->synced(written);
+				submit_sync_group(h);
+				if(res<0) ERRGOSFN(-res, p->path());
+				return std::make_pair(true, ret);
+			});
+			++async_file_io_dispatcher_base::p->groupfsyncs;
+			ring->submit(io_uring_ring::prep(IORING_OP_FSYNC, p->fd, nullptr, 0, 0), std::move(o));
+		}
+		// Called in unknown thread. Submits one fsync on behalf of all the syncs which arrived during the last one, if any did.
+		void submit_sync_group(std::shared_ptr<detail::async_io_handle> h)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			sync_group::waiters_t waiters(p->syncs.next());
+			if(waiters.empty())
+				return;
+			off_t written=p->byteswritten;
+			io_uring_ring::op_ptr o(ring->allocate());
+			o->done=[this, p, h, waiters, written](int res) {
+				exception_ptr e;
+				if(res<0)
+				{
+					try { ERRGOSFN(-res, p->path()); }
+					catch(...) { e=async_io::make_exception_ptr(current_exception()); }
+				}
+				else
+					p->synced(written);
+				DEBUG_PRINT("S %u syncs shared one fsync of %p\n", (unsigned) waiters.size(), h.get());
+				for(auto &w : waiters)
+					complete_async_op(w.first, w.second, e);
+				submit_sync_group(h);
+			};
+			++async_file_io_dispatcher_base::p->groupfsyncs;
+			ring->submit(io_uring_ring::prep(IORING_OP_FSYNC, p->fd, nullptr, 0, 0), std::move(o));
+		}
+		// Called in unknown thread
+		completion_returntype dosyncrange(size_t id, std::shared_ptr<detail::async_io_handle> h, async_sync_op_req req)
+		{
+			if(sync_kind::Full==req.kind)
+				return dosync(id, h, req.precondition);
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			if(!p->write_count_since_fsync())
+				return std::make_pair(true, h);
+			bool isdata=sync_kind::Data==req.kind;
+			off_t written=p->byteswritten;
+			auto o=make_op(id, h, [p, h, written, isdata](int res) -> completion_returntype {
+				if(res<0) ERRGOSFN(-res, p->path());
+				if(isdata)
+					p->synced(written);
+				return std::make_pair(true, h);
+			});
+			io_uring_sqe sqe;
+			if(isdata)
+			{
+				sqe=io_uring_ring::prep(IORING_OP_FSYNC, p->fd, nullptr, 0, 0);
+				sqe.fsync_flags=IORING_FSYNC_DATASYNC;
+			}
+			else
+			{
+				sqe=io_uring_ring::prep(IORING_OP_SYNC_FILE_RANGE, p->fd, nullptr, (unsigned) req.length, req.offset);
+				sqe.sync_range_flags=sync_file_range_flags(req.kind);
+			}
+			ring->submit(sqe, std::move(o));
+			return std::make_pair(false, h);
 		}
 		// Called in unknown thread
 		completion_returntype doclose(size_t id, std::shared_ptr<detail::async_io_handle> h, async_io_op)
 		{
 			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			// Shared read only handles stay open for reuse
+			if(p->cached && filecache.release(h, p->cacheflags))
+				return std::make_pair(true, h);
+			if(p->readahead)
+				p->readahead->invalidate(true);
+			// Set by the linked fsync, if there is one, before the close completes
+			auto fsyncres=std::make_shared<int>(0);
+			auto o=make_op(id, h, [p, h, fsyncres](int res) -> completion_returntype {
+				if(-ECANCELED==res)
+				{
+					// The linked fsync failed, so the close never happened
+					ERRHOSFN(posix_close(p->fd), p->path());
+					p->fd=-1;
+					ERRGOSFN(*fsyncres<0 ? -*fsyncres : EIO, p->path());
+				}
+				if(res<0) ERRGOSFN(-res, p->path());
+				p->fd=-1;
+				return std::make_pair(true, h);
+			});
+			io_uring_sqe close=io_uring_ring::prep(IORING_OP_CLOSE, p->fd, nullptr, 0, 0);
 			if(p->autoflush && p->write_count_since_fsync())
-				ERRHOSFN(posix_fsync(p->fd), p->path());
-			ERRHOSFN(posix_close(p->fd), p->path());
-			p->fd=-1;
-			return std::make_pair(true, h);
+			{
+				// Link the flush to the close so the kernel runs them back to back. Their completions may be
+				// run by different workers in either order, so whichever comes second completes the close.
+				struct linked_t
+				{
+					std::atomic<int> pending;
+					int closeres;
+					io_uring_ring::op::done_t closedone;
+					linked_t() : pending(2), closeres(0) { }
+				};
+				auto linked=std::make_shared<linked_t>();
+				linked->closedone=std::move(o->done);
+				io_uring_ring::op_ptr fsyncop(ring->allocate());
+				fsyncop->done=[linked, fsyncres](int res) {
+					*fsyncres=res;
+					if(1==linked->pending.fetch_sub(1, std::memory_order_acq_rel))
+						linked->closedone(linked->closeres);
+				};
+				o->done=[linked](int res) {
+					linked->closeres=res;
+					if(1==linked->pending.fetch_sub(1, std::memory_order_acq_rel))
+						linked->closedone(linked->closeres);
+				};
+				io_uring_sqe sqes[2]={ io_uring_ring::prep(IORING_OP_FSYNC, p->fd, nullptr, 0, 0), close };
+				io_uring_ring::op_ptr ops[2]={ std::move(fsyncop), std::move(o) };
+				sqes[0].flags|=IOSQE_IO_LINK;
+				ring->submit(sqes, ops, 2);
+			}
+			else
+				ring->submit(close, std::move(o));
+			return std::make_pair(false, h);
 		}
 		// Called in unknown thread
 		completion_returntype doread(size_t id, std::shared_ptr<detail::async_io_handle> h, async_data_op_req<void> req)
 		{
 			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
-			ssize_t bytesread=0, bytestoread=0;
-			iovec v;
-			std::vector<iovec> vecs;
-			vecs.reserve(req.buffers.size());
+			if(p->readahead && do_readahead_serve(h, req))
+				return std::make_pair(true, h);
+			if(req.buffers.size()>IOV_MAX)
+				return post_blocking(id, h, [this, id, h, req] { return async_file_io_dispatcher_compat::doread(id, h, req); });
 			DEBUG_PRINT("R %u %p (%c) @ %u, b=%u\n", (unsigned) id, h.get(), p->path().native().back(), (unsigned) req.where, (unsigned) req.buffers.size());
-#ifdef DEBUG_PRINTING
-			for(auto &b : req.buffers)
-				DEBUG_PRINT("  R %u: %p %u\n", (unsigned) id, boost::asio::buffer_cast<const void *>(b), (unsigned) boost::asio::buffer_size(b));
-#endif
+			ssize_t bytestoread=0;
+			io_uring_ring::op_ptr o(ring->allocate());
+			o->vecs.reserve(req.buffers.size());
 			for(auto &b : req.buffers)
 			{
+				iovec v;
 				v.iov_base=boost::asio::buffer_cast<void *>(b);
 				v.iov_len=boost::asio::buffer_size(b);
 				bytestoread+=v.iov_len;
-				vecs.push_back(v);
+				o->vecs.push_back(v);
 			}
-			for(size_t n=0; n<vecs.size(); n+=IOV_MAX)
+			// Unaligned OSDirect reads need bouncing, which the compat backend does
+			if(p->blocksize && !p->is_block_aligned(o->vecs, req.where))
+				return post_blocking(id, h, [this, id, h, req] { return async_file_io_dispatcher_compat::doread(id, h, req); });
+			off_t where=req.where;
+			int bufindex=(1==o->vecs.size()) ? int_registered_buffers(o->vecs.front().iov_base, o->vecs.front().iov_len) : -1;
+			o->done=make_completion(id, h, [this, p, h, bytestoread, where](int res) -> completion_returntype {
+				if(res<0) ERRGOSFN(-res, p->path());
+				p->bytesread+=res;
+				if(res!=bytestoread)
+					throw std::runtime_error("Failed to read all buffers");
+				if(p->readahead)
+					do_readahead(h, where, bytestoread);
+				return std::make_pair(true, h);
+			});
+			io_uring_sqe sqe;
+			if(bufindex>=0)
 			{
-				ssize_t _bytesread;
-				ERRHOSFN((int) (_bytesread=preadv(p->fd, (&vecs.front())+n, std::min((int) (vecs.size()-n), IOV_MAX), req.where+bytesread)), p->path());
-				p->bytesread+=_bytesread;
-				bytesread+=_bytesread;
+				// The pages are already pinned, so the kernel needn't
+				sqe=io_uring_ring::prep(IORING_OP_READ_FIXED, p->fd, o->vecs.front().iov_base, (unsigned) o->vecs.front().iov_len, req.where);
+				sqe.buf_index=(__u16) bufindex;
 			}
-			if(bytesread!=bytestoread)
-				throw std::runtime_error("Failed to read all buffers");
-			return std::make_pair(true, h);
+			else
+				sqe=io_uring_ring::prep(IORING_OP_READV, p->fd, &o->vecs.front(), (unsigned) o->vecs.size(), req.where);
+			ring->submit(sqe, std::move(o));
+			// Indicate we're not finished yet
+			return std::make_pair(false, h);
 		}
 		// Called in unknown thread
 		completion_returntype dowrite(size_t id, std::shared_ptr<detail::async_io_handle> h, async_data_op_req<const void> req)
 		{
 			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
-			ssize_t byteswritten=0, bytestowrite=0;
-			iovec v;
-			std::vector<iovec> vecs;
-			vecs.reserve(req.buffers.size());
+			if(req.buffers.size()>IOV_MAX)
+				return post_blocking(id, h, [this, id, h, req] { return async_file_io_dispatcher_compat::dowrite(id, h, req); });
 			DEBUG_PRINT("W %u %p (%c) @ %u, b=%u\n", (unsigned) id, h.get(), p->path().native().back(), (unsigned) req.where, (unsigned) req.buffers.size());
-#ifdef DEBUG_PRINTING
-			for(auto &b : req.buffers)
-				DEBUG_PRINT("  W %u: %p %u\n", (unsigned) id, boost::asio::buffer_cast<const void *>(b), (unsigned) boost::asio::buffer_size(b));
-#endif
+			ssize_t bytestowrite=0;
+			io_uring_ring::op_ptr o(ring->allocate());
+			o->vecs.reserve(req.buffers.size());
 			for(auto &b : req.buffers)
 			{
+				iovec v;
 				v.iov_base=(void *) boost::asio::buffer_cast<const void *>(b);
 				v.iov_len=boost::asio::buffer_size(b);
 				bytestowrite+=v.iov_len;
-				vecs.push_back(v);
+				o->vecs.push_back(v);
 			}
-			for(size_t n=0; n<vecs.size(); n+=IOV_MAX)
+			if(p->blocksize && !p->is_block_aligned(o->vecs, req.where))
+				return post_blocking(id, h, [this, id, h, req] { return async_file_io_dispatcher_compat::dowrite(id, h, req); });
+			int bufindex=(1==o->vecs.size()) ? int_registered_buffers(o->vecs.front().iov_base, o->vecs.front().iov_len) : -1;
+			o->done=make_completion(id, h, [p, h, bytestowrite](int res) -> completion_returntype {
+				if(p->readahead)
+					p->readahead->invalidate();
+				if(res<0) ERRGOSFN(-res, p->path());
+				p->byteswritten+=res;
+				if(res!=bytestowrite)
+					throw std::runtime_error("Failed to write all buffers");
+				return std::make_pair(true, h);
+			});
+			io_uring_sqe sqe;
+			if(bufindex>=0)
 			{
-				ssize_t _byteswritten;
-				ERRHOSFN((int) (_byteswritten=pwritev(p->fd, (&vecs.front())+n, std::min((int) (vecs.size()-n), IOV_MAX), req.where+byteswritten)), p->path());
-				p->byteswritten+=_byteswritten;
-				byteswritten+=_byteswritten;
+				sqe=io_uring_ring::prep(IORING_OP_WRITE_FIXED, p->fd, o->vecs.front().iov_base, (unsigned) o->vecs.front().iov_len, req.where);
+				sqe.buf_index=(__u16) bufindex;
 			}
-			if(byteswritten!=bytestowrite)
-				throw std::runtime_error("Failed to write all buffers");
-			return std::make_pair(true, h);
+			else
+				sqe=io_uring_ring::prep(IORING_OP_WRITEV, p->fd, &o->vecs.front(), (unsigned) o->vecs.size(), req.where);
+			ring->submit(sqe, std::move(o));
+			// Indicate we're not finished yet
+			return std::make_pair(false, h);
 		}
 		// Called in unknown thread
 		completion_returntype dotruncate(size_t id, std::shared_ptr<detail::async_io_handle> h, off_t newsize)
 		{
 			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
 			DEBUG_PRINT("T %u %p (%c)\n", (unsigned) id, h.get(), p->path().native().back());
-			ERRHOSFN(posix_ftruncate(p->fd, newsize), p->path());
-			return std::make_pair(true, h);
+			auto o=make_op(id, h, [p, h](int res) -> completion_returntype {
+				if(p->readahead)
+					p->readahead->invalidate();
+				if(res<0) ERRGOSFN(-res, p->path());
+				return std::make_pair(true, h);
+			});
+			ring->submit(io_uring_ring::prep(io_uring_op_ftruncate, p->fd, nullptr, 0, newsize), std::move(o));
+			return std::make_pair(false, h);
 		}
-
+		// Called in unknown thread
+		completion_returntype dopreallocate(size_t id, std::shared_ptr<detail::async_io_handle> h, detail::preallocate_range r)
+		{
+			async_io_handle_posix *p=static_cast<async_io_handle_posix *>(h.get());
+			DEBUG_PRINT("P %u %p (%c)\n", (unsigned) id, h.get(), p->path().native().back());
+			auto o=make_op(id, h, [this, p, h, r](int res) -> completion_returntype {
+				auto unreadahead=NiallsCPP11Utilities::Undoer([p](){ if(p->readahead) p->readahead->invalidate(); });
+				if(-EOPNOTSUPP==res)
+					do_preallocate_emulated(p, r);
+				else if(res<0)
+					ERRGOSFN(-res, p->path());
+				else if(!!(r.mode & preallocate_flags::ZeroRange))
+					p->byteswritten+=r.length;
+				return std::make_pair(true, h);
+			});
+			// The length goes in the address field and the mode in the length field
+			ring->submit(io_uring_ring::prep(IORING_OP_FALLOCATE, p->fd, (const void *)(size_t) r.length, (unsigned) fallocate_mode(r.mode), r.offset), std::move(o));
+			return std::make_pair(false, h);
+		}
+#ifdef STATX_BASIC_STATS
+		// Called in unknown thread. Only stats of paths go through the ring, as fstat() of an open handle never blocks for long.
+		completion_returntype dostat(size_t id, std::shared_ptr<detail::async_io_handle> h, detail::stat_req r)
+		{
+			try
+			{
+				path_at at=resolve_path(h, r.req);
+				auto sx=std::make_shared<struct statx>();
+				std::filesystem::path abspath(at.abspath);
+				auto o=make_op(id, h, [h, r, sx, abspath](int res) -> completion_returntype {
+					try
+					{
+						if(res<0) ERRGOSFN(-res, abspath);
+						stat_t ret;
+						detail::fill_stat(ret, *sx);
+						r.result->set_value(std::move(ret));
+					}
+					catch(...)
+					{
+						r.result->set_exception(async_io::make_exception_ptr(current_exception()));
+						throw;
+					}
+					return std::make_pair(true, h);
+				});
+				o->path=at.path;
+				// The statx buffer goes in the offset field
+				io_uring_sqe sqe=io_uring_ring::prep(IORING_OP_STATX, at.dirfd, o->path.c_str(), detail::statx_mask(r.wanted), (unsigned long long)(size_t) sx.get());
+				sqe.statx_flags=AT_NO_AUTOMOUNT;
+				ring->submit(sqe, std::move(o));
+			}
+			catch(...)
+			{
+				r.result->set_exception(async_io::make_exception_ptr(current_exception()));
+				throw;
+			}
+			return std::make_pair(false, h);
+		}
+#endif
 
 	public:
-		async_file_io_dispatcher_compat(thread_pool &threadpool, file_flags flagsforce, file_flags flagsmask) : async_file_io_dispatcher_base(threadpool, flagsforce, flagsmask)
+		async_file_io_dispatcher_linux(thread_pool &threadpool, file_flags flagsforce, file_flags flagsmask) : async_file_io_dispatcher_compat(threadpool, flagsforce, flagsmask),
+			ring(std::make_shared<io_uring_ring>(threadpool.io_service(), IO_URING_QUEUE_DEPTH))
+		{
+			fixedbuffers=ring->register_buffer_table(BUFFER_POOL_ARENAS);
+			ring->arm();
+		}
+		~async_file_io_dispatcher_linux()
 		{
+			// Completions call into us, so they must all have arrived before we go away
+			int_wait_for_ops();
+			ring->stop();
 		}
 
+		virtual bool int_register_buffers(size_t idx, void *addr, size_t length)
+		{
+			return fixedbuffers && ring->register_buffer((unsigned) idx, addr, length);
+		}
 
+		virtual async_op_flags bind_batch_op(detail::batch_op_function &boundf, const async_batch_op_req &req)
+		{
+			switch(req.kind)
+			{
+			case async_batch_op_req::op_kind::dir:
+				if(!ring->supports(IORING_OP_MKDIRAT))
+					return async_file_io_dispatcher_compat::bind_batch_op(boundf, req);
+				bind_plan_op(boundf, &async_file_io_dispatcher_linux::dodir);
+				break;
+			case async_batch_op_req::op_kind::rmdir:
+				if(!ring->supports(IORING_OP_UNLINKAT))
+					return async_file_io_dispatcher_compat::bind_batch_op(boundf, req);
+				bind_plan_op(boundf, &async_file_io_dispatcher_linux::dormdir);
+				break;
+			case async_batch_op_req::op_kind::file:
+				if(!ring->supports(IORING_OP_OPENAT))
+					return async_file_io_dispatcher_compat::bind_batch_op(boundf, req);
+				bind_plan_op(boundf, &async_file_io_dispatcher_linux::dofile);
+				break;
+			case async_batch_op_req::op_kind::rmfile:
+				if(!ring->supports(IORING_OP_UNLINKAT))
+					return async_file_io_dispatcher_compat::bind_batch_op(boundf, req);
+				bind_plan_op(boundf, &async_file_io_dispatcher_linux::dormfile);
+				break;
+			case async_batch_op_req::op_kind::sync:
+				bind_plan_op(boundf, &async_file_io_dispatcher_linux::dosync);
+				break;
+			case async_batch_op_req::op_kind::close:
+				if(!ring->supports(IORING_OP_CLOSE))
+					return async_file_io_dispatcher_compat::bind_batch_op(boundf, req);
+				bind_plan_op(boundf, &async_file_io_dispatcher_linux::doclose);
+				break;
+			case async_batch_op_req::op_kind::read:
+				bind_plan_op(boundf, &async_file_io_dispatcher_linux::doread);
+				break;
+			case async_batch_op_req::op_kind::write:
+				bind_plan_op(boundf, &async_file_io_dispatcher_linux::dowrite);
+				break;
+			case async_batch_op_req::op_kind::truncate:
+				if(!ring->supports(io_uring_op_ftruncate))
+					return async_file_io_dispatcher_compat::bind_batch_op(boundf, req);
+				bind_plan_op(boundf, &async_file_io_dispatcher_linux::dotruncate);
+				break;
+			}
+			return async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion;
+		}
 		virtual std::vector<async_io_op> dir(const std::vector<async_path_op_req> &reqs)
 		{
+			if(!ring->supports(IORING_OP_MKDIRAT))
+				return async_file_io_dispatcher_compat::dir(reqs);
 #if TRIPLEGIT_VALIDATE_INPUTS
 			for(auto &i : reqs)
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::dir, reqs, async_op_flags::None, &async_file_io_dispatcher_compat::dodir);
+			return chain_async_ops((int) detail::OpType::dir, reqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::dodir);
 		}
 		virtual std::vector<async_io_op> rmdir(const std::vector<async_path_op_req> &reqs)
 		{
+			if(!ring->supports(IORING_OP_UNLINKAT))
+				return async_file_io_dispatcher_compat::rmdir(reqs);
 #if TRIPLEGIT_VALIDATE_INPUTS
 			for(auto &i : reqs)
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::rmdir, reqs, async_op_flags::None, &async_file_io_dispatcher_compat::dormdir);
+			return chain_async_ops((int) detail::OpType::rmdir, reqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::dormdir);
 		}
 		virtual std::vector<async_io_op> file(const std::vector<async_path_op_req> &reqs)
 		{
+			if(!ring->supports(IORING_OP_OPENAT))
+				return async_file_io_dispatcher_compat::file(reqs);
 #if TRIPLEGIT_VALIDATE_INPUTS
 			for(auto &i : reqs)
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::file, reqs, async_op_flags::None, &async_file_io_dispatcher_compat::dofile);
+			return chain_async_ops((int) detail::OpType::file, reqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::dofile);
 		}
 		virtual std::vector<async_io_op> rmfile(const std::vector<async_path_op_req> &reqs)
 		{
+			if(!ring->supports(IORING_OP_UNLINKAT))
+				return async_file_io_dispatcher_compat::rmfile(reqs);
 #if TRIPLEGIT_VALIDATE_INPUTS
 			for(auto &i : reqs)
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::rmfile, reqs, async_op_flags::None, &async_file_io_dispatcher_compat::dormfile);
+			return chain_async_ops((int) detail::OpType::rmfile, reqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::dormfile);
 		}
 		virtual std::vector<async_io_op> sync(const std::vector<async_io_op> &ops)
 		{
@@ -1258,16 +5791,34 @@ namespace detail {
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::sync, ops, async_op_flags::None, &async_file_io_dispatcher_compat::dosync);
+			return chain_async_ops((int) detail::OpType::sync, ops, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::dosync);
+		}
+		virtual std::vector<async_io_op> sync(const std::vector<async_sync_op_req> &reqs)
+		{
+			// The ring takes a 32 bit length for ranges
+			bool canring=ring->supports(IORING_OP_SYNC_FILE_RANGE);
+			for(auto &i : reqs)
+				if(i.length>UINT_MAX)
+					canring=false;
+			if(!canring)
+				return async_file_io_dispatcher_compat::sync(reqs);
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::sync, detail::sync_preconditions(reqs), reqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::dosyncrange);
 		}
 		virtual std::vector<async_io_op> close(const std::vector<async_io_op> &ops)
 		{
+			if(!ring->supports(IORING_OP_CLOSE))
+				return async_file_io_dispatcher_compat::close(ops);
 #if TRIPLEGIT_VALIDATE_INPUTS
 			for(auto &i : ops)
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::close, ops, async_op_flags::None, &async_file_io_dispatcher_compat::doclose);
+			return chain_async_ops((int) detail::OpType::close, ops, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::doclose);
 		}
 		virtual std::vector<async_io_op> read(const std::vector<async_data_op_req<void>> &reqs)
 		{
@@ -1276,7 +5827,7 @@ namespace detail {
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::read, reqs, async_op_flags::None, &async_file_io_dispatcher_compat::doread);
+			return chain_async_ops((int) detail::OpType::read, reqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::doread);
 		}
 		virtual std::vector<async_io_op> write(const std::vector<async_data_op_req<const void>> &reqs)
 		{
@@ -1285,18 +5836,52 @@ namespace detail {
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::write, reqs, async_op_flags::None, &async_file_io_dispatcher_compat::dowrite);
+			return chain_coalesced_writes(reqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::dowrite);
 		}
 		virtual std::vector<async_io_op> truncate(const std::vector<async_io_op> &ops, const std::vector<off_t> &sizes)
 		{
+			if(!ring->supports(io_uring_op_ftruncate))
+				return async_file_io_dispatcher_compat::truncate(ops, sizes);
 #if TRIPLEGIT_VALIDATE_INPUTS
 			for(auto &i : ops)
 				if(!i.validate())
 					throw std::runtime_error("Inputs are invalid.");
 #endif
-			return chain_async_ops((int) detail::OpType::truncate, ops, sizes, async_op_flags::None, &async_file_io_dispatcher_compat::dotruncate);
+			return chain_async_ops((int) detail::OpType::truncate, ops, sizes, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::dotruncate);
+		}
+		virtual std::vector<async_io_op> preallocate(const std::vector<async_io_op> &ops, const std::vector<off_t> &offsets, const std::vector<off_t> &lengths, preallocate_flags mode)
+		{
+			if(!ring->supports(IORING_OP_FALLOCATE))
+				return async_file_io_dispatcher_compat::preallocate(ops, offsets, lengths, mode);
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : ops)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+			for(auto &i : lengths)
+				if(!i)
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			return chain_async_ops((int) detail::OpType::preallocate, ops, detail::make_preallocate_ranges(ops, offsets, lengths, mode), async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::dopreallocate);
 		}
+#ifdef STATX_BASIC_STATS
+		virtual std::pair<std::vector<future<stat_t>>, std::vector<async_io_op>> stat(const std::vector<async_path_op_req> &reqs, metadata_flags wanted)
+		{
+			if(!ring->supports(IORING_OP_STATX))
+				return async_file_io_dispatcher_compat::stat(reqs, wanted);
+#if TRIPLEGIT_VALIDATE_INPUTS
+			for(auto &i : reqs)
+				if(!i.validate())
+					throw std::runtime_error("Inputs are invalid.");
+#endif
+			std::vector<detail::stat_req> statreqs;
+			std::vector<async_io_op> preconditions;
+			auto ret(detail::make_stat_reqs(statreqs, preconditions, reqs, wanted));
+			return std::make_pair(std::move(ret), chain_async_ops((int) detail::OpType::stat, preconditions, statreqs, async_op_flags::DetachedFuture|async_op_flags::ImmediateCompletion, &async_file_io_dispatcher_linux::dostat));
+		}
+		using async_file_io_dispatcher_compat::stat;
+#endif
 	};
+#endif
 }
 
 std::shared_ptr<async_file_io_dispatcher_base> async_file_io_dispatcher(thread_pool &threadpool, file_flags flagsforce, file_flags flagsmask)
@@ -1304,6 +5889,16 @@ std::shared_ptr<async_file_io_dispatcher_base> async_file_io_dispatcher(thread_p
 #if defined(WIN32) && !defined(USE_POSIX_ON_WIN32)
 	return std::make_shared<detail::async_file_io_dispatcher_windows>(threadpool, flagsforce, flagsmask);
 #else
+#if defined(__linux__) && !defined(USE_POSIX_ON_LINUX)
+	// io_uring may be missing from the kernel or disabled by policy, in which case fall back to compat
+	try
+	{
+		return std::make_shared<detail::async_file_io_dispatcher_linux>(threadpool, flagsforce, flagsmask);
+	}
+	catch(const std::exception &)
+	{
+	}
+#endif
 	return std::make_shared<detail::async_file_io_dispatcher_compat>(threadpool, flagsforce, flagsmask);
 #endif
 }